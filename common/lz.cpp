@@ -0,0 +1,219 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lz.h"
+
+#include <string.h>
+#include <math.h>
+
+/*
+ * Format is a list of sequences. Each one is a token byte (high nibble is
+ * literal count, low nibble is match length minus 4; value 15 means that
+ * more length bytes follow, each adding up to 255), literals, 16bit
+ * little-endian match offset and the rest of match length. Last sequence
+ * has literals only.
+ *
+ * Hash table keeps positions of last seen 4-byte strings. It's never
+ * cleared; stale entries from previous packets either point after the
+ * current position, or just fail the comparison.
+ */
+
+#define lz_min_match 4
+#define lz_max_offset 0xffff
+#define lz_hash_bits 12
+
+static uint32_t table[1 << lz_hash_bits];
+
+static inline uint32_t read32 (const uint8_t*p)
+{
+	uint32_t v;
+	memcpy (&v, p, 4);
+	return v;
+}
+
+static inline uint32_t hash (uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - lz_hash_bits);
+}
+
+static inline uint8_t* put_length (uint8_t*op, size_t l)
+{
+	while (l >= 255) {
+		*op++ = 255;
+		l -= 255;
+	}
+	*op++ = (uint8_t) l;
+	return op;
+}
+
+static uint8_t* put_sequence (uint8_t*op, uint8_t*oend,
+                              const uint8_t*lit, size_t litlen,
+                              size_t offset, size_t matchlen)
+{
+	size_t need = 1 + litlen + litlen / 255 + 1 + 2 + matchlen / 255 + 1;
+	if ( (size_t) (oend - op) < need) return 0;
+
+	uint8_t*token = op++;
+	uint8_t t;
+
+	if (litlen >= 15) {
+		t = 15 << 4;
+		op = put_length (op, litlen - 15);
+	} else t = litlen << 4;
+	memcpy (op, lit, litlen);
+	op += litlen;
+
+	if (matchlen) {
+		*op++ = (uint8_t) offset;
+		*op++ = (uint8_t) (offset >> 8);
+		matchlen -= lz_min_match;
+		if (matchlen >= 15) {
+			t |= 15;
+			op = put_length (op, matchlen - 15);
+		} else t |= matchlen;
+	}
+	*token = t;
+	return op;
+}
+
+size_t lz_compress (const uint8_t*src, size_t size,
+                    uint8_t*dst, size_t max)
+{
+	const uint8_t*ip = src, *anchor = src, *end = src + size, *m;
+	const uint8_t*limit = (size > lz_min_match) ? end - lz_min_match : src;
+	uint8_t*op = dst, *oend = dst + max;
+	uint32_t h, cand, pos;
+	size_t misses = 0, ml;
+
+	while (ip < limit) {
+		pos = ip - src;
+		h = hash (read32 (ip) );
+		cand = table[h];
+		table[h] = pos;
+		m = src + cand;
+
+		if ( (cand >= pos) || (pos - cand > lz_max_offset)
+		        || (read32 (m) != read32 (ip) ) ) {
+			//go faster through the stuff that doesn't match
+			ip += 1 + (misses++ >> 5);
+			continue;
+		}
+		misses = 0;
+
+		for (ml = lz_min_match; (ip + ml < end) && (m[ml] == ip[ml]); ++ml);
+
+		op = put_sequence (op, oend, anchor, ip - anchor, ip - m, ml);
+		if (!op) return 0;
+		ip += ml;
+		anchor = ip;
+	}
+
+	op = put_sequence (op, oend, anchor, end - anchor, 0, 0);
+	if (!op) return 0;
+	return op - dst;
+}
+
+static inline bool get_length (const uint8_t*&ip, const uint8_t*iend,
+                               size_t&len)
+{
+	uint8_t b;
+	do {
+		if (ip >= iend) return false;
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+bool lz_decompress (const uint8_t*src, size_t srcsize,
+                    uint8_t*dst, size_t size)
+{
+	const uint8_t*ip = src, *iend = src + srcsize, *m;
+	uint8_t*op = dst, *oend = dst + size;
+	size_t len, off;
+	uint8_t t;
+
+	while (ip < iend) {
+		t = *ip++;
+
+		len = t >> 4;
+		if ( (len == 15) && !get_length (ip, iend, len) ) return false;
+		if ( (len > (size_t) (iend - ip) ) || (len > (size_t) (oend - op) ) )
+			return false;
+		memcpy (op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip == iend) break; //last sequence
+
+		if (iend - ip < 2) return false;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!off || (off > (size_t) (op - dst) ) ) return false;
+
+		len = t & 15;
+		if ( (len == 15) && !get_length (ip, iend, len) ) return false;
+		len += lz_min_match;
+		if (len > (size_t) (oend - op) ) return false;
+
+		//may overlap, byte by byte
+		for (m = op - off; len; --len) *op++ = *m++;
+	}
+
+	return op == oend;
+}
+
+#define lz_entropy_sample 512
+
+float lz_entropy (const uint8_t*data, size_t size)
+{
+	unsigned int count[256];
+	size_t i, n, stride;
+	float e = 0, p;
+
+	if (!size) return 0;
+	n = (size > lz_entropy_sample) ? lz_entropy_sample : size;
+	stride = size / n;
+
+	memset (count, 0, sizeof (count) );
+	for (i = 0;i < n;++i) ++count[data[i*stride]];
+
+	for (i = 0;i < 256;++i) if (count[i]) {
+			p = (float) count[i] / n;
+			e -= p * log2f (p);
+		}
+	return e;
+}
+
+/*
+ * Expected value of the above for uniformly random bytes: every count is
+ * binomial with p=1/256, so it is 256 times the expected -p*log2(p) of one
+ * of them. Computed once for every sample size.
+ */
+
+float lz_entropy_random (size_t size)
+{
+	static float cache[lz_entropy_sample + 1];
+	size_t n = (size > lz_entropy_sample) ? lz_entropy_sample : size;
+	double pc, e = 0, q = 1.0 / 256;
+
+	if (n < 2) return 0;
+	if (cache[n] > 0) return cache[n];
+
+	pc = pow (1 - q, (double) n); //probability of count 0
+	for (size_t c = 1;c <= n;++c) {
+		pc *= (double) (n - c + 1) / c * q / (1 - q);
+		e -= pc * c / n * log2 ( (double) c / n);
+	}
+	return cache[n] = (float) (256 * e);
+}
+
@@ -15,15 +15,21 @@
 #include "log.h"
 #include "conf.h"
 #include "security.h"
+#include "sq.h"
+#include "zerocopy.h"
 
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifndef __WIN32__
+#include <sys/poll.h>
+#endif
 
 
 static bool tcp_nodelay = false;
+static bool tcp_fastopen = false;
 static int ip_tos = 0;
 static int listen_backlog_size = 32;
 
@@ -39,6 +45,16 @@ bool sock_nonblock (int fd)
 
 int tcp_socket_writeable (int sock)
 {
+#ifndef __WIN32__
+	//poll() works with descriptors past FD_SETSIZE. Errors count too,
+	//those are picked up by sock_get_error.
+	struct pollfd f;
+	f.fd = sock;
+	f.events = POLLOUT;
+	f.revents = 0;
+	if (poll (&f, 1, 0) <= 0) return 0;
+	return (f.revents & (POLLOUT | POLLERR | POLLHUP) ) ? 1 : 0;
+#else
 	fd_set s;
 	struct timeval t = {0, 0};
 	FD_ZERO (&s);
@@ -46,6 +62,7 @@ int tcp_socket_writeable (int sock)
 	select (sock + 1, 0, &s, 0, &t);
 	if (FD_ISSET (sock, &s) ) return 1;
 	return 0;
+#endif
 }
 
 int network_init()
@@ -53,6 +70,8 @@ int network_init()
 #ifndef __WIN32__
 	tcp_nodelay = config_is_true ("tcp_nodelay");
 	if (tcp_nodelay) Log_info ("TCP_NODELAY is set for all sockets");
+	tcp_fastopen = config_is_true ("tcp_fastopen");
+	if (tcp_fastopen) Log_info ("using TCP fast open where possible");
 	string t;
 	if (!config_get ("ip_tos", t) ) goto no_tos;
 	if (t == "lowdelay") ip_tos = IPTOS_LOWDELAY;
@@ -69,6 +88,7 @@ no_tos:
 	if (config_get_int ("listen_backlog", i) ) listen_backlog_size = i;
 	Log_info ("listen backlog size is %d", listen_backlog_size);
 
+	zerocopy_init();
 	return 0;
 }
 
@@ -145,6 +165,15 @@ int tcp_listen_socket (const char* addr)
 		return -5;
 	}
 
+#ifdef TCP_FASTOPEN
+	if (tcp_fastopen && (domain != AF_UNIX) ) {
+		opt = listen_backlog_size;
+		if (setsockopt (s, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof (opt) ) )
+			Log_warn ("setsockopt(%d,TCP,FASTOPEN) failed with %d: %s",
+			          s, errno, strerror (errno) );
+	}
+#endif
+
 	Log_info ("created listening socket %d", s);
 
 	return s;
@@ -174,6 +203,20 @@ int tcp_connect_socket (const char*addr)
 
 	sockoptions_set (s);
 
+	/*
+	 * With fast open, connect() only remembers the address, and the SYN
+	 * leaves together with the first data (TLS hello).
+	 */
+
+#ifdef TCP_FASTOPEN_CONNECT
+	int opt = 1;
+	if (tcp_fastopen && (domain != AF_UNIX)
+	        && setsockopt (s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+	                       &opt, sizeof (opt) ) )
+		Log_warn ("setsockopt(%d,TCP,FASTOPEN_CONNECT) failed with %d: %s",
+		          s, errno, strerror (errno) );
+#endif
+
 	if (connect (s, & (sa.sa), sa_len) < 0) {
 		int e = errno;
 		if ( e && (e != EINPROGRESS)
@@ -201,6 +244,135 @@ int tcp_connect_socket (const char*addr)
 	return s;
 }
 
+/*
+ * Datagram sockets. Every peer of a datagram listener gets its own socket,
+ * bound to the same local address and connected to the peer, so that the
+ * kernel does the demultiplexing and each connection can have its own fd.
+ */
+
+static int udp_reuse (int s)
+{
+	int opt = 1;
+	if (setsockopt (s, SOL_SOCKET, SO_REUSEADDR,
+#ifdef __WIN32__
+	                (const char*)
+#endif
+	                &opt, sizeof (opt) ) < 0) return -1;
+#ifdef SO_REUSEPORT
+	if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt) ) < 0)
+		return -1;
+#endif
+	return 0;
+}
+
+int udp_listen_socket (const char* addr)
+{
+	sockaddr_type sa;
+	int sa_len, domain;
+	if (!sockaddr_from_str (addr, & (sa.sa), &sa_len, &domain) ) {
+		Log_error ("could not resolve address and port `%s'", addr);
+		return -1;
+	}
+
+	int s = socket (domain, SOCK_DGRAM, 0);
+
+	if (s < 0) {
+		Log_error ("socket() failed with %d: %s",  errno, strerror (errno) );
+		return -2;
+	}
+
+	if (udp_reuse (s) )
+		Log_warn ("can't set address reuse on socket %d, "
+		          "datagram peers won't get own sockets", s);
+
+	if (!sock_nonblock (s) ) {
+		Log_error ("can't set socket %d to nonblocking mode", s);
+		close (s);
+		return -3;
+	}
+
+	if (bind (s, & (sa.sa), sa_len) ) {
+		Log_error ("binding socket %d failed with %d: %s", s, errno, strerror (errno) );
+		close (s);
+		return -4;
+	}
+
+	sockoptions_set (s);
+
+	Log_info ("created datagram listening socket %d", s);
+
+	return s;
+}
+
+int udp_connect_socket (const char*addr)
+{
+	sockaddr_type sa;
+	int sa_len, domain;
+	if (!sockaddr_from_str (addr, & (sa.sa), &sa_len, &domain) ) {
+		Log_error ("could not resolve address and port `%s'", addr);
+		return -1;
+	}
+
+	int s = socket (domain, SOCK_DGRAM, 0);
+
+	if (s < 0) {
+		Log_error ("socket() failed with %d: %s", errno, strerror (errno) );
+		return -2;
+	}
+
+	if (!sock_nonblock (s) ) {
+		Log_error ("can't set socket %d to nonblocking mode", s);
+		close (s);
+		return -3;
+	}
+
+	sockoptions_set (s);
+
+	if (connect (s, & (sa.sa), sa_len) < 0) {
+		Log_error ("connect(%d) to `%s' failed with %d", s, addr, errno);
+		close (s);
+		return -4;
+	}
+
+	return s;
+}
+
+int udp_peer_socket (int listener, struct sockaddr*peer, int peer_len)
+{
+	sockaddr_type sa;
+	socklen_t sa_len = sizeof (sockaddr_type);
+
+	if (getsockname (listener, & (sa.sa), &sa_len) ) {
+		Log_error ("getsockname(%d) failed with %d: %s",
+		           listener, errno, strerror (errno) );
+		return -1;
+	}
+
+	int s = socket (sa.sa.sa_family, SOCK_DGRAM, 0);
+
+	if (s < 0) {
+		Log_error ("socket() failed with %d: %s", errno, strerror (errno) );
+		return -2;
+	}
+
+	if (udp_reuse (s) || !sock_nonblock (s) ) {
+		Log_error ("can't set up datagram peer socket %d", s);
+		close (s);
+		return -3;
+	}
+
+	sockoptions_set (s);
+
+	if (bind (s, & (sa.sa), sa_len) || connect (s, peer, peer_len) ) {
+		Log_error ("binding datagram peer socket %d failed with %d: %s",
+		           s, errno, strerror (errno) );
+		close (s);
+		return -4;
+	}
+
+	return s;
+}
+
 int tcp_close_socket (int sock, bool do_unlink)
 {
 #ifndef __WIN32__
@@ -326,6 +498,46 @@ int sock_get_error (int fd)
 	return -e;
 }
 
+/*
+ * sends as much of the queue as the socket takes, up to max bytes, in a
+ * single call. Win32 has no sendmsg, so it goes segment by segment, and
+ * ignores the extra flags.
+ */
+
+#define send_iov_max 64
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 //there's the SIGPIPE handler anyway
+#endif
+
+int sock_send_queue (int fd, sgqueue&q, size_t max, int flags)
+{
+	deque<sgqueue::segment>::iterator i, e;
+#ifndef __WIN32__
+	struct iovec iov[send_iov_max];
+	struct msghdr msg;
+	size_t total = 0;
+	int n = 0;
+
+	for (i = q.segs.begin(), e = q.segs.end();
+	        (i != e) && (n < send_iov_max) && (total < max);++i, ++n) {
+		iov[n].iov_base = i->data;
+		iov[n].iov_len = (i->len > max - total) ? max - total : i->len;
+		total += iov[n].iov_len;
+	}
+
+	memset (&msg, 0, sizeof (msg) );
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	return sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | flags);
+#else
+	i = q.segs.begin();
+	if (i == q.segs.end() ) return 0;
+	return send (fd, (const char*) i->data,
+	             (i->len > max) ? max : i->len, 0);
+#endif
+}
+
 
 #ifdef __WIN32__
 //WSA initializator
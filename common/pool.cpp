@@ -0,0 +1,280 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+#define LOGNAME "common/pool"
+#include "log.h"
+#include "conf.h"
+#include "timestamp.h"
+
+#include <stdio.h>
+
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+
+/*
+ * Classes below slab size share 2MiB slabs, which are never returned
+ * (there's only a handful of them per class, and untouched parts of slab
+ * don't take any real memory). Larger classes map every item separately,
+ * in its own size rounded to pages (so a ring with a bit of overflow area
+ * doesn't take twice its size), and keep only few freed items around, so
+ * that the RSS really goes down after a burst. A freed large item
+ * remembers its size right after the free list link.
+ */
+
+#define pool_slab_shift 21
+#define pool_slab_size (1<<pool_slab_shift)
+#define pool_large_keep 2
+#define pool_page_size 4096
+
+static pool_class classes[pool_max_shift+1];
+
+static size_t used_bytes = 0;
+static size_t budget = 0; //0 = unlimited
+static bool hugepages = false;
+static uint64_t failures = 0;
+static int trim_interval = 30000000;
+static uint64_t last_trim = 0;
+
+static int class_shift (size_t size)
+{
+	int s = pool_min_shift;
+	while ( (s <= pool_max_shift) && ( ( (size_t) 1 << s) < size) ) ++s;
+	return s;
+}
+
+size_t pool_item_size (size_t size)
+{
+	int s = class_shift (size);
+	if (s < pool_slab_shift) return (size_t) 1 << s;
+	return (size + pool_page_size - 1) & ~ (size_t) (pool_page_size - 1);
+}
+
+static inline size_t& large_size (void*p)
+{
+	return ( (size_t*) p) [1];
+}
+
+/*
+ * system memory
+ */
+
+static void* os_alloc (size_t size, bool budgeted)
+{
+	if (budgeted && budget && (used_bytes + size > budget) )
+		return 0;
+
+	void*p;
+#ifndef __WIN32__
+	p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (hugepages && ! (size & (pool_slab_size - 1) ) )
+		p = mmap (0, size, PROT_READ | PROT_WRITE,
+		          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap (0, size, PROT_READ | PROT_WRITE,
+		          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+		if (hugepages) madvise (p, size, MADV_HUGEPAGE);
+#endif
+	}
+#else
+	p = new uint8_t[size];
+#endif
+	used_bytes += size;
+	return p;
+}
+
+static void os_free (void*p, size_t size)
+{
+#ifndef __WIN32__
+	munmap (p, size);
+#else
+	delete[] (uint8_t*) p;
+#endif
+	used_bytes -= size;
+}
+
+/*
+ * allocator
+ */
+
+void* pool_alloc (size_t size, bool budgeted)
+{
+	int s = class_shift (size);
+	if (s > pool_max_shift) {
+		++failures;
+		return 0;
+	}
+
+	pool_class&c = classes[s];
+	size_t sz = pool_item_size (size);
+	void*p, **i;
+
+	if (s >= pool_slab_shift) {
+		for (i = &c.free_list; *i; i = (void**) *i)
+			if (large_size (*i) == sz) break;
+	} else i = &c.free_list;
+
+	if (*i) {
+		p = *i;
+		*i = * (void**) p;
+		++c.hits;
+		++c.used;
+		return p;
+	}
+
+	if (c.clean_list) {
+		p = c.clean_list;
+		c.clean_list = * (void**) p;
+		++c.hits;
+		++c.used;
+		return p;
+	}
+
+	if (s >= pool_slab_shift) p = os_alloc (sz, budgeted);
+	else {
+		if (c.slab_pos == c.slab_end) {
+			c.slab_pos = (uint8_t*) os_alloc (pool_slab_size, budgeted);
+			c.slab_end = c.slab_pos ? c.slab_pos + pool_slab_size : 0;
+		}
+		p = c.slab_pos;
+		if (p) c.slab_pos += sz;
+	}
+
+	if (!p) {
+		++failures;
+		return 0;
+	}
+
+	++c.misses;
+	++c.used;
+	++c.total;
+	return p;
+}
+
+void pool_free (void*p, size_t size)
+{
+	if (!p) return;
+	int s = class_shift (size);
+	if (s > pool_max_shift) return; //never allocated here
+
+	pool_class&c = classes[s];
+	--c.used;
+
+	if (s >= pool_slab_shift) {
+		if (c.total - c.used > pool_large_keep) {
+			os_free (p, pool_item_size (size) );
+			--c.total;
+			return;
+		}
+		large_size (p) = pool_item_size (size);
+	}
+
+	* (void**) p = c.free_list;
+	c.free_list = p;
+}
+
+/*
+ * Trimming gives the pages of items that stay free back to the system.
+ * The first page of each slab item is kept, as it holds the free list
+ * link; large items are unmapped completely. Slabs that came from
+ * MAP_HUGETLB can't be trimmed in parts (madvise fails with EINVAL),
+ * their items stay on the free list.
+ */
+
+static void trim_class (int s)
+{
+	pool_class&c = classes[s];
+	size_t sz = (size_t) 1 << s;
+	void*p, *keep = 0;
+
+	while ( (p = c.free_list) ) {
+		c.free_list = * (void**) p;
+		if (s >= pool_slab_shift) {
+			os_free (p, large_size (p) );
+			--c.total;
+			continue;
+		}
+#if !defined(__WIN32__) && defined(MADV_DONTNEED)
+		if (madvise ( (uint8_t*) p + pool_page_size,
+		              sz - pool_page_size, MADV_DONTNEED) ) {
+			* (void**) p = keep;
+			keep = p;
+			continue;
+		}
+#endif
+		* (void**) p = c.clean_list;
+		c.clean_list = p;
+	}
+	c.free_list = keep;
+}
+
+void pool_periodic_update()
+{
+	if (timestamp() - last_trim < (uint64_t) trim_interval) return;
+	last_trim = timestamp();
+
+	for (int i = pool_max_shift;i > pool_min_shift;--i) {
+		if ( ( (size_t) 1 << i) < 2 * pool_page_size) break;
+		trim_class (i);
+	}
+}
+
+/*
+ * stats & init
+ */
+
+pool_class& pool_get_class (int shift)
+{
+	return classes[shift];
+}
+
+size_t pool_used_bytes()
+{
+	return used_bytes;
+}
+
+size_t pool_budget_bytes()
+{
+	return budget;
+}
+
+uint64_t pool_failures()
+{
+	return failures;
+}
+
+void pool_init()
+{
+	string t;
+	unsigned long long b;
+	budget = 0;
+	if (config_get ("pool_budget", t) ) {
+		if (t.find ('-') != string::npos ||
+		    1 != sscanf (t.c_str(), "%llu", &b) )
+			Log_error ("invalid pool_budget `%s', using no budget",
+			           t.c_str() );
+		else budget = (size_t) b;
+	}
+	if (budget) Log_info ("buffer memory budget is %llu bytes",
+	                          (unsigned long long) budget);
+
+	config_get_int ("buffer_idle_time", trim_interval);
+
+	hugepages = config_is_true ("pool_hugepages");
+	if (hugepages) Log_info ("trying to use huge pages for buffers");
+}
+
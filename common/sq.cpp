@@ -14,17 +14,31 @@
 #define LOGNAME "common/sq"
 #include "log.h"
 #include "conf.h"
+#include "pool.h"
+#include "timestamp.h"
 
 
 /*
  * as the standard library doesnt seem to have a function with determinable
  * copying direction, we have this. No idea why bcopy() is marked deprecated.
  *
- * also: TURN OPTIMIZATION ON, everyone!
- * This WILL copy ALL your data, so we need it at least equal to assembler.
+ * This WILL copy ALL your data (every forwarded packet goes through here at
+ * least once), so there are several engines. The best one for the CPU is
+ * selected on the first call. All of them copy forward if dst<src and
+ * backward otherwise, so overlapping areas are handled the same way bcopy()
+ * would handle them. Note that vector engines always load a whole block
+ * before storing it, which keeps them overlap-safe too.
  */
 
-void sq_memcpy (uint8_t*dst, const uint8_t*src, size_t size)
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+	&& !defined(CVPN_NO_SIMD)
+#define SQ_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+static void sq_copy_tail (uint8_t*dst, const uint8_t*src, size_t size)
 {
 	uint8_t*t;
 	if (dst < src) {
@@ -46,6 +60,189 @@ void sq_memcpy (uint8_t*dst, const uint8_t*src, size_t size)
 	}
 }
 
+static void sq_copy_scalar (uint8_t*dst, const uint8_t*src, size_t size)
+{
+	unsigned long w;
+	if (dst < src) {
+		for (;size >= sizeof (w);size -= sizeof (w) ) {
+			memcpy (&w, src, sizeof (w) );
+			memcpy (dst, &w, sizeof (w) );
+			dst += sizeof (w);
+			src += sizeof (w);
+		}
+	} else {
+		dst += size;
+		src += size;
+		for (;size >= sizeof (w);size -= sizeof (w) ) {
+			dst -= sizeof (w);
+			src -= sizeof (w);
+			memcpy (&w, src, sizeof (w) );
+			memcpy (dst, &w, sizeof (w) );
+		}
+		dst -= size;
+		src -= size;
+	}
+	sq_copy_tail (dst, src, size);
+}
+
+#ifdef SQ_X86_SIMD
+
+__attribute__ ( (target ("sse2") ) )
+static void sq_copy_sse2 (uint8_t*dst, const uint8_t*src, size_t size)
+{
+	__m128i a, b, c, d;
+	if (dst < src) {
+		for (;size >= 64;size -= 64, dst += 64, src += 64) {
+			a = _mm_loadu_si128 ( (const __m128i*) src);
+			b = _mm_loadu_si128 ( (const __m128i*) (src + 16) );
+			c = _mm_loadu_si128 ( (const __m128i*) (src + 32) );
+			d = _mm_loadu_si128 ( (const __m128i*) (src + 48) );
+			_mm_storeu_si128 ( (__m128i*) dst, a);
+			_mm_storeu_si128 ( (__m128i*) (dst + 16), b);
+			_mm_storeu_si128 ( (__m128i*) (dst + 32), c);
+			_mm_storeu_si128 ( (__m128i*) (dst + 48), d);
+		}
+		for (;size >= 16;size -= 16, dst += 16, src += 16)
+			_mm_storeu_si128 ( (__m128i*) dst,
+			                   _mm_loadu_si128 ( (const __m128i*) src) );
+	} else {
+		dst += size;
+		src += size;
+		for (;size >= 64;size -= 64) {
+			dst -= 64;
+			src -= 64;
+			a = _mm_loadu_si128 ( (const __m128i*) src);
+			b = _mm_loadu_si128 ( (const __m128i*) (src + 16) );
+			c = _mm_loadu_si128 ( (const __m128i*) (src + 32) );
+			d = _mm_loadu_si128 ( (const __m128i*) (src + 48) );
+			_mm_storeu_si128 ( (__m128i*) dst, a);
+			_mm_storeu_si128 ( (__m128i*) (dst + 16), b);
+			_mm_storeu_si128 ( (__m128i*) (dst + 32), c);
+			_mm_storeu_si128 ( (__m128i*) (dst + 48), d);
+		}
+		for (;size >= 16;size -= 16) {
+			dst -= 16;
+			src -= 16;
+			_mm_storeu_si128 ( (__m128i*) dst,
+			                   _mm_loadu_si128 ( (const __m128i*) src) );
+		}
+		dst -= size;
+		src -= size;
+	}
+	sq_copy_tail (dst, src, size);
+}
+
+__attribute__ ( (target ("avx2") ) )
+static void sq_copy_avx2 (uint8_t*dst, const uint8_t*src, size_t size)
+{
+	__m256i a, b, c, d;
+	if (dst < src) {
+		for (;size >= 128;size -= 128, dst += 128, src += 128) {
+			a = _mm256_loadu_si256 ( (const __m256i*) src);
+			b = _mm256_loadu_si256 ( (const __m256i*) (src + 32) );
+			c = _mm256_loadu_si256 ( (const __m256i*) (src + 64) );
+			d = _mm256_loadu_si256 ( (const __m256i*) (src + 96) );
+			_mm256_storeu_si256 ( (__m256i*) dst, a);
+			_mm256_storeu_si256 ( (__m256i*) (dst + 32), b);
+			_mm256_storeu_si256 ( (__m256i*) (dst + 64), c);
+			_mm256_storeu_si256 ( (__m256i*) (dst + 96), d);
+		}
+		for (;size >= 32;size -= 32, dst += 32, src += 32)
+			_mm256_storeu_si256 ( (__m256i*) dst,
+			                      _mm256_loadu_si256 ( (const __m256i*) src) );
+	} else {
+		dst += size;
+		src += size;
+		for (;size >= 128;size -= 128) {
+			dst -= 128;
+			src -= 128;
+			a = _mm256_loadu_si256 ( (const __m256i*) src);
+			b = _mm256_loadu_si256 ( (const __m256i*) (src + 32) );
+			c = _mm256_loadu_si256 ( (const __m256i*) (src + 64) );
+			d = _mm256_loadu_si256 ( (const __m256i*) (src + 96) );
+			_mm256_storeu_si256 ( (__m256i*) dst, a);
+			_mm256_storeu_si256 ( (__m256i*) (dst + 32), b);
+			_mm256_storeu_si256 ( (__m256i*) (dst + 64), c);
+			_mm256_storeu_si256 ( (__m256i*) (dst + 96), d);
+		}
+		for (;size >= 32;size -= 32) {
+			dst -= 32;
+			src -= 32;
+			_mm256_storeu_si256 ( (__m256i*) dst,
+			                      _mm256_loadu_si256 ( (const __m256i*) src) );
+		}
+		dst -= size;
+		src -= size;
+	}
+	_mm256_zeroupper();
+	sq_copy_tail (dst, src, size);
+}
+
+#endif //SQ_X86_SIMD
+
+/*
+ * engine selection. This must work even before main(), because some
+ * static objects (addresses) get copied from their constructors, therefore
+ * the pointer starts at the resolver, which replaces itself on first use.
+ */
+
+static void sq_copy_resolve (uint8_t*, const uint8_t*, size_t);
+
+static sq_copy_func sq_copy = sq_copy_resolve;
+static const char* sq_copy_name = "scalar";
+
+static void sq_copy_select()
+{
+	sq_copy = sq_copy_scalar;
+	sq_copy_name = "scalar";
+#ifdef SQ_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports ("avx2") ) {
+		sq_copy = sq_copy_avx2;
+		sq_copy_name = "AVX2";
+	} else if (__builtin_cpu_supports ("sse2") ) {
+		sq_copy = sq_copy_sse2;
+		sq_copy_name = "SSE2";
+	}
+#endif
+}
+
+static void sq_copy_resolve (uint8_t*dst, const uint8_t*src, size_t size)
+{
+	sq_copy_select();
+	sq_copy (dst, src, size);
+}
+
+void sq_memcpy (uint8_t*dst, const uint8_t*src, size_t size)
+{
+	if ( (dst == src) || !size) return;
+	sq_copy (dst, src, size);
+}
+
+const char* sq_copy_engine (int i, sq_copy_func&f)
+{
+	if (!i--) {
+		f = sq_copy_tail;
+		return "bytewise";
+	}
+	if (!i--) {
+		f = sq_copy_scalar;
+		return "scalar";
+	}
+#ifdef SQ_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports ("sse2") && !i--) {
+		f = sq_copy_sse2;
+		return "SSE2";
+	}
+	if (__builtin_cpu_supports ("avx2") && !i--) {
+		f = sq_copy_avx2;
+		return "AVX2";
+	}
+#endif
+	return 0;
+}
+
 /*
  * pusher
  *
@@ -63,47 +260,316 @@ void pusher::push (const uint8_t*p, size_t size)
 /*
  * squeue stuff
  *
- * - fill the vector buffer, provide direct access to it
- * - pop things from the front, leave the space there
- * - if we think that realloc is feasible (when len() is zero)
- *   we remove the unused front.
+ * - fill the ring, provide direct access to it
+ * - pop things from the front
+ * - grow the ring if the data doesn't fit, shrink it when it's empty and
+ *   much too large. Data is never moved around otherwise.
  */
 
-#define squeue_max_free_size 0x10000
 #define squeue_back_free_space 0x1000
 
 static int squeue_max_alloc = 0x1000000; //max allocated space, 16M
+static int squeue_watermark = 0x10000; //don't keep more than this drained
+static int squeue_idle_time = 30000000;
+
+bool sq_buffers_idle (uint64_t last_busy)
+{
+	return timestamp() - last_busy > (uint64_t) squeue_idle_time;
+}
 
-uint8_t* squeue::get_buffer (size_t size)
+squeue::squeue (const squeue&a)
 {
-	if (d.size() < back + size) realloc (size);
-	if (d.size() < back + size) return 0;
-	return end();
+	d = 0;
+	clear();
+	*this = a;
 }
 
-void squeue::realloc (size_t size)
+squeue& squeue::operator= (const squeue&a)
 {
-	if ( !len() ) {  //flush to begin
-		front = back = 0;
-	} else if (front > squeue_max_free_size) { //move closer to start
-		sq_memcpy (d.begin().base(),
-		           d.begin().base() + front,
-		           back - front);
-		back -= front;
-		front = 0;
+	if (this == &a) return *this;
+	clear();
+	if (!a.d) return *this;
+	d = (uint8_t*) pool_alloc (squeue_storage (a.size) );
+	if (!d) return *this;
+	size = a.size;
+	sq_memcpy (d, a.d, squeue_storage (size) );
+	front = a.front;
+	back = a.back;
+	spill = a.spill;
+	return *this;
+}
+
+void squeue::clear()
+{
+	pool_free (d, squeue_storage (size) );
+	d = 0;
+	front = back = 0;
+	size = spill = 0;
+}
+
+uint8_t* squeue::window (size_t n)
+{
+	if ( (n > len() ) || (n > squeue_max_request) ) return 0;
+	sync();
+	size_t f = front & mask();
+	if (f + n > size) sq_memcpy (d + size, d, f + n - size);
+	return d + f;
+}
+
+uint8_t* squeue::get_buffer (size_t n)
+{
+	if (n > squeue_max_request) return 0;
+	sync();
+	if (size < len() + n) realloc (n);
+	else if ( (!len() ) && (size > (size_t) squeue_watermark)
+	          && (4* (n + squeue_back_free_space) < size) )
+		realloc (n); //shrink the empty oversized ring
+	if (size < len() + n) return 0;
+	return d + (back & mask() );
+}
+
+void squeue::append (size_t n)
+{
+	if (n > size - len() ) n = size - len();
+	size_t b = back & mask();
+	if (b + n > size) spill = b + n - size;
+	back += n;
+}
+
+void squeue::realloc (size_t n)
+{
+	sync();
+
+	size_t l = len(), t = squeue_back_free_space;
+	while (t < l + n + squeue_back_free_space) t <<= 1;
+	while ( (t > (size_t) squeue_max_alloc) && (t > squeue_back_free_space) )
+		t >>= 1;
+
+	if (t == size) return;
+	if (t < l) return; //can't fit current data.
+
+	uint8_t*nd = (uint8_t*) pool_alloc (squeue_storage (t) );
+	if (!nd) return;
+	if (l) {
+		size_t f = front & mask(), c = size - f;
+		if (c > l) c = l;
+		sq_memcpy (nd, d + f, c);
+		sq_memcpy (nd + c, d, l - c);
 	}
 
-	if (	(d.size() < back + size) || //too short
-	        (d.size() > squeue_max_free_size + back + size) ) { //too long
+	pool_free (d, squeue_storage (size) );
+	d = nd;
+	size = t;
+	front = 0;
+	back = l;
+}
+
+void squeue::release (bool idle)
+{
+	if (!d) return;
+	bool big = squeue_storage (size) > (size_t) squeue_watermark;
+	if (len() ) {
+		//drained well below the watermark, shrink to fit the data
+		if (big && (4 * len() < (size_t) squeue_watermark) ) realloc (0);
+	} else if (idle || big) clear();
+}
+
+/*
+ * blocks
+ */
+
+sq_block* sq_block_alloc (size_t size, bool budgeted)
+{
+	sq_block*b = (sq_block*) pool_alloc (sizeof (sq_block) + size,
+	                                     budgeted);
+	if (!b) return 0;
+	b->refs = 0;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+void sq_block_free (sq_block*b)
+{
+	pool_free (b, sizeof (sq_block) + b->size);
+}
+
+const sq_ref& sq_payload::block()
+{
+	if (blk.b) return blk;
+	blk = sq_ref (sq_block_alloc (size) );
+	if (!blk.b) return blk;
+	sq_memcpy (blk->data(), data, size);
+	blk->used = size;
+	data = blk->data();
+	return blk;
+}
+
+/*
+ * sgqueue stuff
+ *
+ * Payloads shorter than share threshold are rather copied to the inline
+ * block, because a separate segment (and, for TLS, a separate record) is
+ * more expensive than copying few bytes.
+ */
+
+#define sgqueue_block_size 0x4000
+//so that the whole block fits into a pool class
+#define sgqueue_block_data (sgqueue_block_size - sizeof (sq_block) )
+
+static int sgqueue_share_threshold = 2048;
 
-		size_t t = back + size + squeue_back_free_space;
-		if (t > (size_t) squeue_max_alloc) t = squeue_max_alloc;
-		d.resize (t);  //resize
+size_t sgqueue::contiguous (size_t max)
+{
+	deque<segment>::iterator i = segs.begin(), e = segs.end();
+	if (i == e) return 0;
+	size_t r = i->len;
+	uint8_t*p = i->data + i->len;
+	for (++i; (i != e) && (r < max) && (i->data == p); ++i) {
+		r += i->len;
+		p += i->len;
 	}
+	return (r > max) ? max : r;
+}
+
+void sgqueue::read (size_t n)
+{
+	if (n > total) n = total;
+	total -= n;
+	while (n) {
+		segment&s = segs.front();
+		if (s.len > n) {
+			s.data += n;
+			s.len -= n;
+			return;
+		}
+		n -= s.len;
+		segs.pop_front();
+	}
+}
+
+uint8_t* sgqueue::get_buffer (size_t n)
+{
+	//rewind the inline block if nothing else uses it
+	if (tail.b && (tail->refs == 1) ) tail->used = 0;
+
+	if (!tail.b || (tail->size - tail->used < n) )
+		tail = sq_ref (sq_block_alloc (n > sgqueue_block_data ?
+		                               n : sgqueue_block_data,
+		                               budgeted) );
+
+	if (!tail.b) return 0;
+	return tail->data() + tail->used;
+}
+
+void sgqueue::append (size_t n)
+{
+	if (!tail.b) return;
+	if (n > tail->size - tail->used) n = tail->size - tail->used;
+	if (!n) return;
+	push_ref (tail, tail->data() + tail->used, n);
+	tail->used += n;
+}
+
+void sgqueue::push (const uint8_t*p, size_t n)
+{
+	uint8_t*b = get_buffer (n);
+	if (!b) return;
+	sq_memcpy (b, p, n);
+	append (n);
+}
+
+void sgqueue::push_ref (const sq_ref&b, const uint8_t*p, size_t n)
+{
+	if (!n) return;
+	segs.push_back (segment() );
+	segment&s = segs.back();
+	s.blk = b;
+	s.data = (uint8_t*) p;
+	s.len = n;
+	total += n;
+}
+
+void sgqueue::push_payload (sq_payload&p, size_t offset)
+{
+	if (offset >= p.size) return;
+	if (p.size - offset < (size_t) sgqueue_share_threshold)
+		push (p.data + offset, p.size - offset);
+	else {
+		const sq_ref&b = p.block();
+		if (b.b) push_ref (b, p.data + offset, p.size - offset);
+		else push (p.data + offset, p.size - offset);
+	}
+}
+
+void sgqueue::take (sgqueue&q, size_t n)
+{
+	deque<segment>::iterator i, e;
+	size_t done = 0, l;
+	for (i = q.segs.begin(), e = q.segs.end();
+	        (i != e) && (done < n);++i) {
+		l = (i->len > n - done) ? n - done : i->len;
+		push_ref (i->blk, i->data, l);
+		done += l;
+	}
+	q.read (done);
+}
+
+/*
+ * copies out the queue start, up to max bytes. Stops before any segment
+ * that is at least `big' bytes long, as those are better left alone.
+ */
+
+size_t sgqueue::gather (uint8_t*p, size_t max, size_t big)
+{
+	size_t r = 0, n;
+	deque<segment>::iterator i, e;
+	for (i = segs.begin(), e = segs.end(); (i != e) && (r < max); ++i) {
+		if (r && (i->len >= big) ) break;
+		n = (i->len > max - r) ? max - r : i->len;
+		sq_memcpy (p + r, i->data, n);
+		r += n;
+	}
+	return r;
+}
+
+void sgqueue::release (bool idle)
+{
+	if (total || !idle) return;
+	tail.release();
+	deque<segment>().swap (segs);
+}
+
+size_t sgqueue::resident()
+{
+	size_t r = tail.b ? tail->size : 0;
+	deque<segment>::iterator i, e;
+	for (i = segs.begin(), e = segs.end();i != e;++i)
+		if (i->blk.b != tail.b) r += i->len;
+	return r;
+}
+
+size_t sgqueue_share_size()
+{
+	return sgqueue_share_threshold;
 }
 
 void squeue_init()
 {
+	pool_init();
+
+	config_get_int ("share_threshold", sgqueue_share_threshold);
+	Log_info ("payloads above %d bytes are shared between queues",
+	          sgqueue_share_threshold);
+
+	if (sq_copy == sq_copy_resolve) sq_copy_select();
+	Log_info ("using %s copy engine", sq_copy_name);
+
+	config_get_int ("buffer_watermark", squeue_watermark);
+	config_get_int ("buffer_idle_time", squeue_idle_time);
+	Log_info ("idle buffers are released after %gsec",
+	          0.000001 * squeue_idle_time);
+
 	config_get_int ("max_input_queue_size", squeue_max_alloc);
 	Log_info ("maximal input queue size is %d bytes", squeue_max_alloc);
 }
@@ -21,11 +21,16 @@ uint64_t timestamp()
 	return lasttime;
 }
 
-void timestamp_update()
+uint64_t timestamp_precise()
 {
 	struct timeval tv;
 	gettimeofday (&tv, 0);
-	lasttime = (1000000 * (uint64_t) tv.tv_sec) + (uint64_t) tv.tv_usec;
+	return (1000000 * (uint64_t) tv.tv_sec) + (uint64_t) tv.tv_usec;
+}
+
+void timestamp_update()
+{
+	lasttime = timestamp_precise();
 }
 
 static struct ts_initializer_t {
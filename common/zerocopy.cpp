@@ -0,0 +1,200 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zerocopy.h"
+
+#include "conf.h"
+#define LOGNAME "common/zerocopy"
+#include "log.h"
+#include "network.h"
+
+#include <string.h>
+
+#if defined (__linux__) && defined (SO_ZEROCOPY) && defined (MSG_ZEROCOPY)
+#define zerocopy_supported
+#include <linux/errqueue.h>
+#endif
+
+static bool enabled = false;
+static int threshold = 32768;
+
+static uint64_t n_sends = 0, n_bytes = 0, n_copied = 0;
+static size_t n_pinned = 0;
+
+void zerocopy_init()
+{
+	if (!config_is_true ("zerocopy") ) return;
+#ifdef zerocopy_supported
+	enabled = true;
+	config_get_int ("zerocopy_threshold", threshold);
+	Log_info ("sends of %d bytes and more go without copying", threshold);
+#else
+	Log_warn ("zerocopy sends are not supported on this platform");
+#endif
+}
+
+uint64_t zerocopy_sends()
+{
+	return n_sends;
+}
+
+uint64_t zerocopy_bytes()
+{
+	return n_bytes;
+}
+
+uint64_t zerocopy_copied()
+{
+	return n_copied;
+}
+
+size_t zerocopy_pinned()
+{
+	return n_pinned;
+}
+
+#ifdef zerocopy_supported
+
+void sock_zerocopy::setup (int fd)
+{
+	int t = 1;
+	on = false;
+	next = 0;
+	if (!enabled) return;
+
+	//unix sockets don't have it, those just stay copying
+	if (setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &t, sizeof (t) ) )
+		return;
+	on = true;
+}
+
+int sock_zerocopy::send (int fd, sgqueue&q, size_t max)
+{
+	if (!on || (max < (size_t) threshold) || (q.len() < (size_t) threshold) )
+		return sock_send_queue (fd, q, max);
+
+	int r = sock_send_queue (fd, q, max, MSG_ZEROCOPY);
+	if (r < 0) {
+		//too many notifications not read yet (optmem limit)
+		if (errno == ENOBUFS) {
+			reap (fd);
+			return sock_send_queue (fd, q, max);
+		}
+		return r;
+	}
+
+	deque<sgqueue::segment>::iterator i, e;
+	size_t done = 0;
+	for (i = q.segs.begin(), e = q.segs.end();
+	        (i != e) && (done < (size_t) r);++i) {
+		done += i->len;
+		if (pins.size() && (pins.back().id == next)
+		        && (pins.back().blk.b == i->blk.b) ) continue;
+		pins.push_back (pin() );
+		pins.back().id = next;
+		pins.back().blk = i->blk;
+		++n_pinned;
+	}
+	++next;
+	++n_sends;
+	n_bytes += r;
+	return r;
+}
+
+/*
+ * Each notification covers a range of send numbers. TCP completes them
+ * in order, so the range is normally at the front; pins are searched only
+ * up to its end anyway.
+ */
+
+static inline bool id_in (uint32_t id, uint32_t lo, uint32_t hi)
+{
+	return (int32_t) (id - lo) >= 0 && (int32_t) (hi - id) >= 0;
+}
+
+void sock_zerocopy::reap (int fd)
+{
+	struct msghdr msg;
+	struct cmsghdr*cm;
+	struct sock_extended_err*ee;
+	char control[128];
+	deque<pin>::iterator i;
+
+	for (;;) {
+		memset (&msg, 0, sizeof (msg) );
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+		if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+		for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm) ) {
+			if (! ( (cm->cmsg_level == SOL_IP
+			         && cm->cmsg_type == IP_RECVERR)
+			        || (cm->cmsg_level == SOL_IPV6
+			            && cm->cmsg_type == IPV6_RECVERR) ) )
+				continue;
+			ee = (struct sock_extended_err*) CMSG_DATA (cm);
+			if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				n_copied += ee->ee_data - ee->ee_info + 1;
+				if (on) Log_debug ("socket %d: kernel copies "
+					                   "anyway, not using zerocopy", fd);
+				on = false;
+			}
+
+			for (i = pins.begin(); (i != pins.end() )
+			        && ( (int32_t) (i->id - ee->ee_data) <= 0);)
+				if (id_in (i->id, ee->ee_info, ee->ee_data) ) {
+					i = pins.erase (i);
+					--n_pinned;
+				} else ++i;
+		}
+	}
+}
+
+/*
+ * Data that's still in flight would go out of blocks that can get reused
+ * after unpinning, so the connection is rather aborted. Nothing waits for
+ * it anyway when it's being closed.
+ */
+
+void sock_zerocopy::reset (int fd)
+{
+	if (pins.size() && (fd >= 0) ) {
+		struct linger l = {1, 0};
+		setsockopt (fd, SOL_SOCKET, SO_LINGER, &l, sizeof (l) );
+	}
+	n_pinned -= pins.size();
+	pins.clear();
+	on = false;
+	next = 0;
+}
+
+#else //no zerocopy
+
+void sock_zerocopy::setup (int)
+{
+	on = false;
+}
+
+int sock_zerocopy::send (int fd, sgqueue&q, size_t max)
+{
+	return sock_send_queue (fd, q, max);
+}
+
+void sock_zerocopy::reap (int) {}
+
+void sock_zerocopy::reset (int) {}
+
+#endif
+
@@ -0,0 +1,41 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_LZ_H
+#define _CVPN_LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Small and fast LZ77 packet compressor (LZ4 block-like format). Every
+ * packet is compressed separately, so there's no state to keep in sync.
+ */
+
+//returns compressed size, or 0 if it doesn't fit into max bytes.
+size_t lz_compress (const uint8_t*src, size_t size,
+                    uint8_t*dst, size_t max);
+
+//fails unless the output is exactly size bytes.
+bool lz_decompress (const uint8_t*src, size_t srcsize,
+                    uint8_t*dst, size_t size);
+
+//estimated entropy of the data, in bits per byte, from a sample
+float lz_entropy (const uint8_t*data, size_t size);
+
+//what lz_entropy gives on average for random data of that size. Small
+//samples can't show all 8 bits (128 bytes of noise look like 6.5), so
+//this, not 8, is what the estimate should be compared with.
+float lz_entropy_random (size_t size);
+
+#endif
+
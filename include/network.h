@@ -76,11 +76,17 @@ bool sock_nonblock (int fd);
 int tcp_listen_socket (const char*);
 int tcp_connect_socket (const char*);
 int tcp_close_socket (int fd, bool unlink = false);
+int udp_listen_socket (const char*);
+int udp_connect_socket (const char*);
+int udp_peer_socket (int listener, struct sockaddr*peer, int peer_len);
 
 int network_init();
 int sockoptions_set (int fd);
 int tcp_socket_writeable (int fd);
 int sock_get_error (int fd);
 
+class sgqueue;
+int sock_send_queue (int fd, sgqueue&, size_t max, int flags = 0);
+
 #endif
 
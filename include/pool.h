@@ -0,0 +1,62 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_POOL_H
+#define _CVPN_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Size-class pool allocator
+ *
+ * All queue and packet buffers come from here. Sizes are rounded up to
+ * powers of two and carved from big shared slabs; large ones get their own
+ * mapping, only rounded up to whole pages. Freed items wait on per-class
+ * free lists for reuse. The allocator never takes more than the budget
+ * from the system, pool_alloc returns 0 instead.
+ *
+ * Control stuff (route reports, pings, write staging) is allocated past
+ * the budget, so that a node full of data can still keep its routing; it
+ * counts as used anyway.
+ *
+ * Main thread only: there's no locking, handshake workers must not
+ * allocate from the pool.
+ */
+
+void pool_init();
+void pool_periodic_update();
+
+void* pool_alloc (size_t size, bool budgeted = true);
+void pool_free (void*, size_t size);
+size_t pool_item_size (size_t size); //what an allocation really takes
+
+class pool_class
+{
+public:
+	uint64_t hits, misses; //allocations served from free list/new memory
+	size_t used, total; //items handed out / items existing
+	void*free_list;
+	void*clean_list; //freed items whose pages were given back
+	uint8_t*slab_pos, *slab_end;
+};
+
+#define pool_min_shift 6
+#define pool_max_shift 32
+
+pool_class& pool_get_class (int shift);
+size_t pool_used_bytes(); //taken from the system
+size_t pool_budget_bytes(); //0 if unlimited
+uint64_t pool_failures();
+
+#endif
+
@@ -23,8 +23,18 @@ using namespace std;
 
 #include <stdint.h>
 
+#include "pool.h"
+
 void sq_memcpy (uint8_t*dst, const uint8_t*src, size_t size);
 
+/*
+ * Copy engines usable on this CPU, for the benchmark: returns name of the
+ * i-th one (0 past the last). "bytewise" is the original loop.
+ */
+
+typedef void (*sq_copy_func) (uint8_t*, const uint8_t*, size_t);
+const char* sq_copy_engine (int i, sq_copy_func&);
+
 class pusher
 {
 public:
@@ -38,58 +48,256 @@ public:
 
 void squeue_init();
 
+/*
+ * queue owners remember when their queues last held anything; after
+ * buffer_idle_time passes without that, buffers are released completely.
+ */
+
+bool sq_buffers_idle (uint64_t last_busy);
+
+/*
+ * squeue is a power-of-two ring buffer. Positions front and back grow
+ * indefinitely, data lives at position&(size-1).
+ *
+ * Storage has an overflow area after the ring, so anything that wraps
+ * around the ring end can be handed out contiguously: writers may write
+ * over the end (the spilled part is moved to the ring start on next
+ * access), and window() copies the wrapped part of the requested data
+ * after the end. Nothing ever gets compacted.
+ *
+ * A single request is at most one frame (64KiB and a header) or one read,
+ * the overflow area is that large (or as large as the ring, if it's
+ * smaller) and bigger requests are refused.
+ */
+
+#define squeue_max_request (0x10000 + 0x100)
+
+static inline size_t squeue_storage (size_t size)
+{
+	return size + (size < squeue_max_request ? size : squeue_max_request);
+}
+
 class squeue
 {
 public:
 	size_t front, back;
-	vector<uint8_t> d;
+	size_t size, spill;
+	uint8_t*d;
 
-	inline void clear() {
-		front = back = 0;
-		d.clear();
+	explicit inline squeue() {
+		d = 0;
+		clear();
 	}
 
-	explicit inline squeue() {
+	squeue (const squeue&);
+	squeue& operator= (const squeue&);
+
+	inline ~squeue() {
 		clear();
 	}
 
+	void clear();
+
 	inline size_t len() {
 		return back -front;
 	}
 
+	inline size_t mask() {
+		return size - 1;
+	}
+
+	inline void sync() {
+		if (!spill) return;
+		sq_memcpy (d, d + size, spill);
+		spill = 0;
+	}
+
 	inline uint8_t*begin() {
-		return d.begin().base() + front;
+		sync();
+		return d + (front & mask() );
 	}
-	inline void read (size_t size) {
-		front += size;
-		if (front > back) front = back;
+
+	//length of data that can be accessed at begin() without wrapping
+	inline size_t contiguous() {
+		size_t f = front & mask();
+		if (size - f < len() ) return size - f;
+		return len();
+	}
+
+	uint8_t*window (size_t n);
+
+	inline void read (size_t n) {
+		front += n;
+		if (front >= back) front = back = 0;
 	}
 
 	inline uint8_t*end() {
-		return d.begin().base() + back;
+		sync();
+		return d + (back & mask() );
 	}
 
-	uint8_t*get_buffer (size_t size);
+	uint8_t*get_buffer (size_t n);
 
-	inline void append (size_t size) {
-		back += size;
-		if (back > d.size() ) back = d.size();
-	};
+	void append (size_t n);
 
-	inline uint8_t* append_buffer (size_t size) {
-		uint8_t*res = get_buffer (size);
-		append (size);
+	inline uint8_t* append_buffer (size_t n) {
+		uint8_t*res = get_buffer (n);
+		if (res) append (n);
 		return res;
 	}
 
 	void realloc (size_t reserve_size = 0);
 
+	//give memory back if the queue is idle or drained below watermark
+	void release (bool idle);
+
+	inline size_t resident() {
+		return d ? pool_item_size (squeue_storage (size) ) : 0;
+	}
+
 	template<class T> inline void pop (T&t) {
 		if (len() < sizeof (T) ) return;
-		t = * (T*) begin();
+		t = * (T*) window (sizeof (T) );
 		read (sizeof (T) );
 	}
 };
 
+/*
+ * Refcounted data blocks
+ *
+ * Block memory is shared by send queues (and whatever else holds a sq_ref),
+ * the block gets freed when last reference disappears.
+ */
+
+class sq_block
+{
+public:
+	int refs;
+	size_t size, used;
+
+	inline uint8_t*data() {
+		return (uint8_t*) (this + 1);
+	}
+};
+
+sq_block* sq_block_alloc (size_t size, bool budgeted = true);
+void sq_block_free (sq_block*);
+
+class sq_ref
+{
+public:
+	sq_block*b;
+
+	inline sq_ref() : b (0) {}
+	explicit inline sq_ref (sq_block*x) : b (x) {
+		if (b) ++b->refs;
+	}
+	inline sq_ref (const sq_ref&a) : b (a.b) {
+		if (b) ++b->refs;
+	}
+	inline sq_ref& operator= (const sq_ref&a) {
+		if (a.b) ++a.b->refs;
+		release();
+		b = a.b;
+		return *this;
+	}
+	inline ~sq_ref() {
+		release();
+	}
+	inline void release() {
+		if (b && ! (--b->refs) ) sq_block_free (b);
+		b = 0;
+	}
+	inline sq_block* operator-> () const {
+		return b;
+	}
+};
+
+/*
+ * Payload of a packet that is being sent somewhere. The data is copied to
+ * a shared block only when some queue really needs to keep it, and only
+ * once, no matter how many queues reference it.
+ */
+
+class sq_payload
+{
+public:
+	const uint8_t*data;
+	size_t size;
+	sq_ref blk;
+
+	inline sq_payload (const uint8_t*d, size_t s) : data (d), size (s) {}
+
+	const sq_ref& block();
+};
+
+/*
+ * Scatter-gather queue
+ *
+ * Chain of segments that point either to the queue's own inline blocks
+ * (small stuff like headers gets copied there) or to shared payload
+ * blocks. Segments that lie next to each other in memory are handed out
+ * together by contiguous(), so the inline stuff still leaves in big chunks.
+ */
+
+class sgqueue
+{
+public:
+	class segment
+	{
+	public:
+		sq_ref blk;
+		uint8_t*data;
+		size_t len;
+	};
+
+	deque<segment> segs;
+	sq_ref tail; //inline block for small data
+	size_t total;
+	bool budgeted; //false for control queues, see pool.h
+
+	explicit inline sgqueue() : total (0), budgeted (true) {}
+
+	inline size_t len() {
+		return total;
+	}
+
+	inline void clear() {
+		segs.clear();
+		tail.release();
+		total = 0;
+	}
+
+	inline uint8_t*begin() {
+		return segs.size() ? segs.front().data : 0;
+	}
+
+	size_t contiguous (size_t max = (size_t) - 1);
+	void read (size_t size);
+
+	uint8_t*get_buffer (size_t size);
+	void append (size_t size);
+
+	inline uint8_t*append_buffer (size_t size) {
+		uint8_t*res = get_buffer (size);
+		if (res) append (size);
+		return res;
+	}
+
+	void push (const uint8_t*, size_t);
+	void push_ref (const sq_ref&, const uint8_t*, size_t);
+	void push_payload (sq_payload&, size_t offset = 0);
+
+	//moves n bytes from the start of another queue, by reference
+	void take (sgqueue&, size_t n);
+
+	size_t gather (uint8_t*, size_t max, size_t big);
+
+	void release (bool idle);
+	size_t resident();
+};
+
+size_t sgqueue_share_size();
+
 #endif
 
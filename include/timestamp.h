@@ -23,5 +23,8 @@
 uint64_t timestamp();
 void timestamp_update();
 
+//reads the clock right now, for measuring short operations
+uint64_t timestamp_precise();
+
 #endif
 
@@ -0,0 +1,204 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_WIRE_H
+#define _CVPN_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Wire format codec
+ *
+ * Every frame layout is a class with `size' of the fixed part, and a
+ * typedef for every field, which knows its offset and type. Fields are
+ * big-endian and may be unaligned; byte-wise accesses get merged by the
+ * compiler into single loads/stores with byte swap, so this costs the same
+ * as the old pointer casts, except that it's correct everywhere.
+ *
+ * Layout sanity is checked at compile time: wire_check that the last field
+ * fits into the frame, wire_order that neighbouring fields don't overlap.
+ * The wire_bench option round-trips every layout at runtime.
+ */
+
+template<class T> class wire_codec;
+
+template<> class wire_codec<uint8_t>
+{
+public:
+	static inline uint8_t get (const uint8_t*p) {
+		return *p;
+	}
+	static inline void put (uint8_t*p, uint8_t v) {
+		*p = v;
+	}
+};
+
+template<> class wire_codec<uint16_t>
+{
+public:
+	static inline uint16_t get (const uint8_t*p) {
+		return (uint16_t) ( (p[0] << 8) | p[1]);
+	}
+	static inline void put (uint8_t*p, uint16_t v) {
+		p[0] = (uint8_t) (v >> 8);
+		p[1] = (uint8_t) v;
+	}
+};
+
+template<> class wire_codec<uint32_t>
+{
+public:
+	static inline uint32_t get (const uint8_t*p) {
+		return ( (uint32_t) p[0] << 24) | ( (uint32_t) p[1] << 16)
+		       | ( (uint32_t) p[2] << 8) | (uint32_t) p[3];
+	}
+	static inline void put (uint8_t*p, uint32_t v) {
+		p[0] = (uint8_t) (v >> 24);
+		p[1] = (uint8_t) (v >> 16);
+		p[2] = (uint8_t) (v >> 8);
+		p[3] = (uint8_t) v;
+	}
+};
+
+template<size_t Offset, class T> class wire_field
+{
+public:
+	typedef T type;
+	enum { offset = Offset, end = Offset + sizeof (T) };
+
+	static inline T get (const uint8_t*p) {
+		return wire_codec<T>::get (p + Offset);
+	}
+	static inline void put (uint8_t*p, T v) {
+		wire_codec<T>::put (p + Offset, v);
+	}
+};
+
+//C++98 doesn't have static_assert, array of negative size does the job.
+#define wire_check(layout, last) \
+	typedef char layout##_fits[ \
+		( (size_t) layout::last::end <= (size_t) layout::size) ? 1 : -1]
+
+#define wire_order(layout, a, b) \
+	typedef char layout##_##a##_##b[ \
+		( (size_t) layout::a::end <= (size_t) layout::b::offset) ? 1 : -1]
+
+/*
+ * Bounds-checked decoding. Every take() returns 0 if the data is too
+ * short, so a parser can't read after the end of data even if it's a
+ * bit careless with its checks.
+ */
+
+class wire_reader
+{
+public:
+	const uint8_t*p;
+	size_t left;
+
+	inline wire_reader (const uint8_t*P, size_t len) : p (P), left (len) {}
+
+	inline const uint8_t* take (size_t n) {
+		if (left < n) return 0;
+		const uint8_t*r = p;
+		p += n;
+		left -= n;
+		return r;
+	}
+
+	template<class L> inline const uint8_t* take() {
+		return take (L::size);
+	}
+
+	//LEB128-style varint, at most 5 bytes
+	inline bool varint (uint32_t&v) {
+		v = 0;
+		for (int shift = 0; (shift < 35) && left; shift += 7) {
+			uint8_t b = *p++;
+			--left;
+			v |= (uint32_t) (b & 0x7f) << shift;
+			if (! (b & 0x80) ) return true;
+		}
+		return false;
+	}
+};
+
+#define wire_varint_max 5
+
+static inline size_t wire_put_varint (uint8_t*p, uint32_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (uint8_t) (v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (uint8_t) v;
+	return n;
+}
+
+/*
+ * The gate protocol (between cloud and its gates, like ether) is shared by
+ * several programs, so its layouts live here.
+ */
+
+class gate_header
+{
+public:
+	enum { size = 3 };
+	typedef wire_field<0, uint8_t> type;
+	typedef wire_field<1, uint16_t> length;
+};
+wire_check (gate_header, length);
+wire_order (gate_header, type, length);
+
+class gate_route_entry
+{
+public:
+	enum { size = 6 };
+	typedef wire_field<0, uint16_t> addr_size;
+	typedef wire_field<2, uint32_t> inst;
+};
+wire_check (gate_route_entry, inst);
+wire_order (gate_route_entry, addr_size, inst);
+
+class gate_packet
+{
+public:
+	enum { size = 14 };
+	typedef wire_field<0, uint32_t> inst;
+	typedef wire_field<4, uint16_t> dof;
+	typedef wire_field<6, uint16_t> ds;
+	typedef wire_field<8, uint16_t> sof;
+	typedef wire_field<10, uint16_t> ss;
+	typedef wire_field<12, uint16_t> length;
+};
+wire_check (gate_packet, length);
+wire_order (gate_packet, inst, dof);
+wire_order (gate_packet, dof, ds);
+wire_order (gate_packet, ds, sof);
+wire_order (gate_packet, sof, ss);
+wire_order (gate_packet, ss, length);
+
+/*
+ * Priority class of a packet. Gate may send it in one byte right after the
+ * packet payload (older cores ignore anything after it; packets without it
+ * are best effort). Between cores it travels in the frame header.
+ */
+
+#define prio_best_effort 0
+#define prio_background 1
+#define prio_interactive 2
+#define prio_voice 3
+#define prio_classes 4
+
+#endif
+
@@ -0,0 +1,75 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_ZEROCOPY_H
+#define _CVPN_ZEROCOPY_H
+
+#include "sq.h"
+
+#include <stdint.h>
+
+/*
+ * MSG_ZEROCOPY sends
+ *
+ * Large sends from a sgqueue can let the kernel take the pages instead of
+ * copying them. The kernel reads them until it reports completion through
+ * the socket error queue, so the blocks of everything sent that way stay
+ * referenced (pinned) here meanwhile, and the queue can't reuse them.
+ *
+ * Small sends are cheaper to copy than to pin and notify about; only sends
+ * of at least zerocopy_threshold bytes go without copying. Completions that
+ * tell the kernel copied anyway (loopback, devices without scatter-gather)
+ * switch the socket back to plain sends.
+ */
+
+class sock_zerocopy
+{
+public:
+	bool on;
+	uint32_t next; //number of the next zerocopy send, as kernel counts
+
+	class pin
+	{
+	public:
+		uint32_t id;
+		sq_ref blk;
+	};
+	deque<pin> pins;
+
+	explicit inline sock_zerocopy() : on (false), next (0) {}
+
+	void setup (int fd); //enables it on the socket if configured
+
+	//like sock_send_queue
+	int send (int fd, sgqueue&, size_t max);
+
+	//processes the completions, call when the socket reports an error
+	void reap (int fd);
+
+	//before closing the socket
+	void reset (int fd);
+
+	inline bool pending() {
+		return !pins.empty();
+	}
+};
+
+void zerocopy_init();
+
+//totals for the status
+uint64_t zerocopy_sends();
+uint64_t zerocopy_bytes();
+uint64_t zerocopy_copied();
+size_t zerocopy_pinned();
+
+#endif
+
@@ -0,0 +1,1229 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include "conf.h"
+#define LOGNAME "cloud/bench"
+#include "log.h"
+#include "network.h"
+#include "timestamp.h"
+#include "sq.h"
+#include "comm.h"
+#include "wire.h"
+#include "pool.h"
+#include "lz.h"
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+/*
+ * Candidates are listed in the order of NORMAL priority. A cipher only
+ * goes before its neighbour if it's faster by more than the ratio, so that
+ * measurement noise doesn't reorder them on every start. (Buckets of fixed
+ * width would split two equally fast ciphers whenever they happened to be
+ * measured on different sides of a bucket boundary.)
+ */
+
+static const gnutls_cipher_algorithm_t candidates[] = {
+	GNUTLS_CIPHER_AES_256_GCM,
+	GNUTLS_CIPHER_CHACHA20_POLY1305,
+	GNUTLS_CIPHER_AES_128_GCM,
+};
+
+#define n_candidates (sizeof (candidates) / sizeof (candidates[0]) )
+
+#define bench_tag_size 16
+#define bench_speedup_ratio 1.15
+#define bench_startup_usec 20000
+#define bench_run_usec 250000
+
+static const size_t record_sizes[] = {64, 512, 1400, 16384};
+
+#define n_record_sizes (sizeof (record_sizes) / sizeof (record_sizes[0]) )
+
+//bytes per second, 0 if the cipher isn't available
+static double measure (gnutls_cipher_algorithm_t c, size_t size, int usec)
+{
+	gnutls_aead_cipher_hd_t h;
+	uint8_t keybuf[32], nonce[12];
+	vector<uint8_t> in (size), out (size + bench_tag_size);
+	gnutls_datum_t key = {keybuf,
+	                      (unsigned int) gnutls_cipher_get_key_size (c)
+	                     };
+	size_t outlen;
+	uint64_t start, now, bytes = 0;
+
+	memset (keybuf, 0x5a, sizeof (keybuf) );
+	memset (nonce, 0, sizeof (nonce) );
+	if (gnutls_aead_cipher_init (&h, c, &key) ) return 0;
+
+	start = now = timestamp_precise();
+	while (now - start < (uint64_t) usec) {
+		for (int i = 0;i < 16;++i) {
+			++nonce[0];
+			outlen = out.size();
+			if (gnutls_aead_cipher_encrypt (h, nonce, sizeof (nonce),
+			                                0, 0, bench_tag_size,
+			                                & (in[0]), size,
+			                                & (out[0]), &outlen) ) {
+				gnutls_aead_cipher_deinit (h);
+				return 0;
+			}
+			bytes += size;
+		}
+		now = timestamp_precise();
+	}
+
+	gnutls_aead_cipher_deinit (h);
+	return 1000000.0 * bytes / (now - start);
+}
+
+class bench_result
+{
+public:
+	gnutls_cipher_algorithm_t cipher;
+	double speed;
+};
+
+//bubble sort, swaps only pairs that differ by more than the ratio
+static void order_by_speed (vector<bench_result>&r)
+{
+	bool swapped = true;
+	while (swapped) {
+		swapped = false;
+		for (size_t i = 1;i < r.size();++i)
+			if (r[i].speed > r[i-1].speed * bench_speedup_ratio) {
+				swap (r[i], r[i-1]);
+				swapped = true;
+			}
+	}
+}
+
+string bench_cipher_priority (const string&base)
+{
+	vector<bench_result> r;
+	bench_result b;
+
+	for (size_t i = 0;i < n_candidates;++i) {
+		b.cipher = candidates[i];
+		b.speed = measure (b.cipher, 16384, bench_startup_usec);
+		if (b.speed <= 0) continue;
+		r.push_back (b);
+		Log_info ("cipher %s encrypts %.1fMB/s",
+		          gnutls_cipher_get_name (b.cipher), b.speed / 1000000);
+	}
+	order_by_speed (r);
+
+	//others stay behind in the base order
+	string p = base + ":-CIPHER-ALL";
+	for (size_t i = 0;i < r.size();++i)
+		p = p + ":+" + gnutls_cipher_get_name (r[i].cipher);
+	return p + ":+CIPHER-ALL";
+}
+
+int bench_ciphers_run()
+{
+	if (gnutls_global_init() ) {
+		Log_error ("gnutls_global_init failed");
+		return 1;
+	}
+
+	printf ("%-20s", "cipher \\ record");
+	for (size_t j = 0;j < n_record_sizes;++j)
+		printf ("%10zuB", record_sizes[j]);
+	printf ("\n");
+
+	for (size_t i = 0;i < n_candidates;++i) {
+		printf ("%-20s", gnutls_cipher_get_name (candidates[i]) );
+		for (size_t j = 0;j < n_record_sizes;++j)
+			printf ("%7.1fMB/s", measure (candidates[i],
+			                             record_sizes[j],
+			                             bench_run_usec) / 1000000);
+		printf ("\n");
+		fflush (stdout);
+	}
+
+	gnutls_global_deinit();
+	return 0;
+}
+
+/*
+ * Zerocopy benchmark
+ *
+ * Finds the send size above which MSG_ZEROCOPY costs the sender less CPU
+ * than copying, completion handling included. Loopback always copies
+ * (the receiving side can't keep the sender's pages), so the real answer
+ * comes from a run against some discarding sink behind the actual NIC,
+ * set by zerocopy_bench_target.
+ */
+
+#if defined (__linux__) && defined (SO_ZEROCOPY) && defined (MSG_ZEROCOPY)
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <linux/errqueue.h>
+
+#define zc_bench_usec 300000
+
+static const size_t send_sizes[] = {1024, 4096, 16384, 65536, 262144};
+
+#define n_send_sizes (sizeof (send_sizes) / sizeof (send_sizes[0]) )
+
+static void* drain (void*p)
+{
+	int fd = * (int*) p;
+	static char buf[262144];
+	while (recv (fd, buf, sizeof (buf), 0) > 0);
+	return 0;
+}
+
+static uint64_t cpu_usec()
+{
+	struct timespec t;
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+//error queue only wakes up poll as an error
+static void wait_error (int fd)
+{
+	struct pollfd f;
+	f.fd = fd;
+	f.events = 0;
+	f.revents = 0;
+	poll (&f, 1, 100);
+}
+
+static void reap (int fd, uint64_t&completed, uint64_t&copied)
+{
+	struct msghdr msg;
+	struct cmsghdr*cm;
+	struct sock_extended_err*ee;
+	char control[128];
+
+	for (;;) {
+		memset (&msg, 0, sizeof (msg) );
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+		if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+		for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm) ) {
+			ee = (struct sock_extended_err*) CMSG_DATA (cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			completed += ee->ee_data - ee->ee_info + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				copied += ee->ee_data - ee->ee_info + 1;
+		}
+	}
+}
+
+//sender CPU nanoseconds per KiB, negative on failure
+static double measure_send (int fd, size_t size, bool zc, double&copied_ratio)
+{
+	vector<uint8_t> buf (size, 0x5a);
+	uint64_t start, cpu, bytes = 0, sends = 0, completed = 0, copied = 0;
+	int r;
+
+	start = timestamp_precise();
+	cpu = cpu_usec();
+	while (timestamp_precise() - start < zc_bench_usec) {
+		r = send (fd, & (buf[0]), size, MSG_NOSIGNAL
+		          | (zc ? MSG_ZEROCOPY : 0) );
+		if (r < 0) {
+			if (zc && (errno == ENOBUFS) ) {
+				wait_error (fd);
+				reap (fd, completed, copied);
+				continue;
+			}
+			return -1;
+		}
+		bytes += r;
+		if (!zc) continue;
+		++sends;
+		reap (fd, completed, copied);
+	}
+	//the buffer must not go away before the kernel lets it go
+	while (completed < sends) {
+		wait_error (fd);
+		reap (fd, completed, copied);
+	}
+	cpu = cpu_usec() - cpu;
+
+	copied_ratio = sends ? (double) copied / sends : 0;
+	return bytes ? 1000.0 * cpu / (bytes / 1024.0) : -1;
+}
+
+static int bench_socket (const string&target, int&peer)
+{
+	sockaddr_type sa;
+	socklen_t sa_len = sizeof (sa.sa_4);
+	int len, domain, fd, l;
+
+	peer = -1;
+	if (target.length() ) {
+		if (!sockaddr_from_str (target.c_str(), & (sa.sa), &len, &domain) )
+			return -1;
+		fd = socket (domain, SOCK_STREAM, 0);
+		if ( (fd >= 0) && connect (fd, & (sa.sa), len) ) {
+			close (fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	//loopback pair with a drain on the other side
+	memset (&sa, 0, sizeof (sa) );
+	sa.sa_4.sin_family = AF_INET;
+	sa.sa_4.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	l = socket (AF_INET, SOCK_STREAM, 0);
+	if (l < 0) return -1;
+	if (bind (l, & (sa.sa), sa_len) || listen (l, 1)
+	        || getsockname (l, & (sa.sa), &sa_len) ) {
+		close (l);
+		return -1;
+	}
+	fd = socket (AF_INET, SOCK_STREAM, 0);
+	if ( (fd >= 0) && connect (fd, & (sa.sa), sa_len) ) {
+		close (fd);
+		fd = -1;
+	}
+	if (fd >= 0) peer = accept (l, 0, 0);
+	close (l);
+	if (peer < 0) {
+		if (fd >= 0) close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+int bench_zerocopy_run()
+{
+	string target;
+	int fd, peer, one = 1;
+	pthread_t drainer;
+	double copy, zc, copied, ratio = 0;
+	size_t crossover = 0;
+
+	config_get ("zerocopy_bench_target", target);
+	fd = bench_socket (target, peer);
+	if (fd < 0) {
+		Log_error ("cannot set up the benchmark connection");
+		return 1;
+	}
+	if (setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one) ) ) {
+		Log_error ("socket doesn't support zerocopy");
+		close (fd);
+		if (peer >= 0) close (peer);
+		return 1;
+	}
+	if ( (peer >= 0) && pthread_create (&drainer, 0, drain, &peer) ) {
+		close (fd);
+		close (peer);
+		return 1;
+	}
+
+	printf ("%10s %14s %14s %8s\n", "send size",
+	        "copy ns/KiB", "zerocopy ns/KiB", "copied");
+	for (size_t i = 0;i < n_send_sizes;++i) {
+		copy = measure_send (fd, send_sizes[i], false, copied);
+		zc = measure_send (fd, send_sizes[i], true, copied);
+		if ( (copy < 0) || (zc < 0) ) {
+			Log_error ("benchmark connection failed");
+			break;
+		}
+		printf ("%9zuB %14.1f %14.1f %7.0f%%\n", send_sizes[i],
+		        copy, zc, 100 * copied);
+		fflush (stdout);
+
+		//smallest size from which zerocopy keeps winning
+		if (zc >= copy) crossover = 0;
+		else if (!crossover) crossover = send_sizes[i];
+		if (copied > ratio) ratio = copied;
+	}
+
+	if (crossover)
+		printf ("suggested zerocopy_threshold: %zu\n", crossover);
+	else printf ("zerocopy doesn't pay off on this path\n");
+	if (ratio > 0.5)
+		printf ("kernel copied most sends anyway, as it does for local "
+		        "peers; try zerocopy_bench_target\n");
+
+	shutdown (fd, SHUT_RDWR);
+	close (fd);
+	if (peer >= 0) {
+		pthread_join (drainer, 0);
+		close (peer);
+	}
+	return 0;
+}
+
+#else
+
+int bench_zerocopy_run()
+{
+	Log_error ("zerocopy sends are not supported on this platform");
+	return 1;
+}
+
+#endif
+
+/*
+ * Copy engine benchmark
+ *
+ * Every engine is first checked against memmove() on random, mostly
+ * overlapping ranges, then timed on packet-sized copies. Buffers are a few
+ * bytes off alignment, as payloads in the queues usually are.
+ */
+
+#define copy_bench_usec 100000
+#define copy_check_rounds 2000
+#define copy_check_size 8192
+
+static const size_t copy_sizes[] = {64, 128, 256, 512, 1024, 1514, 4096, 8192};
+
+#define n_copy_sizes (sizeof (copy_sizes) / sizeof (copy_sizes[0]) )
+
+static void copy_libc (uint8_t*dst, const uint8_t*src, size_t size)
+{
+	memmove (dst, src, size);
+}
+
+static bool check_copy (sq_copy_func f)
+{
+	vector<uint8_t> a (2 * copy_check_size), b;
+	size_t n, s, d;
+
+	for (int r = 0;r < copy_check_rounds;++r) {
+		for (size_t i = 0;i < a.size();++i) a[i] = rand();
+		b = a;
+		n = 1 + rand() % copy_check_size;
+		s = rand() % (a.size() - n + 1);
+		d = rand() % (a.size() - n + 1);
+		if (s == d) continue; //sq_memcpy never calls the engine for that
+		f (& (a[d]), & (a[s]), n);
+		memmove (& (b[d]), & (b[s]), n);
+		if (a != b) return false;
+	}
+	return true;
+}
+
+//bytes per second
+static double measure_copy (sq_copy_func f, size_t size)
+{
+	vector<uint8_t> src (size + 32, 0x5a), dst (size + 32);
+	uint64_t start, now, bytes = 0;
+
+	start = now = timestamp_precise();
+	while (now - start < copy_bench_usec) {
+		for (int i = 0;i < 256;++i) {
+			f (& (dst[1 + (i & 7)]), & (src[3 + (i & 15)]), size);
+			bytes += size;
+		}
+		now = timestamp_precise();
+	}
+	return 1000000.0 * bytes / (now - start);
+}
+
+int bench_memcpy_run()
+{
+	vector<sq_copy_func> f;
+	vector<const char*> names;
+	sq_copy_func e;
+	const char*name;
+	int ret = 0;
+
+	for (int i = 0; (name = sq_copy_engine (i, e) );++i) {
+		f.push_back (e);
+		names.push_back (name);
+	}
+	f.push_back (copy_libc);
+	names.push_back ("libc memmove");
+
+	for (size_t i = 0;i + 1 < f.size();++i)
+		if (!check_copy (f[i]) ) {
+			printf ("%s engine FAILED the overlap check\n", names[i]);
+			ret = 1;
+		}
+
+	printf ("%-14s", "engine \\ size");
+	for (size_t j = 0;j < n_copy_sizes;++j)
+		printf ("%9zuB", copy_sizes[j]);
+	printf ("\n");
+
+	for (size_t i = 0;i < f.size();++i) {
+		printf ("%-14s", names[i]);
+		for (size_t j = 0;j < n_copy_sizes;++j)
+			printf ("%6.1fGB/s", measure_copy (f[i], copy_sizes[j])
+			        / 1000000000);
+		printf ("\n");
+		fflush (stdout);
+	}
+	return ret;
+}
+
+/*
+ * Queue benchmark
+ *
+ * Replays the way connections and gates use their byte queues -- reads of
+ * varying size with frames parsed out of them, and frames written out in
+ * partial sends -- through squeue and through a model of the former
+ * vector-backed queue that compacted by moving the data to its start.
+ * Reported are the bytes the queue itself copied or zero-filled for each
+ * forwarded byte; copying the data in and out is the same for both.
+ */
+
+#define queue_bench_bytes 0x4000000
+#define queue_bench_read 16384
+#define queue_head_size 4
+
+class compacting_queue
+{
+public:
+	size_t front, back;
+	vector<uint8_t> d;
+	uint64_t copied;
+
+	compacting_queue() : front (0), back (0), copied (0) {}
+
+	size_t len() {
+		return back - front;
+	}
+	uint8_t*begin() {
+		return & (d[0]) + front;
+	}
+	void read (size_t n) {
+		front += n;
+	}
+	void append (size_t n) {
+		back += n;
+	}
+
+	uint8_t*get_buffer (size_t n) {
+		if (d.size() < back + n) realloc (n);
+		return & (d[0]) + back;
+	}
+
+	void realloc (size_t n) {
+		if (!len() ) front = back = 0;
+		else if (front > 0x10000) {
+			memmove (& (d[0]), & (d[0]) + front, len() );
+			copied += len();
+			back -= front;
+			front = 0;
+		}
+		if ( (d.size() < back + n) || (d.size() > 0x10000 + back + n) ) {
+			size_t t = back + n + 0x1000;
+			if (t > d.capacity() ) copied += d.size();
+			if (t > d.size() ) copied += t - d.size();
+			d.resize (t);
+		}
+	}
+};
+
+static size_t bench_frame_size()
+{
+	int r = rand() % 100;
+	if (r < 60) return 40 + rand() % 200;
+	if (r < 90) return 1000 + rand() % 500;
+	return 1500 + rand() % 7000;
+}
+
+/*
+ * squeue itself doesn't count anything; the copies it makes follow from
+ * its state: the spilled part moves on every access, window() copies the
+ * wrapped part and a reallocation moves all the data.
+ */
+
+class counting_ring
+{
+public:
+	squeue q;
+	uint64_t copied;
+
+	counting_ring() : copied (0) {}
+
+	size_t len() {
+		return q.len();
+	}
+	void read (size_t n) {
+		q.read (n);
+	}
+	void append (size_t n) {
+		q.append (n);
+	}
+
+	uint8_t*get_buffer (size_t n) {
+		uint8_t*d = q.d;
+		size_t l = q.len();
+		copied += q.spill;
+		uint8_t*r = q.get_buffer (n);
+		if (l && (q.d != d) ) copied += l;
+		return r;
+	}
+
+	uint8_t*window (size_t n) {
+		size_t f = q.front & q.mask();
+		copied += q.spill;
+		if ( (n <= q.len() ) && (n <= squeue_max_request)
+		        && (f + n > q.size) ) copied += f + n - q.size;
+		return q.window (n);
+	}
+};
+
+static uint8_t*queue_window (counting_ring&q, size_t n)
+{
+	return q.window (n);
+}
+
+static uint8_t*queue_window (compacting_queue&q, size_t)
+{
+	return q.begin();
+}
+
+//receiving side: reads of random size, whole frames parsed off the front
+template<class Q> static void replay_recv (Q&q, const vector<uint8_t>&in)
+{
+	size_t pos = 0, r, frame;
+	uint8_t*p;
+
+	while (pos < in.size() ) {
+		p = q.get_buffer (queue_bench_read);
+		r = 1 + rand() % queue_bench_read;
+		if (r > in.size() - pos) r = in.size() - pos;
+		memcpy (p, & (in[pos]), r);
+		q.append (r);
+		pos += r;
+
+		while (q.len() >= queue_head_size) {
+			p = queue_window (q, queue_head_size);
+			frame = queue_head_size + ( (p[2] << 8) | p[3]);
+			if (q.len() < frame) break;
+			p = queue_window (q, frame);
+			q.read (frame);
+		}
+	}
+}
+
+//sending side: frames appended, written out in pieces the socket takes
+template<class Q> static void replay_send (Q&q, const vector<uint8_t>&in,
+        vector<uint8_t>&out)
+{
+	size_t pos = 0, frame, w;
+	uint8_t*p;
+
+	while (pos < in.size() || q.len() ) {
+		for (int i = 0; (i < 8) && (pos < in.size() );++i) {
+			frame = queue_head_size
+			        + ( (in[pos + 2] << 8) | in[pos + 3]);
+			p = q.get_buffer (frame);
+			memcpy (p, & (in[pos]), frame);
+			q.append (frame);
+			pos += frame;
+		}
+		w = 1 + rand() % (2 * queue_bench_read);
+		if (w > q.len() ) w = q.len();
+		p = queue_window (q, w);
+		memcpy (& (out[0]), p, w);
+		q.read (w);
+	}
+}
+
+template<class Q> static void bench_queue (const char*name,
+        const vector<uint8_t>&in, bool send)
+{
+	Q q;
+	vector<uint8_t> out (2 * queue_bench_read);
+	uint64_t start = timestamp_precise();
+
+	srand (1);
+	if (send) replay_send (q, in, out);
+	else replay_recv (q, in);
+
+	printf ("%-12s %-6s %10.4f %12.2f\n", name, send ? "send" : "recv",
+	        (double) q.copied / in.size(),
+	        1000.0 * (timestamp_precise() - start) / in.size() );
+	fflush (stdout);
+}
+
+int bench_queue_run()
+{
+	vector<uint8_t> in;
+	size_t frame;
+
+	//frames with 16bit sizes at the header end, like the protocols have
+	srand (0);
+	while (in.size() < queue_bench_bytes) {
+		frame = bench_frame_size();
+		in.push_back (0);
+		in.push_back (0);
+		in.push_back ( (uint8_t) (frame >> 8) );
+		in.push_back ( (uint8_t) frame);
+		in.resize (in.size() + frame, 0x5a);
+	}
+
+	printf ("%-12s %-6s %10s %12s\n", "queue", "side",
+	        "copied/B", "ns/B");
+	for (int send = 0;send < 2;++send) {
+		bench_queue<compacting_queue> ("compacting", in, send);
+		bench_queue<counting_ring> ("ring", in, send);
+	}
+	return 0;
+}
+
+/*
+ * Wire codec tests and benchmark
+ *
+ * Every layout gets random values put into all its fields, which then must
+ * come back unchanged, and nothing may be written past the layout size --
+ * that catches overlapping fields or wrong offsets the compile time checks
+ * would miss. Varints and wire_reader are fuzzed with random values and
+ * truncated or garbage input. Then encoding and decoding of the packet
+ * frame headers is timed.
+ */
+
+#define wire_test_rounds 100000
+#define wire_bench_frames 10000000
+#define wire_canary 0xa5
+
+template<class L> class wire_roundtrip
+{
+public:
+	uint8_t buf[L::size + 16];
+	uint32_t vals[32];
+	int n;
+	bool checking, ok;
+
+	template<class F> wire_roundtrip& f() {
+		typename F::type v;
+		if (!checking) {
+			v = (typename F::type) ( (rand() << 16) ^ rand() );
+			F::put (buf, v);
+			vals[n++] = v;
+		} else if (F::get (buf) != vals[n++]) ok = false;
+		return *this;
+	}
+};
+
+template<class L> static bool wire_test (const char*name,
+        void (*fields) (wire_roundtrip<L>&) )
+{
+	wire_roundtrip<L> t;
+
+	for (int r = 0;r < wire_test_rounds;++r) {
+		memset (t.buf, wire_canary, sizeof (t.buf) );
+		t.n = 0;
+		t.checking = false;
+		fields (t);
+		t.n = 0;
+		t.checking = t.ok = true;
+		fields (t);
+		for (size_t i = L::size;i < sizeof (t.buf);++i)
+			if (t.buf[i] != wire_canary) t.ok = false;
+		if (!t.ok) {
+			printf ("layout %s FAILED the round trip\n", name);
+			return false;
+		}
+	}
+	return true;
+}
+
+#define wire_f(l, x) template f<l::x>()
+
+static void fields_gate_header (wire_roundtrip<gate_header>&t)
+{
+	t.wire_f (gate_header, type).wire_f (gate_header, length);
+}
+
+static void fields_gate_route_entry (wire_roundtrip<gate_route_entry>&t)
+{
+	t.wire_f (gate_route_entry, addr_size).wire_f (gate_route_entry, inst);
+}
+
+static void fields_gate_packet (wire_roundtrip<gate_packet>&t)
+{
+	t.wire_f (gate_packet, inst).wire_f (gate_packet, dof)
+	.wire_f (gate_packet, ds).wire_f (gate_packet, sof)
+	.wire_f (gate_packet, ss).wire_f (gate_packet, length);
+}
+
+static void fields_comm_header (wire_roundtrip<comm_header>&t)
+{
+	t.wire_f (comm_header, type).wire_f (comm_header, special)
+	.wire_f (comm_header, length);
+}
+
+static void fields_comm_packet (wire_roundtrip<comm_packet>&t)
+{
+	t.wire_f (comm_packet, id).wire_f (comm_packet, ttl)
+	.wire_f (comm_packet, inst).wire_f (comm_packet, dof)
+	.wire_f (comm_packet, ds).wire_f (comm_packet, sof)
+	.wire_f (comm_packet, ss).wire_f (comm_packet, length);
+}
+
+static void fields_comm_compact (wire_roundtrip<comm_compact>&t)
+{
+	t.wire_f (comm_compact, id);
+}
+
+static void fields_comm_cap_entry (wire_roundtrip<comm_cap_entry>&t)
+{
+	t.wire_f (comm_cap_entry, tag).wire_f (comm_cap_entry, length);
+}
+
+static void fields_comm_route_entry (wire_roundtrip<comm_route_entry>&t)
+{
+	t.wire_f (comm_route_entry, ping).wire_f (comm_route_entry, dist)
+	.wire_f (comm_route_entry, inst).wire_f (comm_route_entry, addr_size);
+}
+
+static uint32_t random_varint_value()
+{
+	//all encoded lengths equally likely
+	int bits = 1 + rand() % 32;
+	uint32_t v = ( (uint32_t) rand() << 16) ^ rand() ^ ( (uint32_t) rand() << 31);
+	return bits < 32 ? v & ( (1U << bits) - 1) : v;
+}
+
+static bool varint_test()
+{
+	uint8_t buf[2 * wire_varint_max];
+	uint32_t v, d;
+	size_t n;
+
+	for (int r = 0;r < wire_test_rounds;++r) {
+		v = random_varint_value();
+		n = wire_put_varint (buf, v);
+		if (n > wire_varint_max) return false;
+
+		wire_reader w (buf, n);
+		if (!w.varint (d) || (d != v) || w.left) return false;
+
+		//any truncation must fail
+		wire_reader t (buf, rand() % n);
+		if (t.varint (d) ) return false;
+	}
+
+	//continuation on every byte is never valid
+	memset (buf, 0xff, sizeof (buf) );
+	wire_reader g (buf, sizeof (buf) );
+	if (g.varint (d) || (g.left != sizeof (buf) - wire_varint_max) )
+		return false;
+	return true;
+}
+
+static bool reader_test()
+{
+	uint8_t buf[64];
+	const uint8_t*p;
+	size_t len, n, pos;
+
+	for (int r = 0;r < wire_test_rounds;++r) {
+		len = rand() % sizeof (buf);
+		wire_reader w (buf, len);
+		pos = 0;
+		for (int i = 0;i < 8;++i) {
+			n = rand() % 24;
+			p = w.take (n);
+			if (pos + n > len) {
+				if (p || (w.left != len - pos) ) return false;
+				continue;
+			}
+			if (p != buf + pos) return false;
+			pos += n;
+		}
+		if (w.left != len - pos) return false;
+	}
+	return true;
+}
+
+int bench_wire_run()
+{
+	bool ok = true;
+	srand (0);
+
+	ok = wire_test<gate_header> ("gate_header", fields_gate_header) && ok;
+	ok = wire_test<gate_route_entry> ("gate_route_entry",
+	                                  fields_gate_route_entry) && ok;
+	ok = wire_test<gate_packet> ("gate_packet", fields_gate_packet) && ok;
+	ok = wire_test<comm_header> ("comm_header", fields_comm_header) && ok;
+	ok = wire_test<comm_packet> ("comm_packet", fields_comm_packet) && ok;
+	ok = wire_test<comm_compact> ("comm_compact", fields_comm_compact) && ok;
+	ok = wire_test<comm_cap_entry> ("comm_cap_entry",
+	                                fields_comm_cap_entry) && ok;
+	ok = wire_test<comm_route_entry> ("comm_route_entry",
+	                                  fields_comm_route_entry) && ok;
+	if (!varint_test() ) {
+		printf ("varint FAILED the round trip\n");
+		ok = false;
+	}
+	if (!reader_test() ) {
+		printf ("wire_reader FAILED the bounds check\n");
+		ok = false;
+	}
+	printf ("round trips %s\n", ok ? "ok" : "FAILED");
+	if (!ok) return 1;
+
+	uint8_t buf[64];
+	volatile uint32_t sink = 0;
+	uint32_t x, t;
+	uint64_t start;
+
+	//full frame header, as write_full_packet and handle_packet do it
+	start = timestamp_precise();
+	for (uint32_t i = 0;i < wire_bench_frames;++i) {
+		uint8_t*p = buf + (i & 7);
+		comm_header::type::put (p, 3);
+		comm_header::special::put (p, 0);
+		comm_header::length::put (p, (uint16_t) (i + 20) );
+		p += comm_header::size;
+		comm_packet::id::put (p, i);
+		comm_packet::ttl::put (p, 64);
+		comm_packet::inst::put (p, i * 7);
+		comm_packet::dof::put (p, 0);
+		comm_packet::ds::put (p, 6);
+		comm_packet::sof::put (p, 6);
+		comm_packet::ss::put (p, 6);
+		comm_packet::length::put (p, (uint16_t) i);
+		sink = sink + p[i & 15];
+	}
+	printf ("full header encode   %6.2fns/frame\n",
+	        1000.0 * (timestamp_precise() - start) / wire_bench_frames);
+
+	start = timestamp_precise();
+	for (uint32_t i = 0;i < wire_bench_frames;++i) {
+		const uint8_t*p = buf + (i & 7);
+		buf[i & 15] = (uint8_t) i;
+		x = comm_header::length::get (p) + comm_header::type::get (p);
+		p += comm_header::size;
+		x += comm_packet::id::get (p) + comm_packet::ttl::get (p)
+		     + comm_packet::inst::get (p) + comm_packet::dof::get (p)
+		     + comm_packet::ds::get (p) + comm_packet::sof::get (p)
+		     + comm_packet::ss::get (p) + comm_packet::length::get (p);
+		sink = sink + x;
+	}
+	printf ("full header decode   %6.2fns/frame\n",
+	        1000.0 * (timestamp_precise() - start) / wire_bench_frames);
+
+	//compact header with the ethernet layout implied
+	start = timestamp_precise();
+	for (uint32_t i = 0;i < wire_bench_frames;++i) {
+		uint8_t*p = buf + (i & 7);
+		comm_compact::id::put (p, i);
+		p += comm_compact::size;
+		p += wire_put_varint (p, 64);
+		wire_codec<uint32_t>::put (p, i * 7);
+		sink = sink + p[i & 3];
+	}
+	printf ("compact header encode %5.2fns/frame\n",
+	        1000.0 * (timestamp_precise() - start) / wire_bench_frames);
+
+	comm_compact::id::put (buf, 0);
+	wire_put_varint (buf + comm_compact::size, 64);
+	start = timestamp_precise();
+	for (uint32_t i = 0;i < wire_bench_frames;++i) {
+		buf[i & 3] = (uint8_t) i;
+		wire_reader r (buf, comm_compact::size + 1 + 4);
+		x = comm_compact::id::get (r.take<comm_compact>() );
+		if (!r.varint (t) ) break;
+		x += t + wire_codec<uint32_t>::get (r.take (4) );
+		sink = sink + x;
+	}
+	printf ("compact header decode %5.2fns/frame\n",
+	        1000.0 * (timestamp_precise() - start) / wire_bench_frames);
+	return 0;
+}
+
+/*
+ * Framing benchmark
+ *
+ * Bytes on the wire per packet of a mixed profile of ethernet frames,
+ * written by the real frame encoders: full headers, compact headers over
+ * a stream (instance mostly remembered) and over datagrams (instance
+ * always explicit). TLS record overhead comes on top of that and doesn't
+ * depend on the framing.
+ */
+
+#define frame_bench_packets 100000
+
+class frame_profile_entry
+{
+public:
+	const char*name;
+	int percent;
+	size_t size;
+};
+
+static const frame_profile_entry frame_profile[] = {
+	{"voice", 40, 214}, //G.711 20ms in RTP/UDP/IPv4
+	{"game", 20, 110},
+	{"tcp ack", 25, 66},
+	{"bulk", 15, 1514},
+};
+
+#define n_frame_profile (sizeof (frame_profile) / sizeof (frame_profile[0]) )
+
+static size_t frame_bytes (connection&c, packet_frame&f, bool compact)
+{
+	size_t l = c.data_q.len();
+	if (compact) c.write_compact_packet (f, c.data_q);
+	else c.write_full_packet (f, c.data_q);
+	l = c.data_q.len() - l;
+	c.data_q.read (c.data_q.len() );
+	return l;
+}
+
+int bench_frame_run()
+{
+	static uint8_t payload[1514];
+	connection full (0), stream (1), dgram (2);
+	uint64_t bytes[n_frame_profile][3], packets[n_frame_profile];
+	uint64_t total[3] = {0, 0, 0}, total_payload = 0;
+	uint32_t inst = 1;
+	size_t k;
+	int r;
+
+	pool_init();
+	stream.features = dgram.features = feat_compact;
+	dgram.dgram = true;
+	memset (bytes, 0, sizeof (bytes) );
+	memset (packets, 0, sizeof (packets) );
+
+	srand (0);
+	for (int i = 0;i < frame_bench_packets;++i) {
+		r = rand() % 100;
+		for (k = 0;k + 1 < n_frame_profile;++k) {
+			if (r < frame_profile[k].percent) break;
+			r -= frame_profile[k].percent;
+		}
+		//mostly the same instance as before, broadcasts here and there
+		if (! (rand() % 10) ) inst = 1 + rand() % 4;
+		bool bcast = ! (rand() % 50);
+
+		packet_frame f (i, 64, inst, 0, bcast ? 0 : 6, 6, 6,
+		                payload, frame_profile[k].size);
+		++packets[k];
+		bytes[k][0] += frame_bytes (full, f, false);
+		bytes[k][1] += frame_bytes (stream, f, true);
+		bytes[k][2] += frame_bytes (dgram, f, true);
+		total_payload += frame_profile[k].size;
+	}
+
+	printf ("%-10s %8s %10s %10s %10s\n", "packets", "payload",
+	        "full", "compact", "datagram");
+	for (k = 0;k < n_frame_profile;++k) {
+		if (!packets[k]) continue;
+		printf ("%-10s %7zuB", frame_profile[k].name,
+		        frame_profile[k].size);
+		for (int j = 0;j < 3;++j) {
+			printf (" %9.2fB", (double) bytes[k][j] / packets[k]);
+			total[j] += bytes[k][j];
+		}
+		printf ("\n");
+	}
+	printf ("%-10s %7.1fB", "all", (double) total_payload
+	        / frame_bench_packets);
+	for (int j = 0;j < 3;++j)
+		printf (" %9.2fB", (double) total[j] / frame_bench_packets);
+	printf ("\nheader share of wire bytes: full %.1f%%, compact %.1f%%, "
+	        "datagram %.1f%%\n",
+	        100.0 * (total[0] - total_payload) / total[0],
+	        100.0 * (total[1] - total_payload) / total[1],
+	        100.0 * (total[2] - total_payload) / total[2]);
+	return 0;
+}
+
+/*
+ * Compressor tests and benchmark
+ *
+ * Payloads of several kinds and sizes must come back unchanged through
+ * lz_compress/lz_decompress, wrong output sizes must be refused, and the
+ * decompressor must never write past its output on garbage or damaged
+ * input (a canary after the output checks that). Then the entropy
+ * estimate, ratio and speed are shown for text-like and random payloads.
+ */
+
+#define lz_test_rounds 20000
+#define lz_test_max 9000
+#define lz_bench_usec 200000
+#define lz_canary 16
+
+enum { lz_zeros, lz_text, lz_pattern, lz_random, lz_kinds };
+
+static const char*lz_kind_names[lz_kinds] = {
+	"zeros", "text", "pattern", "random"
+};
+
+static void lz_fill (vector<uint8_t>&d, size_t size, int kind)
+{
+	static const char*words[] = {"the ", "packet ", "route ", "of ",
+	                             "cloud ", "and ", "<a href=\"", "\">\n",
+	                             "GET /index.html HTTP/1.1\r\n", "0123 "
+	                            };
+	d.resize (size);
+	for (size_t i = 0;i < size;) switch (kind) {
+		case lz_zeros:
+			d[i++] = 0;
+			break;
+		case lz_text: {
+			const char*w = words[rand() % 10];
+			while (*w && (i < size) ) d[i++] = *w++;
+			break;
+		}
+		case lz_pattern:
+			d[i] = (uint8_t) (i % 7 + (rand() % 16 ? 0 : rand() ) );
+			++i;
+			break;
+		default:
+			d[i++] = rand();
+		}
+}
+
+static bool lz_canary_ok (const vector<uint8_t>&d, size_t size)
+{
+	for (size_t i = size;i < size + lz_canary;++i)
+		if (d[i] != 0xa5) return false;
+	return true;
+}
+
+static bool lz_test()
+{
+	vector<uint8_t> in, z (2 * lz_test_max + 64), out;
+	size_t size, zs, max;
+
+	for (int r = 0;r < lz_test_rounds;++r) {
+		int kind = r % lz_kinds;
+		size = (r < 1000) ? r % 300 : rand() % lz_test_max;
+		lz_fill (in, size, kind);
+
+		//room for incompressible data, so this must succeed
+		max = size + size / 255 + 16;
+		zs = lz_compress (& (in[0]), size, & (z[0]), max);
+		if (!zs || (zs > max) ) {
+			printf ("compressing %zuB of %s failed\n",
+			        size, lz_kind_names[kind]);
+			return false;
+		}
+
+		out.assign (size + 1 + lz_canary, 0xa5);
+		if (!lz_decompress (& (z[0]), zs, & (out[0]), size)
+		        || memcmp (& (out[0]), & (in[0]), size)
+		        || !lz_canary_ok (out, size) ) {
+			printf ("%zuB of %s didn't round-trip\n",
+			        size, lz_kind_names[kind]);
+			return false;
+		}
+
+		//wrong sizes are refused
+		out.assign (size + 1 + lz_canary, 0xa5);
+		if (lz_decompress (& (z[0]), zs, & (out[0]), size + 1)
+		        || (size && lz_decompress (& (z[0]), zs,
+		                                   & (out[0]), size - 1) ) ) {
+			printf ("%zuB of %s decompressed with a wrong size\n",
+			        size, lz_kind_names[kind]);
+			return false;
+		}
+
+		//too small output for the compressor fails cleanly
+		if (size > 16) {
+			z[size / 2] = 0xa5;
+			zs = lz_compress (& (in[0]), size, & (z[0]), size / 2);
+			if ( (zs > size / 2) || (z[size / 2] != 0xa5) ) {
+				printf ("compressing %zuB of %s overflowed\n",
+				        size, lz_kind_names[kind]);
+				return false;
+			}
+		}
+
+		//damaged stream: any result, but no writes past the output
+		zs = lz_compress (& (in[0]), size, & (z[0]), max);
+		for (int k = 1 + rand() % 4;k;--k) z[rand() % (zs + 1)] = rand();
+		if (rand() % 2) zs = rand() % (zs + 1);
+		out.assign (size + lz_canary, 0xa5);
+		lz_decompress (& (z[0]), zs, & (out[0]), size);
+		if (!lz_canary_ok (out, size) ) {
+			printf ("damaged stream wrote past the output\n");
+			return false;
+		}
+
+		//pure garbage
+		zs = rand() % 512;
+		for (size_t i = 0;i < zs;++i) z[i] = rand();
+		size = rand() % lz_test_max;
+		out.assign (size + lz_canary, 0xa5);
+		lz_decompress (& (z[0]), zs, & (out[0]), size);
+		if (!lz_canary_ok (out, size) ) {
+			printf ("garbage input wrote past the output\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+int bench_lz_run()
+{
+	static const size_t sizes[] = {128, 256, 512, 1400, 8192};
+	vector<uint8_t> in, z (2 * lz_test_max), out (lz_test_max);
+	uint64_t start, bytes;
+	size_t zs = 0;
+	double ctime, dtime;
+
+	srand (0);
+	if (!lz_test() ) {
+		printf ("round trips FAILED\n");
+		return 1;
+	}
+	printf ("round trips ok\n");
+
+	printf ("%-8s %6s %8s %8s %8s %10s %10s\n", "payload", "size",
+	        "entropy", "random", "ratio", "compress", "decompress");
+	for (int kind = lz_text;kind < lz_kinds;++kind)
+		for (size_t j = 0;j < sizeof (sizes) / sizeof (sizes[0]);++j) {
+			lz_fill (in, sizes[j], kind);
+
+			start = timestamp_precise();
+			bytes = 0;
+			while (timestamp_precise() - start < lz_bench_usec)
+				for (int i = 0;i < 64;++i) {
+					zs = lz_compress (& (in[0]), in.size(),
+					                  & (z[0]), z.size() );
+					bytes += in.size();
+				}
+			ctime = (double) (timestamp_precise() - start) / bytes;
+
+			start = timestamp_precise();
+			bytes = 0;
+			while (timestamp_precise() - start < lz_bench_usec)
+				for (int i = 0;i < 64;++i) {
+					lz_decompress (& (z[0]), zs,
+					               & (out[0]), in.size() );
+					bytes += in.size();
+				}
+			dtime = (double) (timestamp_precise() - start) / bytes;
+
+			printf ("%-8s %5zuB %8.2f %8.2f %8.2f %6.0fMB/s "
+			        "%6.0fMB/s\n", lz_kind_names[kind], sizes[j],
+			        lz_entropy (& (in[0]), in.size() ),
+			        lz_entropy_random (in.size() ),
+			        (double) zs / in.size(), 1 / ctime, 1 / dtime);
+			fflush (stdout);
+		}
+	return 0;
+}
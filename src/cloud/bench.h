@@ -0,0 +1,91 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_BENCH_H
+#define _CVPN_BENCH_H
+
+#include <string>
+using std::string;
+
+/*
+ * AEAD cipher benchmark
+ *
+ * Measures how fast the TLS AEAD ciphers encrypt on this host (AES is slow
+ * without hardware support, ChaCha20 without vector units), so that the
+ * GnuTLS priority can prefer what's fast here.
+ */
+
+//base priority with the measured ciphers moved in front, fastest first
+string bench_cipher_priority (const string&base);
+
+//standalone mode (cipher_bench option), prints a table, returns exit code
+int bench_ciphers_run();
+
+/*
+ * Zerocopy benchmark (zerocopy_bench option)
+ *
+ * Compares sender CPU per byte of copying and MSG_ZEROCOPY sends of various
+ * sizes, to find where zerocopy_threshold should be. Runs over loopback, or
+ * against zerocopy_bench_target which must read and discard the data.
+ */
+
+int bench_zerocopy_run();
+
+/*
+ * Copy engine benchmark (memcpy_bench option)
+ *
+ * Checks sq_memcpy engines against memmove() on overlapping ranges, then
+ * prints their speed for packet sizes up to the default conn-mtu.
+ */
+
+int bench_memcpy_run();
+
+/*
+ * Queue benchmark (queue_bench option)
+ *
+ * Bytes copied by the queue itself per forwarded byte, squeue against the
+ * former compacting queue, for receive and send patterns.
+ */
+
+int bench_queue_run();
+
+/*
+ * Wire codec tests and benchmark (wire_bench option)
+ *
+ * Round-trips every frame layout, fuzzes varints and the bounds-checked
+ * reader, then times header encoding and decoding. Exits with 1 if any
+ * check fails.
+ */
+
+int bench_wire_run();
+
+/*
+ * Framing benchmark (frame_bench option)
+ *
+ * Bytes on the wire per packet for a mixed traffic profile, with full and
+ * compact packet headers.
+ */
+
+int bench_frame_run();
+
+/*
+ * Compressor tests and benchmark (lz_bench option)
+ *
+ * Round-trips payloads through the packet compressor, feeds damaged and
+ * garbage input to the decompressor, then prints entropy estimates, ratio
+ * and speed. Exits with 1 if any check fails.
+ */
+
+int bench_lz_run();
+
+#endif
+
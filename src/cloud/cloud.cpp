@@ -19,17 +19,21 @@
 #include "conf.h"
 #include "gate.h"
 #include "poll.h"
+#include "pool.h"
 #include "route.h"
 #include "status.h"
 #include "network.h"
 #include "security.h"
 #include "timestamp.h"
 #include "sighandler.h"
+#include "bench.h"
 
 #include <unistd.h>
 
 int g_terminate = 0;
 
+#define shaper_tick 2000 //usec to sleep while the upload shaper waits
+
 int main (int argc, char**argv)
 {
 	int ret = 0;
@@ -53,6 +57,41 @@ int main (int argc, char**argv)
 		goto failed_config;
 	}
 
+	if (config_is_true ("cipher_bench") ) {
+		ret = bench_ciphers_run();
+		goto failed_config;
+	}
+
+	if (config_is_true ("zerocopy_bench") ) {
+		ret = bench_zerocopy_run();
+		goto failed_config;
+	}
+
+	if (config_is_true ("memcpy_bench") ) {
+		ret = bench_memcpy_run();
+		goto failed_config;
+	}
+
+	if (config_is_true ("queue_bench") ) {
+		ret = bench_queue_run();
+		goto failed_config;
+	}
+
+	if (config_is_true ("wire_bench") ) {
+		ret = bench_wire_run();
+		goto failed_config;
+	}
+
+	if (config_is_true ("frame_bench") ) {
+		ret = bench_frame_run();
+		goto failed_config;
+	}
+
+	if (config_is_true ("lz_bench") ) {
+		ret = bench_lz_run();
+		goto failed_config;
+	}
+
 	if (!config_get_int ("heartbeat", heartbeat_usec) )
 		heartbeat_usec = 50000;
 	Log_info ("heartbeat is set to %d usec", heartbeat_usec);
@@ -120,10 +159,11 @@ int main (int argc, char**argv)
 
 		if ( (timestamp() - last_beat)
 		        < (unsigned int) heartbeat_usec) {
-			//poll more stuff
-			poll_wait_for_event (heartbeat_usec
-			                     - timestamp()
-			                     + last_beat);
+			//poll more stuff, shaped uploads get new tokens soon
+			int t = heartbeat_usec - timestamp() + last_beat;
+			if (comm_throttled() && (t > shaper_tick) )
+				t = shaper_tick;
+			poll_wait_for_event (t);
 			//send the results
 			comm_flush_data();
 			gate_flush_data();
@@ -135,6 +175,7 @@ int main (int argc, char**argv)
 		gate_periodic_update();
 		comm_periodic_update();
 		route_periodic_update();
+		pool_periodic_update();
 
 		status_try_export();
 	}
@@ -20,12 +20,23 @@
 #include "timestamp.h"
 #include "sq.h"
 #include "network.h"
+#include "lz.h"
+#include "ktls.h"
+#include "handshake.h"
+#include "dh.h"
+#include "bench.h"
+#include "fq.h"
 
 #include <gnutls/gnutls.h>
 #include <gnutls/openpgp.h>
 #include <gcrypt.h>
 
 #include <string.h>
+#ifndef __WIN32__
+#include <sys/poll.h>
+#else
+#define poll WSAPoll
+#endif
 
 #include <list>
 using namespace std;
@@ -33,6 +44,12 @@ using namespace std;
 static map<int, int> conn_index; //indexes socket FD to connection ID
 static map<int, connection> connections;  //indexes connection ID to real object
 static set<int> listeners; //set of listening FDs
+static set<int> dgram_listeners; //those of listeners that are datagram
+static set<int> plain_listeners; //those that drop TLS after the handshake
+typedef pair<string, uint32_t> bundle_key; //peer and side, bundle ID
+static map<bundle_key, vector<int> > bundles; //to stream conn IDs
+static int max_handshakes = 256; //in progress, incoming ones refused over
+static uint64_t startup_time = 0; //for reporting the first accept
 
 /*
  * functions that return references to static members, so others can access
@@ -59,8 +76,11 @@ set<int>& comm_listeners()
  */
 
 static gnutls_certificate_credentials_t xcred;
-static gnutls_dh_params_t dh_params;
 static gnutls_priority_t prio_cache;
+static gnutls_datum_t cookie_key; //for DTLS hello verification
+static gnutls_datum_t ticket_key; //for session tickets, if enabled
+static bool resumption = true;
+static map<string, vector<uint8_t> > session_cache; //by connect_address
 
 /*
  * GnuTLS initialization
@@ -85,6 +105,7 @@ static int ssl_initialize()
 	bool use_x509_keys = false, use_pgp_keys = false;
 
 	Log_info ("Initializing ssl layer");
+	startup_time = timestamp_precise();
 
 	if ( config_get ("x509key", keypath) && config_get ("x509cert", certpath) ) {
 		use_x509_keys = true;
@@ -135,51 +156,12 @@ static int ssl_initialize()
 		}
 	}
 
-	//load DH params, or generate some.
-	gnutls_dh_params_init (&dh_params);
-
-	if (config_get ("x509dh", t) ) {
-		FILE*f;
-		long s;
-		vector<uint8_t>buffer;
-
-		f = fopen (t.c_str(), "r");
-		if (!f) {
-			Log_error ("can't open DH params file");
-			return 5;
-		}
-
-		fseek (f, 0, SEEK_END);
-		s = ftell (f);
-		fseek (f, 0, SEEK_SET);
-		if ( (s <= 0) || s > 65536) { //prevent too large files.
-			Log_error ("DH params file empty or too big");
-			fclose (f);
-			return 6;
-		}
-
-		buffer.resize (s, 0);
-		if (fread (buffer.begin().base(), s, 1, f) != 1) {
-			Log_error ("bad DH param read");
-			fclose (f);
-			return 7;
-		}
-		fclose (f);
-
-		gnutls_datum_t data = {buffer.begin().base(), s};
-
-		if (gnutls_dh_params_import_pkcs3
-		        (dh_params, &data, GNUTLS_X509_FMT_PEM) ) {
-			Log_error ("DH params importing failed");
-			return 8;
-		}
-
-	} else {
-		gnutls_dh_params_generate2 (dh_params, 1024);
+	//load DH params, or start generating some.
+	{
+		int r = dh_init (xcred);
+		if (r) return r;
 	}
 
-	gnutls_certificate_set_dh_params (xcred, dh_params);
-
 	if (use_x509_keys) {
 		//load CAs and CRLs
 		list<string> l;
@@ -218,13 +200,39 @@ static int ssl_initialize()
 
 	gnutls_certificate_set_verify_limits (xcred, 32768, 8);
 
-	if (gnutls_priority_init (&prio_cache,
-	                          config_get ("tls_prio_str", t) ?
-	                          t.c_str() : "NORMAL", NULL) ) {
+	/*
+	 * Without explicit priority, the ciphers are ordered by how fast they
+	 * are on this host, and the accepting side's order is the one used.
+	 */
+	if (!config_get ("tls_prio_str", t) ) {
+		t = "NORMAL";
+		if (!config_is_set ("tls_prio_auto")
+		        || config_is_true ("tls_prio_auto") ) {
+			t = bench_cipher_priority (t) + ":%SERVER_PRECEDENCE";
+			Log_info ("TLS priority is %s", t.c_str() );
+		}
+	}
+
+	if (gnutls_priority_init (&prio_cache, t.c_str(), NULL) ) {
 		Log_error ("gnutls priority initialization failed");
 		return 8;
 	}
 
+	if (gnutls_key_generate (&cookie_key, GNUTLS_COOKIE_KEY_SIZE) ) {
+		Log_error ("DTLS cookie key generation failed");
+		return 9;
+	}
+
+	resumption = !config_is_set ("tls_resumption")
+	             || config_is_true ("tls_resumption");
+	if (resumption) {
+		if (gnutls_session_ticket_key_generate (&ticket_key) ) {
+			Log_error ("session ticket key generation failed");
+			return 10;
+		}
+		Log_info ("TLS session resumption enabled");
+	}
+
 	Log_info ("SSL initialized OK");
 	return 0;
 }
@@ -234,7 +242,10 @@ static int ssl_destroy()
 	Log_info ("destroying SSL layer");
 	gnutls_certificate_free_credentials (xcred);
 	gnutls_priority_deinit (prio_cache);
-	gnutls_dh_params_deinit (dh_params);
+	dh_destroy();
+	gnutls_free (cookie_key.data);
+	if (resumption) gnutls_free (ticket_key.data);
+	session_cache.clear();
 	gnutls_global_deinit();
 	return 0;
 }
@@ -319,6 +330,14 @@ static int try_accept_connection (int sock)
 		return 2;
 	}
 
+	if (comm_handshakes_pending() >= max_handshakes) {
+		Log_info ("%d handshakes in progress, closing %d",
+		          max_handshakes, s);
+		++connection::all_handshakes_refused;
+		close (s);
+		return 0;
+	}
+
 	int cid = connection_alloc();
 	if (cid < 0) {
 		Log_info ("connection limit %d hit, closing %d",
@@ -329,7 +348,8 @@ static int try_accept_connection (int sock)
 	connection&c = connections[cid];
 
 	c.set_fd (s);
-	c.state = cs_accepting;
+	c.set_state (cs_accepting);
+	c.plain = plain_listeners.count (sock);
 	c.peer_addr_str = peer_addr_str;
 	c.peer_connected_since = timestamp();
 
@@ -338,7 +358,8 @@ static int try_accept_connection (int sock)
 	return 0;
 }
 
-static int connect_connection (const string&addr)
+static int connect_connection (const string&addr, uint32_t bundle = 0,
+                               int index = 0, int count = 0)
 {
 	int cid = connection_alloc();
 	if (cid < 0) {
@@ -353,9 +374,133 @@ static int connect_connection (const string&addr)
 
 	connection&c = connections[cid];
 
-	c.state = cs_retry_timeout;
+	c.set_state (cs_retry_timeout);
 	c.last_retry = 0;
 	c.connect_address = addr;
+	c.bundle_id = bundle;
+	c.bundle_index = index;
+	c.bundle_count = count;
+
+	return 0;
+}
+
+/*
+ * Datagram listeners. The first datagram from a peer must be a hello with
+ * a valid cookie (which is stateless, so spoofed floods don't create any
+ * connections); after that, the peer gets its own connected socket.
+ */
+
+#define dgram_prefix "dtls:"
+
+static bool dgram_address (const string&a, string&addr)
+{
+	size_t n = strlen (dgram_prefix);
+	if (a.compare (0, n, dgram_prefix) ) {
+		addr = a;
+		return false;
+	}
+	addr = a.substr (n);
+	return true;
+}
+
+/*
+ * "plain:" links authenticate by the TLS handshake as usual, then both
+ * sides send the frames over the bare socket. Meant for trusted paths
+ * only (unix sockets, encrypted underlays); both ends must use it, which
+ * they check by the greeting, see activate().
+ */
+
+#define plain_prefix "plain:"
+
+static bool plain_address (const string&a, string&addr)
+{
+	size_t n = strlen (plain_prefix);
+	if (a.compare (0, n, plain_prefix) ) {
+		addr = a;
+		return false;
+	}
+	addr = a.substr (n);
+	return true;
+}
+
+class dgram_reply
+{
+public:
+	int fd;
+	sockaddr*addr;
+	socklen_t len;
+};
+
+static ssize_t dgram_reply_push (gnutls_transport_ptr_t p,
+                                 const void*data, size_t len)
+{
+	dgram_reply&r = * (dgram_reply*) p;
+	return sendto (r.fd, (const char*) data, len, 0, r.addr, r.len);
+}
+
+static int try_accept_dgram (int sock)
+{
+	static uint8_t buf[0x10000];
+	sockaddr_type addr;
+	socklen_t addrsize = sizeof (sockaddr_type);
+	int n = recvfrom (sock, (char*) buf, sizeof (buf), 0,
+	                  & (addr.sa), &addrsize);
+	if (n < 0) {
+		if ( (errno == EWOULDBLOCK) || (errno == EAGAIN) || (!errno) )
+			return 0;
+		Log_error ("recvfrom(%d) failed with %d: %s",
+		           sock, errno, strerror (errno) );
+		return 1;
+	}
+
+	gnutls_dtls_prestate_st prestate;
+	memset (&prestate, 0, sizeof (prestate) );
+	int r = gnutls_dtls_cookie_verify (&cookie_key, & (addr.sa), addrsize,
+	                                   buf, n, &prestate);
+	if (r == GNUTLS_E_BAD_COOKIE) {
+		dgram_reply rep = { sock, & (addr.sa), addrsize };
+		gnutls_dtls_cookie_send (&cookie_key, & (addr.sa), addrsize,
+		                         &prestate, (gnutls_transport_ptr_t) &rep,
+		                         dgram_reply_push);
+		return 0;
+	}
+	if (r < 0) return 0; //some late datagram, not a hello
+
+	string peer_addr_str = sockaddr_to_str (& (addr.sa) );
+
+	if (comm_handshakes_pending() >= max_handshakes) {
+		++connection::all_handshakes_refused;
+		return 0; //the peer retransmits the hello later
+	}
+
+	//retransmitted hello that came before the peer socket was connected
+	map<int, connection>::iterator i;
+	for (i = connections.begin();i != connections.end();++i)
+		if (i->second.dgram && (i->second.peer_addr_str == peer_addr_str) )
+			return 0;
+
+	int s = udp_peer_socket (sock, & (addr.sa), addrsize);
+	if (s < 0) return 2;
+
+	Log_info ("get datagram connection from address %s on socket %d",
+	          peer_addr_str.c_str(), s);
+
+	int cid = connection_alloc();
+	if (cid < 0) {
+		Log_info ("connection limit %d hit, closing %d",
+		          max_connections, s);
+		close (s);
+		return 0;
+	}
+
+	connection&c = connections[cid];
+
+	c.set_fd (s);
+	c.set_state (cs_accepting);
+	c.peer_addr_str = peer_addr_str;
+	c.peer_connected_since = timestamp();
+
+	c.start_accept_dgram (buf, n, prestate);
 
 	return 0;
 }
@@ -395,30 +540,50 @@ void connection::deindex()
 #define pt_echo_request 4
 #define pt_echo_reply 5
 #define pt_route_request 6
+#define pt_packet_compact 7
+#define pt_caps 8
+
+//capability frame tags, unknown ones are skipped
+#define cap_features 1
+#define cap_max_frame 2
+#define cap_max_record 3
+#define cap_bundle_id 4
+#define cap_bundle_stream 5 //index<<16 | count
+
+//compact packet flags (in special byte)
+#define pc_same_inst 0x01
+#define pc_layout_mask 0x06
+#define pc_layout_explicit 0x00
+#define pc_layout_eth 0x02 //0,6,6,6
+#define pc_layout_eth_bcast 0x04 //0,0,6,6
+#define pc_compressed 0x08
+#define pc_prio_mask 0x30
+#define pc_prio_shift 4
+#define pc_side 0x40 //explicit instance that isn't remembered
 
 //sizes
-#define p_head_size 4
+#define p_head_size comm_header::size
+#define tls_record_size 16384
+#define read_min_size 2048
+#define plain_read_max 65536 //no records to fit in
 
-static void add_packet_header (pusher&b, uint8_t type,
+static void add_packet_header (uint8_t*b, uint8_t type,
                                uint8_t special, uint16_t size)
 {
-	b.push<uint8_t> (type);
-	b.push<uint8_t> (special);
-	b.push<uint16_t> (htons (size) );
+	comm_header::type::put (b, type);
+	comm_header::special::put (b, special);
+	comm_header::length::put (b, size);
 }
 
 static bool parse_packet_header (squeue&q, uint8_t&type,
                                  uint8_t&special, uint16_t&size)
 {
-	if (q.len() < p_head_size) return false;
-	uint8_t t;
-	q.pop<uint8_t> (t);
-	type = t;
-	q.pop<uint8_t> (t);
-	special = t;
-	uint16_t t2 = 0;
-	q.pop<uint16_t> (t2);
-	size = ntohs (t2);
+	const uint8_t*h = q.window (p_head_size);
+	if (!h) return false;
+	type = comm_header::type::get (h);
+	special = comm_header::special::get (h);
+	size = comm_header::length::get (h);
+	q.read (p_head_size);
 	return true;
 }
 
@@ -426,65 +591,218 @@ static bool parse_packet_header (squeue&q, uint8_t&type,
  * handlers of incoming information
  */
 
-void connection::handle_packet (uint8_t*buf, int len)
+void connection::handle_packet (uint8_t special, uint8_t*buf, int len)
 {
 	if (dbl_enabled) {
 		if (dbl_over > (unsigned int) dbl_burst) return;
 		dbl_over += len + 4;
 	}
 
-	uint16_t dof, ds, sof, ss, s, ttl;
-	uint32_t inst, ID;
+	uint16_t dof, ds, sof, ss, s;
+	const uint8_t*h, *data;
+	wire_reader r (buf, len);
 
-	if (len < 20) goto error;
+	if (! (h = r.take<comm_packet>() ) ) goto error;
 
-	ID = ntohl (* (uint32_t*) buf);
-	ttl = ntohs (* (uint16_t*) (buf + 4) );
-	inst = ntohl (* (uint32_t*) (buf + 6) );
-	dof = ntohs (* (uint16_t*) (buf + 10) );
-	ds = ntohs (* (uint16_t*) (buf + 12) );
-	sof = ntohs (* (uint16_t*) (buf + 14) );
-	ss = ntohs (* (uint16_t*) (buf + 16) );
-	s = ntohs (* (uint16_t*) (buf + 18) );
+	dof = comm_packet::dof::get (h);
+	ds = comm_packet::ds::get (h);
+	sof = comm_packet::sof::get (h);
+	ss = comm_packet::ss::get (h);
+	s = comm_packet::length::get (h);
 
-	if ( (len < 20 + (int) s)
+	if ( (! (data = r.take (s) ) )
 	        || (s < (int) dof + (int) ds)
 	        || (s < (int) sof + (int) ss) )
 		goto error;
 
 	stat_packet (true, len + p_head_size);
-	route_packet (ID, ttl, inst, dof, ds, sof, ss, s, buf + 20, id);
+	route_packet (comm_packet::id::get (h), comm_packet::ttl::get (h),
+	              comm_packet::inst::get (h),
+	              dof, ds, sof, ss, s, data, bundle_primary(),
+	              special < prio_classes ? special : prio_best_effort);
 	return;
 error:
 	Log_info ("connection %d broadcast read corruption", id);
 	reset();
 }
 
+void connection::handle_compact_packet (uint8_t flags,
+                                        uint8_t*buf, int len)
+{
+	if (dbl_enabled) {
+		if (dbl_over > (unsigned int) dbl_burst) return;
+		dbl_over += len + 4;
+	}
+
+	uint32_t ID, ttl, inst, dof, ds, sof, ss, s;
+	const uint8_t*h, *data;
+	wire_reader r (buf, len);
+
+	if (! (local_features & feat_compact) ) goto error;
+
+	if (! (h = r.take<comm_compact>() ) ) goto error;
+	ID = comm_compact::id::get (h);
+	if (!r.varint (ttl) ) goto error;
+
+	if (flags & pc_same_inst) {
+		if (!compact_rx_valid) goto error;
+		inst = compact_rx_inst;
+	} else {
+		if (! (h = r.take (4) ) ) goto error;
+		inst = wire_codec<uint32_t>::get (h);
+		if (! (flags & pc_side) ) {
+			compact_rx_inst = inst;
+			compact_rx_valid = true;
+		}
+	}
+
+	switch (flags & pc_layout_mask) {
+	case pc_layout_eth:
+		dof = 0;
+		ds = sof = ss = 6;
+		break;
+	case pc_layout_eth_bcast:
+		dof = ds = 0;
+		sof = ss = 6;
+		break;
+	case pc_layout_explicit:
+		if (! (r.varint (dof) && r.varint (ds)
+		        && r.varint (sof) && r.varint (ss) ) ) goto error;
+		break;
+	default:
+		goto error;
+	}
+
+	data = r.p;
+	s = r.left;
+	if (flags & pc_compressed) {
+		static uint8_t zbuf[0x10000];
+		if (! (local_features & feat_compress) ) goto error;
+		if (!r.varint (s) || (s >= sizeof (zbuf) ) ) goto error;
+		if (!lz_decompress (r.p, r.left, zbuf, s) ) goto error;
+		data = zbuf;
+	}
+
+	if ( (ttl > 0xffff) || (s < dof + ds) || (s < sof + ss) ) goto error;
+
+	stat_packet (true, len + p_head_size);
+	route_packet (ID, ttl, inst, dof, ds, sof, ss, s, data,
+	              bundle_primary(),
+	              (flags & pc_prio_mask) >> pc_prio_shift);
+	return;
+error:
+	Log_info ("connection %d compact packet read corruption", id);
+	reset();
+}
+
+void connection::handle_hello (uint8_t f)
+{
+	//datagram links repeat the hello, keep what the caps said
+	if (!caps_received && (features != (f & local_features) ) ) {
+		features = f & local_features;
+		Log_info ("connection %d negotiated features 0x%02x",
+		          id, features);
+	}
+	if ( (features & feat_caps) && !plain) write_caps(); //plain sent it
+}
+
+void connection::handle_caps (uint8_t*data, int n)
+{
+	uint32_t f = 0, v, bid = 0, bstream = 0;
+	uint8_t tag, len;
+	const uint8_t*h, *d;
+	wire_reader r (data, n);
+
+	while (r.left) {
+		if (! (h = r.take<comm_cap_entry>() ) ) goto error;
+		tag = comm_cap_entry::tag::get (h);
+		len = comm_cap_entry::length::get (h);
+		if (! (d = r.take (len) ) ) goto error;
+		if (len > 4) continue; //no integer, nothing we'd know
+
+		for (v = 0;len;--len) v = (v << 8) | *d++;
+		switch (tag) {
+		case cap_features:
+			f = v;
+			break;
+		case cap_max_frame:
+			peer_max_frame = v;
+			break;
+		case cap_max_record:
+			peer_max_record = v;
+			break;
+		case cap_bundle_id:
+			bid = v;
+			break;
+		case cap_bundle_stream:
+			bstream = v;
+			break;
+		}
+	}
+
+	if ( (f & feat_plain) ? !plain : (plain && !plain_rx) ) {
+		Log_error ("connection %d: %s", id, plain ?
+		           "peer doesn't use plaintext" : "peer wants plaintext");
+		reset();
+		return;
+	}
+	if (! (plain || (features & feat_caps) ) ) {
+		if (dgram) return; //our copy of the hello got lost
+		goto error;
+	}
+	if (plain && !plain_rx) {
+		//nothing of the TLS stream may be left behind
+		if ( (recv_q.len() != (size_t) n)
+		        || gnutls_record_check_pending (session) ) {
+			Log_error ("connection %d got TLS data after the "
+			           "plain link greeting", id);
+			reset();
+			return;
+		}
+		plain_rx = true;
+	}
+
+	features = f & local_features;
+	caps_received = true;
+	Log_info ("connection %d capabilities: features 0x%x, "
+	          "max frame %u, max record %u",
+	          id, features, peer_max_frame, peer_max_record);
+
+	if (! (features & feat_bundle) ) return;
+	if (!connect_address.length() && bid) {
+		bundle_id = bid;
+		bundle_index = bstream >> 16;
+		bundle_count = bstream & 0xffff;
+	}
+	if (bundle_id) bundle_join();
+	return;
+error:
+	Log_info ("connection %d capability frame corruption", id);
+	reset();
+}
+
 void connection::handle_route (bool set, uint8_t*data, int n)
 {
 	stat_packet (true, n + p_head_size);
+	if (bundle_secondary() ) return; //leftovers from before joining
 	if (set) remote_routes.clear();
 	route_set_dirty();
 
 	uint32_t remote_ping;
-	uint32_t remote_dist;
-	uint32_t instance;
-	uint16_t s;
-
-	while (n > 0) {
-		if (n < 14) goto error;
-		remote_ping = ntohl (* (uint32_t*) data);
-		remote_dist = ntohl (* (uint32_t*) (data + 4) );
-		instance = ntohl (* (uint32_t*) (data + 8) );
-		s = ntohs (* (uint16_t*) (data + 12) );
-		if (n < 14 + (int) s) goto error;
-
-		if (remote_ping) remote_routes
-			[address (instance,data+14,s) ] =
-			    remote_route (remote_ping, remote_dist);
-		else remote_routes.erase (address (instance, data + 14, s) );
-		n -= 14 + s;
-		data += 14 + s;
+	const uint8_t*h, *a;
+	wire_reader r (data, n);
+
+	while (r.left) {
+		if (! (h = r.take<comm_route_entry>() ) ) goto error;
+		if (! (a = r.take (comm_route_entry::addr_size::get (h) ) ) )
+			goto error;
+
+		address addr (comm_route_entry::inst::get (h), a,
+		              comm_route_entry::addr_size::get (h) );
+		remote_ping = comm_route_entry::ping::get (h);
+		if (remote_ping) remote_routes[addr] = remote_route
+			                (remote_ping, comm_route_entry::dist::get (h) );
+		else remote_routes.erase (addr);
 	}
 
 	handle_route_overflow();
@@ -522,90 +840,487 @@ void connection::handle_route_request ()
  * senders
  */
 
-void connection::write_packet (uint32_t id, uint16_t ttl,
-                               uint32_t inst,
-                               uint16_t dof, uint16_t ds,
-                               uint16_t sof, uint16_t ss,
-                               uint16_t s, const uint8_t*buf)
+#define p_frame_head_size (p_head_size + comm_packet::size)
+
+static void add_frame_header (uint8_t*b, packet_frame&f)
 {
-	size_t size = p_head_size + 20 + s;
+	//older nodes don't look at the special byte of packets
+	add_packet_header (b, pt_packet, f.prio,
+	                   comm_packet::size + f.payload.size);
+	b += p_head_size;
+	comm_packet::id::put (b, f.id);
+	comm_packet::ttl::put (b, f.ttl);
+	comm_packet::inst::put (b, f.inst);
+	comm_packet::dof::put (b, f.dof);
+	comm_packet::ds::put (b, f.ds);
+	comm_packet::sof::put (b, f.sof);
+	comm_packet::ss::put (b, f.ss);
+	comm_packet::length::put (b, f.payload.size);
+}
 
-	if (!can_write_data (size) ) try_write();
-	if (!can_write_data (size) ) return;
+const sq_ref& packet_frame::encode()
+{
+	if (frame.b) return frame;
 
-	if (s > mtu) return;
+	size_t size = p_frame_head_size + payload.size;
+	frame = sq_ref (sq_block_alloc (size) );
+	if (!frame.b) return frame;
 
-	pusher b (send_q.get_buffer (size) );
-	if (!b.d) return;
-	send_q.append (size);
+	uint8_t*b = frame->data();
+	add_frame_header (b, *this);
+	sq_memcpy (b + p_frame_head_size, payload.data, payload.size);
+	frame->used = size;
 
-	add_packet_header (b, pt_packet, 0, 20 + s);
-	b.push<uint32_t> (htonl (id) );
-	b.push<uint16_t> (htons (ttl) );
-	b.push<uint32_t> (htonl (inst) );
-	b.push<uint16_t> (htons (dof) );
-	b.push<uint16_t> (htons (ds) );
-	b.push<uint16_t> (htons (sof) );
-	b.push<uint16_t> (htons (ss) );
-	b.push<uint16_t> (htons (s) );
-	b.push ( (uint8_t*) buf, s);
+	//gates can share the payload part of the frame
+	if (!payload.blk.b) {
+		payload.blk = frame;
+		payload.data = b + p_frame_head_size;
+	}
+	return frame;
 }
 
-void connection::write_route_set (uint8_t*data, int n)
+void connection::write_packet (packet_frame&f)
 {
-	size_t size = p_head_size + n;
+	connection&c = bundle_stream (f);
+	if (&c != this) {
+		c.write_packet (f);
+		return;
+	}
 
-	pusher b (send_q.get_buffer (size) );
-	if (!b.d) return;
-	send_q.append (size);
+	bool ok;
 
-	add_packet_header (b, pt_route_set, 0, n);
-	b.push (data, n);
+	/*
+	 * Instances with an upload class wait in their own leaf. All leaves of
+	 * a connection together can hold as much as its data queue.
+	 */
+	if (shaper_enabled() && shaper_has_class (f.inst) ) {
+		shaper_leaf&lf = leaf (f.inst);
+		ok = (leaves_len + p_frame_head_size + f.payload.size
+		      < max_waiting_data_size)
+		     && write_to_queue (f, lf.q, lf.stamps, leaves_len);
+		if (!ok) ++lf.drops;
+		else if (!lf.backlogged) {
+			lf.backlogged = true;
+			backlog.push_back (f.inst);
+		}
+	} else if ( (f.prio != prio_best_effort) && prio_queueing()
+	            && prio_conforms (f) )
+		ok = (queued_data() + p_frame_head_size + f.payload.size
+		      < max_waiting_data_size)
+		     && write_to_queue (f, prio_q[f.prio], prio_stamps[f.prio],
+		                        prio_len);
+	else ok = write_data_packet (f);
+
+	if (ok) {
+		++prio_out[f.prio];
+		want_write();
+	} else ++prio_drops[f.prio];
 }
 
-void connection::write_route_diff (uint8_t*data, int n)
+bool connection::write_data_packet (packet_frame&f)
 {
-	size_t size = p_head_size + n;
+	size_t l = data_q.len();
+	if (features & feat_compact) write_compact_packet (f, data_q);
+	else write_full_packet (f, data_q);
+	if (data_q.len() == l) return false;
 
-	pusher b (send_q.get_buffer (size) );
-	if (!b.d) return;
-	send_q.append (size);
+	/*
+	 * With flow queueing, data_q only holds the frame just written. Flows
+	 * reorder and drop frames, so the peer can't know which instance came
+	 * last and the next frame has to name its own.
+	 */
+	if (fq_enabled() ) {
+		fq.enqueue (fq_hash (f.inst,
+		                     f.payload.data + f.dof, f.ds,
+		                     f.payload.data + f.sof, f.ss),
+		            data_q, max_waiting_data_size - prio_len, f.since);
+		compact_tx_valid = false;
+	} else data_stamps.push (data_q.len() - l, f.since, true);
+	return true;
+}
 
-	add_packet_header (b, pt_route_diff, 0, n);
-	b.push (data, n);
+bool connection::write_to_queue (packet_frame&f, sgqueue&q,
+                                 sojourn_stamps&stamps, size_t&total)
+{
+	size_t l = q.len();
+	if (features & feat_compact) write_compact_packet (f, q);
+	else write_full_packet (f, q);
+	if (q.len() == l) return false;
+
+	stamps.push (q.len() - l, f.since, true);
+	total += q.len() - l;
+	return true;
 }
 
-void connection::write_ping (uint8_t ID)
+shaper_leaf& connection::leaf (uint32_t inst)
 {
-	size_t size = p_head_size;
+	map<uint32_t, shaper_leaf>::iterator i = leaves.find (inst);
+	if (i == leaves.end() ) {
+		i = leaves.insert (pair<uint32_t, shaper_leaf>
+		                   (inst, shaper_leaf() ) ).first;
+		shaper_leaf_setup (inst, i->second, shaper);
+	}
+	return i->second;
+}
 
-	pusher b (send_q.get_buffer (size) );
-	if (!b.d) return;
-	send_q.append (size);
+/*
+ * Compact frames that overtake others can't use the "same instance" flag,
+ * so without the peer understanding pc_side, frames of all classes stay in
+ * data_q, in order.
+ */
 
-	add_packet_header (b, pt_echo_request, ID, 0);
+bool connection::prio_queueing()
+{
+	return ! (features & feat_compact) || (features & feat_prio);
 }
 
-void connection::write_pong (uint8_t ID)
+/*
+ * Classes are policed when the frame comes, so that a flood marked as
+ * voice gets no further than best effort does. The frame keeps its class
+ * on the wire (it may be shared with other connections), the next node
+ * polices it again.
+ */
+
+#define prio_burst 16384
+
+void connection::prio_setup()
 {
-	size_t size = p_head_size;
+	for (int i = 0;i < prio_classes;++i)
+		prio_police[i].setup (prio_rate[i], 0, prio_burst, 0);
+}
 
-	pusher b (send_q.get_buffer (size) );
-	if (!b.d) return;
-	send_q.append (size);
+bool connection::prio_conforms (packet_frame&f)
+{
+	size_t size = p_frame_head_size + f.payload.size;
+	shaper_class&p = prio_police[f.prio];
 
-	add_packet_header (b, pt_echo_reply, ID, 0);
+	if (p.allowance() < (int64_t) size) {
+		++prio_over[f.prio];
+		return false;
+	}
+	p.charge (size, false);
+	return true;
 }
 
-void connection::write_route_request ()
+void connection::write_full_packet (packet_frame&f, sgqueue&q)
 {
-	size_t size = p_head_size;
+	size_t size = p_frame_head_size + f.payload.size;
 
-	pusher b (send_q.get_buffer (size) );
-	if (!b.d) return;
-	send_q.append (size);
+	if (!can_queue (q, size) ) try_write();
+	if (!can_queue (q, size) ) return;
+
+	if (f.payload.size > max_frame() ) {
+		if (dgram) ++dgram_dropped;
+		return;
+	}
+
+	if ( (f.fanout > 1) || (f.payload.size >= sgqueue_share_size() ) ) {
+		const sq_ref&b = f.encode();
+		if (b.b) {
+			q.push_ref (b, b->data(), b->used);
+			if (f.uses++) {
+				++all_fanout_frames;
+				all_fanout_saved += size;
+			}
+			return;
+		}
+	}
+
+	uint8_t*b = q.get_buffer (p_frame_head_size);
+	if (!b) return;
+
+	add_frame_header (b, f);
+	q.append (p_frame_head_size);
+	q.push_payload (f.payload);
+}
+
+#define p_compact_max_head (p_head_size + comm_compact::size \
+                            + 4 + 6 * wire_varint_max)
+
+void connection::write_compact_packet (packet_frame&f, sgqueue&q)
+{
+	if (f.payload.size > max_frame() ) {
+		if (dgram) ++dgram_dropped;
+		return;
+	}
+	if (!can_queue (q, p_compact_max_head + f.payload.size) ) try_write();
+	if (!can_queue (q, p_compact_max_head + f.payload.size) ) return;
+
+	bool z = (features & feat_compress) && compress_payload (f);
+	size_t size = z ? f.zpayload->used : f.payload.size;
+
+	uint8_t*b = q.get_buffer (p_compact_max_head);
+	if (!b) return;
+
+	uint8_t flags = 0, *p = b + p_head_size;
+
+	comm_compact::id::put (p, f.id);
+	p += comm_compact::size;
+	p += wire_put_varint (p, f.ttl);
+
+	/*
+	 * Datagrams may get lost, so they can't depend on each other; neither
+	 * can frames that the queues may drop or reorder. Frames outside
+	 * data_q don't change the remembered instance, if the peer knows that.
+	 */
+
+	bool side = (&q != &data_q) && (features & feat_prio);
+	if (features & feat_prio) flags |= f.prio << pc_prio_shift;
+	if (!side && !dgram
+	        && (!shaper_classes() || (features & feat_prio) )
+	        && compact_tx_valid && (compact_tx_inst == f.inst) )
+		flags |= pc_same_inst;
+	else {
+		wire_codec<uint32_t>::put (p, f.inst);
+		p += 4;
+		if (side) flags |= pc_side;
+		else {
+			compact_tx_inst = f.inst;
+			compact_tx_valid = true;
+		}
+	}
+
+	if ( (f.dof == 0) && (f.sof == 6) && (f.ss == 6) && (f.ds == 6) )
+		flags |= pc_layout_eth;
+	else if ( (f.dof == 0) && (f.sof == 6) && (f.ss == 6) && (f.ds == 0) )
+		flags |= pc_layout_eth_bcast;
+	else {
+		p += wire_put_varint (p, f.dof);
+		p += wire_put_varint (p, f.ds);
+		p += wire_put_varint (p, f.sof);
+		p += wire_put_varint (p, f.ss);
+	}
+
+	if (z) {
+		flags |= pc_compressed;
+		p += wire_put_varint (p, f.payload.size);
+	}
+
+	size_t hs = p - b;
+	add_packet_header (b, pt_packet_compact, flags,
+	                   hs - p_head_size + size);
+	q.append (hs);
+	all_compact_saved += p_frame_head_size - hs;
+
+	//payload of a fanned-out packet is shared, whatever the size
+	if (z) {
+		if ( (f.fanout > 1) || (size >= sgqueue_share_size() ) )
+			q.push_ref (f.zpayload, f.zpayload->data(), size);
+		else q.push (f.zpayload->data(), size);
+	} else if (f.fanout > 1) {
+		const sq_ref&pb = f.payload.block();
+		if (pb.b) q.push_ref (pb, f.payload.data, size);
+		else q.push_payload (f.payload);
+	} else q.push_payload (f.payload);
+
+	if ( (f.fanout > 1) && f.uses++) {
+		++all_fanout_frames;
+		all_fanout_saved += size;
+	}
+}
+
+/*
+ * Compression of a packet is tried only once, even if it goes to many
+ * connections. Packets that look random (already compressed, encrypted)
+ * aren't even tried.
+ */
+
+#define comp_min_size 128
+#define comp_entropy_margin 0.5 //bits per byte below random data
+#define comp_fail_limit 8
+#define comp_backoff_min 64
+#define comp_backoff_max 65536
+
+void connection::comp_clear()
+{
+	comp_fails = comp_skip = 0;
+	comp_backoff = comp_backoff_min;
+	comp_in = comp_out = comp_packets = comp_bypass = comp_usec = 0;
+}
+
+bool connection::compress_payload (packet_frame&f)
+{
+	if (f.payload.size < comp_min_size) return false;
+
+	if (comp_skip) {
+		--comp_skip;
+		++comp_bypass;
+		return false;
+	}
+
+	if (!f.zstate) {
+		uint64_t t = timestamp_precise();
+		f.zstate = 2;
+		if (lz_entropy (f.payload.data, f.payload.size)
+		        <= lz_entropy_random (f.payload.size)
+		        - comp_entropy_margin) {
+			//it has to save at least 1/16 to be worth anything
+			size_t max = f.payload.size - f.payload.size / 16;
+			f.zpayload = sq_ref (sq_block_alloc (max) );
+			if (f.zpayload.b) f.zpayload->used =
+				    lz_compress (f.payload.data, f.payload.size,
+				                 f.zpayload->data(), max);
+			if (f.zpayload.b && f.zpayload->used) f.zstate = 1;
+			else f.zpayload.release();
+		}
+		comp_usec += timestamp_precise() - t;
+	}
+
+	if (f.zstate != 1) {
+		++comp_bypass;
+		if (++comp_fails >= comp_fail_limit) {
+			comp_skip = comp_backoff;
+			if (comp_backoff < comp_backoff_max) comp_backoff *= 2;
+			comp_fails = 0;
+		}
+		return false;
+	}
+
+	comp_fails = 0;
+	comp_backoff = comp_backoff_min;
+	++comp_packets;
+	comp_in += f.payload.size;
+	comp_out += f.zpayload->used;
+	return true;
+}
+
+uint8_t* connection::ctl_buffer (size_t size)
+{
+	if (!ctl_q.len() ) ctl_since = timestamp_precise();
+	want_write();
+	return ctl_q.get_buffer (size);
+}
 
+void connection::write_hello()
+{
+	if (!local_features) return;
+	uint8_t*b = ctl_buffer (p_head_size);
+	if (!b) return;
+	add_packet_header (b, pt_route_diff, local_features & 0xff, 0);
+	ctl_q.append (p_head_size);
+}
+
+static uint8_t* put_cap (uint8_t*p, uint8_t tag, uint32_t v)
+{
+	comm_cap_entry::tag::put (p, tag);
+	comm_cap_entry::length::put (p, 4);
+	wire_codec<uint32_t>::put (p + comm_cap_entry::size, v);
+	return p + comm_cap_entry::size + 4;
+}
+
+#define p_caps_max_size (5 * (comm_cap_entry::size + 4) )
+
+size_t connection::caps_frame (uint8_t*b, uint32_t f)
+{
+	uint8_t*p = b + p_head_size;
+	p = put_cap (p, cap_features, f);
+	p = put_cap (p, cap_max_frame, mtu);
+	p = put_cap (p, cap_max_record, tls_record_size);
+	if (bundle_id && connect_address.length() ) {
+		p = put_cap (p, cap_bundle_id, bundle_id);
+		p = put_cap (p, cap_bundle_stream,
+		             (bundle_index << 16) | bundle_count);
+	}
+	add_packet_header (b, pt_caps, 0, p - b - p_head_size);
+	return p - b;
+}
+
+void connection::write_caps()
+{
+	uint8_t*b = ctl_buffer (p_head_size + p_caps_max_size);
+	if (!b) return;
+	ctl_q.append (caps_frame (b, local_features) );
+}
+
+/*
+ * The greeting is the capability frame, alone in the last TLS record that
+ * the link sends, so that the peer knows where the plaintext starts. The
+ * socket is fresh, a failed or short write means it's broken anyway.
+ */
+
+bool connection::write_plain_greeting()
+{
+	uint8_t b[p_head_size + p_caps_max_size];
+	size_t n = caps_frame (b, local_features | feat_plain);
+	return gnutls_record_send (session, b, n) == (ssize_t) n;
+}
+
+void connection::write_route_set (uint8_t*data, int n)
+{
+	uint8_t type = pt_route_set;
+
+	/*
+	 * Route set that doesn't fit into a datagram is split on entry
+	 * boundaries; the parts after the first one are sent as diffs.
+	 */
+
+	if (dgram) {
+		size_t max = gnutls_dtls_get_data_mtu (session) - p_head_size;
+		size_t len;
+		const uint8_t*h, *start;
+		wire_reader r (data, n), t (data, n);
+
+		while (r.left > max) {
+			start = r.p;
+			len = 0;
+			for (t = r; t.left; r = t) {
+				if (! (h = t.take<comm_route_entry>() ) ) break;
+				if (!t.take (comm_route_entry::addr_size::get (h) ) )
+					break;
+				if (len + r.left - t.left > max) break;
+				len += r.left - t.left;
+			}
+			if (!len) break; //can't be helped
+
+			uint8_t*b = ctl_buffer (p_head_size);
+			if (!b) return;
+			add_packet_header (b, type, 0, len);
+			ctl_q.append (p_head_size);
+			ctl_q.push (start, len);
+			type = pt_route_diff;
+		}
+		data = (uint8_t*) r.p;
+		n = r.left;
+	}
+
+	uint8_t*b = ctl_buffer (p_head_size);
+	if (!b) return;
+	add_packet_header (b, type, 0, n);
+	ctl_q.append (p_head_size);
+	ctl_q.push (data, n);
+}
+
+void connection::write_route_diff (uint8_t*data, int n)
+{
+	uint8_t*b = ctl_buffer (p_head_size);
+	if (!b) return;
+	add_packet_header (b, pt_route_diff, 0, n);
+	ctl_q.append (p_head_size);
+	ctl_q.push (data, n);
+}
+
+void connection::write_ping (uint8_t ID)
+{
+	uint8_t*b = ctl_buffer (p_head_size);
+	if (!b) return;
+	add_packet_header (b, pt_echo_request, ID, 0);
+	ctl_q.append (p_head_size);
+}
+
+void connection::write_pong (uint8_t ID)
+{
+	uint8_t*b = ctl_buffer (p_head_size);
+	if (!b) return;
+	add_packet_header (b, pt_echo_reply, ID, 0);
+	ctl_q.append (p_head_size);
+}
+
+void connection::write_route_request ()
+{
+	uint8_t*b = ctl_buffer (p_head_size);
+	if (!b) return;
 	add_packet_header (b, pt_route_request, 0, 0);
+	ctl_q.append (p_head_size);
 }
 
 /*
@@ -624,24 +1339,41 @@ try_more:
 		                          cached_header.special,
 		                          cached_header.size) ) return;
 
+	//plain links start with the greeting, see activate()
+	if (plain && !plain_rx && (cached_header.type != pt_caps) ) {
+		Log_error ("connection %d: peer doesn't use plaintext", id);
+		reset();
+		return;
+	}
+
 	switch (cached_header.type) {
 	case pt_route_set:
 	case pt_route_diff:
 	case pt_packet:
+	case pt_packet_compact:
+	case pt_caps:
 		if (recv_q.len() >=
 		        (unsigned int) cached_header.size) {
+			uint8_t*p = recv_q.window (cached_header.size);
 			switch (cached_header.type) {
 			case pt_route_set:
-				handle_route (true, recv_q.begin(),
-				              cached_header.size);
+				handle_route (true, p, cached_header.size);
 				break;
 			case pt_route_diff:
-				handle_route (false, recv_q.begin(),
-				              cached_header.size);
+				if (!cached_header.size && cached_header.special)
+					handle_hello (cached_header.special);
+				else handle_route (false, p, cached_header.size);
 				break;
 			case pt_packet:
-				handle_packet (recv_q.begin(),
-				               cached_header.size);
+				handle_packet (cached_header.special,
+				               p, cached_header.size);
+				break;
+			case pt_packet_compact:
+				handle_compact_packet (cached_header.special,
+				                       p, cached_header.size);
+				break;
+			case pt_caps:
+				handle_caps (p, cached_header.size);
 				break;
 			}
 			recv_q.read (cached_header.size);
@@ -680,10 +1412,19 @@ bool connection::try_read()
 	//TODO examine whether this is needed. I guess not, but who knows.
 	//if (pending_write == 1) return true;
 
-	int r;
+	int r, size = dgram ? tls_record_size : read_size;
+	size_t pending;
 	uint8_t*buf;
 	while (1) {
-		buf = recv_q.get_buffer (4096); //alloc a buffer
+		//what GnuTLS has decrypted already can be taken in one piece
+		if (!dgram && !ktls_rx && !plain_rx) {
+			pending = gnutls_record_check_pending (session);
+			size = (pending > (size_t) read_size) ? pending : read_size;
+			if (size > tls_record_size) size = tls_record_size;
+			pull_drained = false;
+		}
+
+		buf = recv_q.get_buffer (size); //alloc a buffer
 
 		if (!buf) {
 			Log_error ("cannot allocate enough buffer space for connection %d", id);
@@ -691,11 +1432,27 @@ bool connection::try_read()
 			return false;
 		}
 
-		r = gnutls_record_recv (session, buf, 4096);
+		if (plain_rx) {
+			r = recv (fd, (char*) buf, size, 0);
+			++syscalls_now;
+			pull_drained = (r > 0) && (r < size);
+		} else if (ktls_rx) r = ktls_recv (fd, buf, size);
+		else {
+			r = gnutls_record_recv (session, buf, size);
+			//only after a whole record, GnuTLS holds no part of another
+			if (ktls_wait && (r > 0) ) ktls_late();
+		}
 		if (r == 0) {
 			Log_info ("connection id %d closed by peer", id);
 			reset();
 			return false;
+		} else if (r < 0 && (ktls_rx || plain_rx) ) {
+			if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)
+			        || (errno == EINTR) ) return true;
+			Log_info ("connection id %d read error %d: %s",
+			          id, errno, strerror (errno) );
+			reset();
+			return false;
 		} else if (r < 0) {
 			if (handle_ssl_error (r) ) {
 				Log_info ("connection id %d read error", id);
@@ -705,33 +1462,392 @@ bool connection::try_read()
 			return true;
 		} else {
 			recv_q.append (r); //confirm read
+			buffers_busy = timestamp();
+			if (!ktls_rx && !plain_rx) {
+				++rec_in_now;
+				rec_in_bytes += r;
+			}
+			if (!dgram) {
+				if ( (r == size) && (read_size < (plain_rx ?
+				                     plain_read_max : tls_record_size) ) )
+					read_size *= 2;
+				else if ( (r < read_size / 4)
+				          && (read_size > read_min_size) )
+					read_size /= 2;
+			}
 			try_parse_input();
 			if (fd < 0) return false; //we got reset
+			if (dgram && recv_q.len() ) {
+				//frames never span datagrams
+				recv_q.read (recv_q.len() );
+				cached_header.type = 0;
+			}
+
+			/*
+			 * socket came up short and GnuTLS holds nothing more,
+			 * rather wait for the poll than for EAGAIN.
+			 */
+			if (pull_drained && (plain_rx || (!ktls_rx &&
+			                     !gnutls_record_check_pending (session) ) ) )
+				return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Control frames go out before any waiting data. Data is moved by whole
+ * frames (so that control ones can go in between) and only while send_q
+ * is short, by reference, nothing is copied.
+ */
+
+#define feed_low_size 32768
+#define feed_size 65536
+
+/*
+ * Nothing can overtake what's already in the kernel either, so stream
+ * connections keep only a little unsent data there.
+ */
+
+static int notsent_lowat = 131072;
+
+static inline size_t frame_size (sgqueue&q)
+{
+	uint8_t h[p_head_size];
+	q.gather (h, p_head_size, (size_t) - 1);
+	return p_head_size + comm_header::length::get (h);
+}
+
+bool connection::feed_frame()
+{
+	size_t l, n;
+	uint64_t t;
+	bool data;
+
+	if (fq.len() ) {
+		l = send_q.len();
+		if (fq.dequeue (send_q, t) ) {
+			send_stamps.push (send_q.len() - l, t, true);
+			return true;
 		}
 	}
+	if (!data_q.len() ) return false;
+
+	l = frame_size (data_q);
+	if (!data_stamps.pop (n, t, data) ) t = 0;
+	send_stamps.push (l, t, true);
+	send_q.take (data_q, l);
 	return true;
 }
 
+/*
+ * Voice goes right after control frames, interactive traffic before the
+ * rest. Leaves then get what's within their rate, then the rest of data
+ * and the leaves that may borrow go in turns, a frame each. Background
+ * only gets what nothing else wanted.
+ */
+
+void connection::feed_send_q()
+{
+	//control frames are all stamped as old as the oldest one
+	if (ctl_q.len() ) {
+		send_stamps.push (ctl_q.len(), ctl_since, false);
+		send_q.take (ctl_q, ctl_q.len() );
+	}
+
+	//voice doesn't wait for send_q to drain
+	if (prio_len) feed_prio (prio_voice);
+
+	if (send_q.len() >= feed_low_size) return;
+	if (prio_len) feed_prio (prio_interactive);
+	if (leaves_len) feed_leaves (false);
+
+	bool any = false;
+	while (send_q.len() < feed_size) {
+		bool fed = feed_frame();
+		if (leaves_len && feed_leaves (true) ) fed = true;
+		if (!fed) break;
+		any = true;
+	}
+	if (!any && prio_len) feed_prio (prio_background);
+}
+
+bool connection::feed_prio (int prio)
+{
+	sgqueue&q = prio_q[prio];
+	size_t l, n;
+	uint64_t t;
+	bool data, fed = false;
+
+	while (q.len() && (send_q.len() < feed_size) ) {
+		l = frame_size (q);
+		if (!prio_stamps[prio].pop (n, t, data) ) t = 0;
+		send_stamps.push (l, t, true);
+		send_q.take (q, l);
+		prio_len -= l;
+		fed = true;
+	}
+	return fed;
+}
+
+/*
+ * Only the leaves that hold something are looked at, each once, in the
+ * order they got backlogged. The emptied ones drop out of the backlog.
+ */
+
+bool connection::feed_leaves (bool borrow)
+{
+	size_t l, n, k = backlog.size();
+	uint64_t t;
+	bool data, fed = false;
+
+	while (k--) {
+		uint32_t inst = backlog.front();
+		backlog.pop_front();
+		shaper_leaf&lf = leaves[inst];
+		while (lf.q.len() && (send_q.len() < feed_size) ) {
+			if (borrow ? lf.cls.allowance() <= 0 : !lf.cls.green() ) {
+				if (borrow) {
+					++lf.cls.throttled;
+					throttled = true;
+				}
+				break;
+			}
+			l = frame_size (lf.q);
+			if (!lf.stamps.pop (n, t, data) ) t = 0;
+			send_stamps.push (l, t, true);
+			send_q.take (lf.q, l);
+			leaves_len -= l;
+			lf.cls.charge (l, false);
+			fed = true;
+			if (borrow) break;
+		}
+		if (lf.q.len() ) backlog.push_back (inst);
+		else lf.backlogged = false;
+	}
+	return fed;
+}
+
+/*
+ * Data is handed to TLS in record-sized groups; send_q keeps small frames
+ * next to each other in memory, so usually a whole group is a single
+ * contiguous run. Shared frames are separate segments, and a frame header
+ * is never contiguous with its shared payload -- if the queue starts with
+ * a short run, it is gathered into write_stage together with whatever
+ * follows, up to a whole record, so that neither a bunch of small frames
+ * nor a lone header ends up as a tiny record of its own.
+ */
+
+#define tls_gather_size 2048
+
+/*
+ * Record sizing follows the usual TLS practice: records that fit into
+ * one TCP segment (so the peer can decrypt each one as soon as it comes)
+ * until the link sends a lot without pause or gets a backlog, then full
+ * records, corked in batches so that fragmented queues don't make them
+ * small. A second of silence makes it interactive again.
+ */
+
+#define record_small_size 1300
+#define record_boost_bytes 262144
+#define record_idle_usec 1000000
+#define cork_batch_size 65536
+
+void connection::record_sizing()
+{
+	if (timestamp() - rec_last > record_idle_usec) {
+		rec_bulk = false;
+		rec_burst = 0;
+	}
+	if (!rec_bulk && ( (rec_burst > record_boost_bytes)
+	                   || (send_q.len() + data_q.len()
+	                       > (size_t) max_record() ) ) )
+		rec_bulk = true;
+}
+
+int connection::record_size()
+{
+	int m = max_record();
+	return (rec_bulk || (m < record_small_size) ) ? m : record_small_size;
+}
+
+/*
+ * The cork copies the batch into GnuTLS, which then sends it as full
+ * records. Whatever the socket doesn't take stays there, and the next
+ * call only tries to uncork again. Returns -1 if the connection got
+ * reset, 0 if writing should stop for now.
+ */
+
+int connection::corked_write()
+{
+	int r;
+	size_t n, total = 0;
+
+	if (!corked) {
+		gnutls_record_cork (session);
+		corked = true;
+		while (send_q.len() && (total < cork_batch_size) ) {
+			n = send_q.contiguous (cork_batch_size - total);
+			r = gnutls_record_send (session, send_q.begin(), n);
+			if (r <= 0) break; //can't happen while corked
+			send_q_read (r);
+			total += r;
+		}
+		rec_out_now += (total + gnutls_record_get_max_size (session) - 1)
+		               / gnutls_record_get_max_size (session);
+		rec_out_bytes += total;
+		rec_burst += total;
+		rec_last = timestamp();
+		buffers_busy = timestamp();
+	}
+
+	r = gnutls_record_uncork (session, 0);
+	if (r < 0) {
+		if (handle_ssl_error (r) ) {
+			Log_error ("connection id %d write error", id);
+			reset();
+			return -1;
+		}
+		return 0; //stays corked
+	}
+	corked = false;
+	return 1;
+}
+
+/*
+ * Limits the peer announced, capped by ours. Records are never made
+ * smaller than the gathering size, frames on datagram links must fit
+ * into a datagram.
+ */
+
+unsigned int connection::max_frame()
+{
+	unsigned int m = mtu;
+	if (peer_max_frame && (peer_max_frame < m) ) m = peer_max_frame;
+	if (dgram && session) {
+		unsigned int d = gnutls_dtls_get_data_mtu (session);
+		d = (d > p_frame_head_size) ? d - p_frame_head_size : 0;
+		if (d < m) m = d;
+	}
+	return m;
+}
+
+int connection::max_record()
+{
+	if (peer_max_record && (peer_max_record < tls_record_size) )
+		return (peer_max_record > tls_gather_size) ?
+		       peer_max_record : tls_gather_size;
+	return tls_record_size;
+}
+
+uint8_t* connection::write_chunk (int&n)
+{
+	if (dgram) return dgram_chunk (n);
+
+	if (!stage_len) {
+		int rs = record_size();
+		int gs = (rs < tls_gather_size) ? rs : tls_gather_size;
+		n = send_q.contiguous (rs);
+		if (pending_write || (n >= gs)
+		        || ( (size_t) n == send_q.len() ) )
+			return send_q.begin();
+
+		if (!write_stage.b) write_stage = sq_ref (sq_block_alloc
+			                  (tls_record_size - sizeof (sq_block),
+			                   false) );
+		if (!write_stage.b) return send_q.begin();
+		stage_pos = 0;
+		stage_len = send_q.gather (write_stage->data(),
+		                           ( (size_t) rs < write_stage->size) ?
+		                           rs : write_stage->size, (size_t) - 1);
+		send_q_read (stage_len);
+	}
+	n = stage_len;
+	return write_stage->data() + stage_pos;
+}
+
+/*
+ * Datagrams are staged as well, each one is filled with whole frames up to
+ * the DTLS data MTU. Frames that don't fit even alone are dropped.
+ */
+
+uint8_t* connection::dgram_chunk (int&n)
+{
+	if (!stage_len) {
+		if (!write_stage.b) write_stage = sq_ref (sq_block_alloc
+			                  (tls_record_size - sizeof (sq_block),
+			                   false) );
+		if (!write_stage.b) {
+			n = 0;
+			return 0;
+		}
+
+		size_t max = gnutls_dtls_get_data_mtu (session), fs;
+		uint8_t h[p_head_size];
+		if (max > write_stage->size) max = write_stage->size;
+
+		stage_pos = 0;
+		while (send_q.len() >= p_head_size) {
+			send_q.gather (h, p_head_size, (size_t) - 1);
+			fs = p_head_size + comm_header::length::get (h);
+			if (stage_len + fs > max) {
+				if (stage_len) break;
+				send_q_read (fs);
+				++dgram_dropped;
+				continue;
+			}
+			send_q.gather (write_stage->data() + stage_len,
+			               fs, (size_t) - 1);
+			send_q_read (fs);
+			stage_len += fs;
+		}
+	}
+	n = stage_len;
+	return write_stage->data() + stage_pos;
+}
+
 bool connection::try_write()
 {
 	int r, n;
+	uint8_t*buf;
+
+	if (ktls_tx || plain) return raw_write();
+	if (!dgram) record_sizing();
+
+	while (needs_write() || corked) {
+		feed();
 
-	while (needs_write() ) {
+		//bandwidth limit needs to see every piece, no corking there
+		if (corked || (rec_bulk && !dgram && !shaper_enabled()
+		               && !pending_write && !stage_len
+		               && (send_q.len() > (size_t) max_record() ) ) ) {
+			r = corked_write();
+			if (r < 0) return false;
+			if (!r) return true;
+			continue;
+		}
+
+		buf = write_chunk (n);
 
 		//choke the bandwidth. Note that we dont want to really
 		//discard the packet here, because of SSL.
 
-		n = send_q.len();
-		if (ubl_enabled && ( (unsigned int) n > ubl_available)
-		        && (n > ubl_available) ) n = ubl_available;
+		if (shaper_enabled() && !pending_write) {
+			int64_t a = shaper.allowance();
+			if ( (n > a) && dgram) n = 0; //datagrams can't be split
+			else if (n > a) n = a;
+			if (!n) {
+				++shaper.throttled;
+				throttled = true;
+			}
+		}
 
 		if (!n) return true; //we ran out of available bandwidth
 
 		//or try to send.
 
-		r = pending_write ?
-		    gnutls_record_send (session, send_q.begin(), pending_write) :
-		    gnutls_record_send (session, send_q.begin(), n);
+		r = gnutls_record_send (session, buf,
+		                        pending_write ? pending_write : n);
 
 		if (r == 0) {
 			Log_info ("connection id %d closed by peer", id);
@@ -746,8 +1862,17 @@ bool connection::try_write()
 			pending_write = n;
 			return true;
 		} else {
-			send_q.read (r);
+			if (stage_len) {
+				stage_pos += r;
+				stage_len -= r;
+			} else send_q_read (r);
+			if (shaper_enabled() ) shaper.charge (r, true);
 			pending_write = 0;
+			buffers_busy = timestamp();
+			++rec_out_now;
+			rec_out_bytes += r;
+			rec_burst += r;
+			rec_last = timestamp();
 		}
 	}
 	poll_set_remove_write (fd); //don't need any more write
@@ -755,6 +1880,50 @@ bool connection::try_write()
 	return true;
 }
 
+/*
+ * With kernel TLS or on plain links, the whole queue goes to the socket
+ * in one call, nothing gets staged or copied.
+ */
+
+bool connection::raw_write()
+{
+	int r;
+	size_t max;
+
+	for (feed(); send_q.len(); feed() ) {
+		max = send_q.len();
+		if (shaper_enabled() ) {
+			int64_t a = shaper.allowance();
+			if ( (int64_t) max > a) max = a;
+			if (!max) {
+				++shaper.throttled;
+				throttled = true;
+				return true;
+			}
+		}
+
+		r = ktls_tx ? ktls_send (fd, send_q, max) :
+		    zc.send (fd, send_q, max);
+		++syscalls_now;
+		if (r < 0) {
+			if ( (errno == EAGAIN) || (errno == EWOULDBLOCK)
+			        || (errno == EINTR) ) {
+				poll_set_add_write (fd);
+				return true;
+			}
+			Log_error ("connection id %d write error %d: %s",
+			           id, errno, strerror (errno) );
+			reset();
+			return false;
+		}
+		send_q_read (r);
+		if (shaper_enabled() ) shaper.charge (r, true);
+		buffers_busy = timestamp();
+	}
+	poll_set_remove_write (fd);
+	return true;
+}
+
 void connection::try_data()
 {
 	/*
@@ -781,64 +1950,13 @@ void connection::try_data()
 
 void connection::try_accept()
 {
+	if (hs_job) return; //a worker has it
+
 	int r = gnutls_handshake (session);
 	if (r == 0) {
-		Log_info ("socket %d accepted SSL connection id %d", fd, id);
-		activate();
-		unsigned int certificatestatus;
-		if ( gnutls_certificate_verify_peers2
-				( session, &certificatestatus ) < 0) {
-			Log_error ( "error verifying peer %d credentials", id );
-			reset();
-		}
-		else {
-			if (certificatestatus != 0) {
-				if (certificatestatus & GNUTLS_CERT_INVALID)
-					Log_info("%d certificate is not trusted", id);
-
-				if (certificatestatus & GNUTLS_CERT_SIGNER_NOT_FOUND)
-					Log_info("%d certificate hasn't got a known issuer", id);
-
-				if (certificatestatus & GNUTLS_CERT_REVOKED)
-					Log_info("%d certificate has been revoked", id);
-
-				if (certificatestatus & GNUTLS_CERT_INSECURE_ALGORITHM)
-					Log_info("%d certificate uses an insecure algorithm", id);
-
-				reset();
-			}
-			else {
-				 if ( GNUTLS_CRT_OPENPGP == gnutls_certificate_type_get (session) ) {
-				 	unsigned int list_size;
-					const gnutls_datum_t * datum = gnutls_certificate_get_peers
-  						( session, &list_size );
-					if ( datum ) {
-						gnutls_openpgp_crt_t key;
-						gnutls_openpgp_crt_init( &key );
-						if ( gnutls_openpgp_crt_import ( key , datum, GNUTLS_OPENPGP_FMT_RAW ) == GNUTLS_E_SUCCESS ) {
-							unsigned int verification_result = 0;
-							gnutls_openpgp_keyring_t keyring;
-							gnutls_openpgp_keyring_init( &keyring );
-							gnutls_certificate_get_openpgp_keyring ( xcred, &keyring );
-							if ( gnutls_openpgp_crt_verify_ring ( key, keyring , 0, &verification_result ) == GNUTLS_E_SUCCESS ) {
-								Log_info( "client verification: %d", verification_result );
-        					} else {
-								Log_error("error verifying client %d certificate", id);
-								reset();
-        					}
-						} else {
-							Log_error("error acquiring client %d certificate from datum", id);
-							reset();
-						}
-						gnutls_openpgp_crt_deinit( key );
-					} else {
-						Log_error("error acquiring client %d certificate datum", id);
-						reset();
-					}
-				}
-			}
-		}
-
+		unsigned int status = 0;
+		int v = handshake_verify (session, &status);
+		accepted (v, status);
 	} else if (handle_ssl_error (r) ) {
 		Log_error ("accepting fd %d lost", fd);
 		reset();
@@ -849,6 +1967,62 @@ void connection::try_accept()
 	}
 }
 
+/*
+ * finishing the handshakes, also for those that come from workers
+ */
+
+/*
+ * Peer certificate is checked on both sides before the connection does
+ * anything (hello, routes, pings); resets the connection if it's no good.
+ */
+
+bool connection::peer_verified (int verify_result, unsigned int verify_status)
+{
+	if (verify_result < 0) {
+		Log_error ("error verifying peer %d credentials: %s",
+		           id, gnutls_strerror (verify_result) );
+		reset();
+		return false;
+	}
+	if (!verify_status) return true;
+
+	if (verify_status & GNUTLS_CERT_INVALID)
+		Log_info("%d certificate is not trusted", id);
+
+	if (verify_status & GNUTLS_CERT_SIGNER_NOT_FOUND)
+		Log_info("%d certificate hasn't got a known issuer", id);
+
+	if (verify_status & GNUTLS_CERT_REVOKED)
+		Log_info("%d certificate has been revoked", id);
+
+	if (verify_status & GNUTLS_CERT_INSECURE_ALGORITHM)
+		Log_info("%d certificate uses an insecure algorithm", id);
+
+	reset();
+	return false;
+}
+
+void connection::accepted (int verify_result, unsigned int verify_status)
+{
+	Log_info ("socket %d accepted SSL connection id %d", fd, id);
+	if (startup_time) {
+		Log_info ("first connection accepted %gs after startup",
+		          0.000001 * (timestamp_precise() - startup_time) );
+		startup_time = 0;
+	}
+	handshake_done();
+	if (peer_verified (verify_result, verify_status) ) activate();
+}
+
+void connection::established (int verify_result, unsigned int verify_status)
+{
+	Log_info ("socket %d established SSL connection id %d", fd, id);
+	handshake_done();
+	if (!peer_verified (verify_result, verify_status) ) return;
+	save_session();
+	activate();
+}
+
 void connection::try_connect()
 {
 	//test if the socket is writeable, otherwise still in progress
@@ -892,21 +2066,26 @@ void connection::try_connect()
 
 	poll_set_remove_write (fd);
 	poll_set_add_read (fd); //always needed
-	state = cs_ssl_connecting;
+	set_state (cs_ssl_connecting);
+	handshake_start = timestamp_precise();
 	if (alloc_ssl (false) ) {
 		Log_error ("conn %d failed to allocate SSL stuff", id);
 		reset();
-	} else try_ssl_connect();
+	} else if (!dgram && handshake_workers() ) handshake_offload (false);
+	else try_ssl_connect();
 }
 
 void connection::try_ssl_connect()
 {
+	if (hs_job) return;
+
 	int r = gnutls_handshake (session);
 	if (r == 0) {
-		Log_info ("socket %d established SSL connection id %d", fd, id);
-		activate();
-
-	} else if (handle_ssl_error (r) ) {
+		unsigned int status = 0;
+		int v = handshake_verify (session, &status);
+		established (v, status);
+	}
+	else if (handle_ssl_error (r) ) {
 		Log_error ("SSL connecting on %d failed", fd);
 		reset();
 	} else if ( (timestamp() - last_ping) > (unsigned int) timeout) {
@@ -923,7 +2102,18 @@ void connection::try_close()
 		return;
 	}
 
-	int r = gnutls_bye (session, GNUTLS_SHUT_RDWR);
+	//nobody would retransmit the peer's close notify on datagrams
+	if (plain) { //no TLS to close
+		reset();
+		return;
+	}
+	if (ktls_tx) { //GnuTLS doesn't know the record state anymore
+		ktls_send_close (fd);
+		reset();
+		return;
+	}
+
+	int r = gnutls_bye (session, dgram ? GNUTLS_SHUT_WR : GNUTLS_SHUT_RDWR);
 	if (r == 0) reset(); //closed OK
 	else if (handle_ssl_error (r) ) reset ();
 	else if ( (timestamp() - last_ping) > (unsigned int) timeout) {
@@ -941,7 +2131,15 @@ void connection::start_connect()
 {
 	last_retry = timestamp();
 
-	int t = tcp_connect_socket (connect_address.c_str() );
+	string a, p;
+	plain = plain_address (connect_address, p);
+	dgram = dgram_address (p, a);
+	if (plain && dgram) {
+		Log_error ("connection id %d can't be both plain and DTLS", id);
+		return;
+	}
+	int t = dgram ? udp_connect_socket (a.c_str() ) :
+	        tcp_connect_socket (a.c_str() );
 	if (t < 0) {
 		Log_error ("failed connecting in connection id %d", id);
 		return;
@@ -949,7 +2147,7 @@ void connection::start_connect()
 
 	set_fd (t);
 
-	state = cs_connecting;
+	set_state (cs_connecting);
 	last_ping = timestamp();
 	poll_set_add_write (fd); //wait for connect() to be done
 	try_connect();
@@ -964,11 +2162,42 @@ void connection::start_accept()
 	}
 
 	last_ping = timestamp(); //abuse the variable...
+	handshake_start = timestamp_precise();
+
+	if (handshake_workers() ) {
+		handshake_offload (true);
+		return;
+	}
 
 	poll_set_add_read (fd); //always needed
 	try_accept();
 }
 
+void connection::start_accept_dgram (const uint8_t*hello, size_t len,
+                                     gnutls_dtls_prestate_st&prestate)
+{
+	dgram = true;
+	if (alloc_ssl (true) ) {
+		Log_error ("failed to allocate SSL stuff for connection %d", id);
+		reset();
+		return;
+	}
+	gnutls_dtls_prestate_set (session, &prestate);
+
+	//the listener has already read the hello, give it to the session
+	dgram_hello = sq_ref (sq_block_alloc (len, false) );
+	if (dgram_hello.b) {
+		memcpy (dgram_hello->data(), hello, len);
+		dgram_hello->used = len;
+	}
+
+	last_ping = timestamp();
+	handshake_start = timestamp_precise();
+
+	poll_set_add_read (fd);
+	try_accept();
+}
+
 void connection::send_ping()
 {
 	sent_ping_time = timestamp();
@@ -976,20 +2205,138 @@ void connection::send_ping()
 	write_ping (sent_ping_id);
 }
 
+/*
+ * Stream transport of active sessions does the same as GnuTLS' own, but
+ * counts the system calls, and notices when the socket got drained.
+ */
+
+#ifndef __WIN32__
+static ssize_t stream_push (gnutls_transport_ptr_t p,
+                            const giovec_t*iov, int iovcnt)
+{
+	connection&c = * (connection*) p;
+	struct msghdr msg;
+	memset (&msg, 0, sizeof (msg) );
+	msg.msg_iov = (struct iovec*) iov;
+	msg.msg_iovlen = iovcnt;
+#ifdef MSG_NOSIGNAL
+	ssize_t r = sendmsg (c.fd, &msg, MSG_NOSIGNAL);
+#else
+	ssize_t r = sendmsg (c.fd, &msg, 0);
+#endif
+	++c.syscalls_now;
+	if (r < 0) gnutls_transport_set_errno (c.session, errno);
+	return r;
+}
+
+static ssize_t stream_pull (gnutls_transport_ptr_t p, void*data, size_t len)
+{
+	connection&c = * (connection*) p;
+	ssize_t r = recv (c.fd, (char*) data, len, 0);
+	++c.syscalls_now;
+	if (r < 0) gnutls_transport_set_errno (c.session, errno);
+	else if ( (size_t) r < len) c.pull_drained = true;
+	return r;
+}
+#endif
+
+/*
+ * TLS1.3 servers send session tickets after the handshake, in records the
+ * kernel would only pass up as handshake messages GnuTLS can't take back,
+ * so resumption would never work with offloaded receiving. The connecting
+ * side therefore keeps the whole link in GnuTLS until the ticket arrives
+ * (or the server doesn't seem to send any), saves the session, and
+ * offloads then. Both directions go at once, so that GnuTLS never answers
+ * a key update or sends an alert with keys the kernel has moved past;
+ * that needs a record boundary both ways, so it's retried on every
+ * record received until GnuTLS holds nothing.
+ */
+
+#define ktls_ticket_wait 5000000 //usec
+
+static inline bool ticket_expected (gnutls_session_t s, bool connecting)
+{
+	return resumption && connecting
+	       && (gnutls_protocol_get_version (s) == GNUTLS_TLS1_3)
+	       && ! (gnutls_session_get_flags (s) & GNUTLS_SFLAGS_SESSION_TICKET);
+}
+
+void connection::ktls_late()
+{
+	if (ticket_expected (session, connect_address.length() )
+	        && (timestamp() < ktls_wait) ) return;
+	if (pending_write || corked || stage_len
+	        || gnutls_record_check_pending (session) ) return;
+
+	ktls_wait = 0;
+	save_session();
+	ktls_enable (fd, session, ktls_tx, ktls_rx);
+	if (ktls_tx || ktls_rx)
+		Log_info ("connection %d uses kernel TLS for%s%s",
+		          id, ktls_tx ? " sending" : "",
+		          ktls_rx ? " receiving" : "");
+}
+
 void connection::activate()
 {
-	state = cs_active;
+	set_state (cs_active);
+	if (plain) {
+		/*
+		 * Both sides greet over TLS and send plaintext right after;
+		 * reading switches on the peer's greeting, which must come
+		 * first and say feat_plain, otherwise the link is reset.
+		 */
+		if (!write_plain_greeting() ) {
+			Log_error ("connection %d can't send plain link greeting",
+			           id);
+			reset();
+			return;
+		}
+		Log_info ("connection %d continues in plaintext", id);
+		zc.setup (fd);
+	} else if (!dgram) {
+#ifndef __WIN32__
+		//the worker is done with the session, it may point here now
+		gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) this);
+		gnutls_transport_set_vec_push_function (session, stream_push);
+		gnutls_transport_set_pull_function (session, stream_pull);
+#endif
+		ktls_wait = timestamp() + ktls_ticket_wait;
+		ktls_late();
+	}
+#ifdef TCP_NOTSENT_LOWAT
+	if (!dgram && (notsent_lowat > 0)
+	        && setsockopt (fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	                       &notsent_lowat, sizeof (notsent_lowat) ) )
+		Log_warn ("connection %d can't limit unsent data", id);
+#endif
+	write_hello();
 	route_report_to_connection (*this);
 	send_ping();
 }
 
+//handshake count for the accept limit, without walking all connections
+void connection::set_state (int s)
+{
+	bool was = (state == cs_ssl_connecting) || (state == cs_accepting);
+	bool is = (s == cs_ssl_connecting) || (s == cs_accepting);
+	if (is && !was) ++all_handshaking;
+	else if (was && !is) --all_handshaking;
+	state = s;
+}
+
 void connection::disconnect()
 {
+	if (hs_job) { //can't say goodbye to the worker's session
+		reset();
+		return;
+	}
+
 	poll_set_remove_write (fd);
 	poll_set_remove_read (fd);
 
 	if ( (state == cs_retry_timeout) && (! (connect_address.length() ) ) ) {
-		state = cs_inactive;
+		set_state (cs_inactive);
 		return;
 	}
 
@@ -998,7 +2345,7 @@ void connection::disconnect()
 	        || (state == cs_closing) ) return;
 
 	last_ping = timestamp();
-	state = cs_closing;
+	set_state (cs_closing);
 	remote_routes.clear();
 	route_set_dirty();
 	try_close();
@@ -1013,34 +2360,81 @@ void connection::reset()
 	poll_set_remove_write (fd);
 	poll_set_remove_read (fd);
 
+	//the worker's job closes the session and socket when it's done
+	bool detached = hs_job;
+	if (hs_job) {
+		handshake_cancel (hs_job);
+		hs_job = 0;
+		session = 0;
+	}
+
 	remote_routes.clear();
 	route_overflow = false;
 	route_set_dirty();
 
 	recv_q.clear();
 	send_q.clear();
+	ctl_q.clear();
+	data_q.clear();
+	fq.clear();
+	send_stamps.clear();
+	data_stamps.clear();
+	leaves.clear();
+	backlog.clear();
+	leaves_len = 0;
+	for (int i = 0;i < prio_classes;++i) {
+		prio_q[i].clear();
+		prio_stamps[i].clear();
+	}
+	prio_len = 0;
 
 	pending_write = 0;
+	write_stage.release();
+	stage_pos = stage_len = 0;
+	rec_bulk = corked = pull_drained = false;
+	rec_burst = rec_last = 0;
+	read_size = 4096;
+
+	features = 0;
+	peer_max_frame = peer_max_record = 0;
+	caps_received = false;
+	compact_tx_valid = compact_rx_valid = false;
 
 	cached_header.type = 0;
 
+	//TLS1.3 tickets come after the handshake, keep the latest one
+	if (state == cs_active) save_session();
 	dealloc_ssl();
+	ktls_tx = ktls_rx = false;
+	ktls_wait = 0;
+	handshake_usec = 0;
+	resumed = false;
+	bundle_leave();
+	if (!connect_address.length() ) {
+		bundle_id = 0;
+		bundle_index = bundle_count = 0;
+	}
+	dgram = false;
+	plain = plain_rx = false;
+	dgram_hello.release();
+	dgram_last_report = dgram_dropped = 0;
 
 	ping = timeout;
 	last_ping = 0;
 
-	tcp_close_socket (fd);
+	zc.reset (detached ? -1 : fd);
+	if (!detached) tcp_close_socket (fd);
 	unset_fd();
 
 	stats_clear();
-	ubl_available = 0;
+	comp_clear();
 	dbl_over = 0;
 
 	peer_addr_str = "";
 	peer_connected_since = 0;
 	if (connect_address.length() )
-		state = cs_retry_timeout;
-	else state = cs_inactive;
+		set_state (cs_retry_timeout);
+	else set_state (cs_inactive);
 }
 
 /*
@@ -1077,6 +2471,9 @@ int connection::handle_ssl_error (int ret)
 
 void connection::poll_simple()
 {
+	//zerocopy completions come as socket errors
+	if (zc.pending() ) zc.reap (fd);
+
 	switch (state) {
 	case cs_accepting:
 		try_accept();
@@ -1116,6 +2513,12 @@ void connection::periodic_update()
 	case cs_connecting:
 		try_connect();
 		break;
+	case cs_accepting: //DTLS handshake retransmissions need a clock
+		if (dgram) try_accept();
+		break;
+	case cs_ssl_connecting:
+		if (dgram) try_ssl_connect();
+		break;
 	case cs_closing:
 		try_close();
 		break;
@@ -1130,9 +2533,53 @@ void connection::periodic_update()
 			return;
 		} else if ( (timestamp() - sent_ping_time) >
 		            (unsigned int) keepalive) send_ping();
+		if (dgram && ( (timestamp() - dgram_last_report) >
+		               (unsigned int) keepalive) ) {
+			dgram_last_report = timestamp();
+			write_hello();
+			route_report_to_connection (*this);
+		}
 		try_write();
 		break;
 	}
+
+	release_buffers();
+}
+
+/*
+ * idle connections shouldn't hold any memory
+ */
+
+void connection::release_buffers()
+{
+	if (recv_q.len() || needs_write() ) buffers_busy = timestamp();
+
+	bool idle = sq_buffers_idle (buffers_busy);
+	recv_q.release (idle);
+	send_q.release (idle);
+	ctl_q.release (idle);
+	data_q.release (idle);
+	fq.release (idle);
+	map<uint32_t, shaper_leaf>::iterator i;
+	for (i = leaves.begin();i != leaves.end();++i) i->second.q.release (idle);
+	for (int j = 0;j < prio_classes;++j) prio_q[j].release (idle);
+	if (idle && !stage_len) write_stage.release();
+}
+
+size_t connection::leaves_resident()
+{
+	size_t r = 0;
+	map<uint32_t, shaper_leaf>::iterator i;
+	for (i = leaves.begin();i != leaves.end();++i) r += i->second.q.resident();
+	for (int j = 0;j < prio_classes;++j) r += prio_q[j].resident();
+	return r;
+}
+
+size_t connection::resident_buffers()
+{
+	return recv_q.resident() + send_q.resident() + ctl_q.resident()
+	       + data_q.resident() + fq.resident() + leaves_resident()
+	       + (write_stage.b ? write_stage->size : 0);
 }
 
 /*
@@ -1140,21 +2587,147 @@ void connection::periodic_update()
  * create and destroy SSL objects specific for each connection
  */
 
+/*
+ * DTLS transport functions work on connected datagram sockets, except that
+ * the first datagram of accepted connections comes from the listener.
+ * Nothing here may block, the handshake gets repeated by periodic_update.
+ */
+
+static ssize_t dgram_push (gnutls_transport_ptr_t p,
+                           const void*data, size_t len)
+{
+	connection&c = * (connection*) p;
+	ssize_t r = send (c.fd, (const char*) data, len, 0);
+	++c.syscalls_now;
+	if (r < 0) gnutls_transport_set_errno (c.session, errno);
+	return r;
+}
+
+static ssize_t dgram_pull (gnutls_transport_ptr_t p, void*data, size_t len)
+{
+	connection&c = * (connection*) p;
+	if (c.dgram_hello.b) {
+		size_t n = c.dgram_hello->used;
+		if (n > len) n = len;
+		memcpy (data, c.dgram_hello->data(), n);
+		c.dgram_hello.release();
+		return n;
+	}
+	ssize_t r = recv (c.fd, (char*) data, len, 0);
+	++c.syscalls_now;
+	if (r < 0) gnutls_transport_set_errno (c.session, errno);
+	return r;
+}
+
+static int dgram_pull_timeout (gnutls_transport_ptr_t p, unsigned int ms)
+{
+	connection&c = * (connection*) p;
+	if (c.dgram_hello.b) return 1;
+
+	/*
+	 * poll() rather than select() so that descriptors past FD_SETSIZE
+	 * work. Sessions are nonblocking, so GnuTLS asks with ms == 0 from
+	 * the main loop; longer waits only happen if a caller requests them.
+	 */
+	struct pollfd f;
+	f.fd = c.fd;
+	f.events = POLLIN;
+	f.revents = 0;
+	return poll (&f, 1, ms == GNUTLS_INDEFINITE_TIMEOUT ? -1 : (int) ms);
+}
+
 int connection::alloc_ssl (bool server)
 {
 	dealloc_ssl();
 
-	if (gnutls_init (&session, server ? GNUTLS_SERVER : GNUTLS_CLIENT) )
+	//plain links can't take any TLS after the handshake, like tickets
+	if (gnutls_init (&session, (server ? GNUTLS_SERVER : GNUTLS_CLIENT)
+	                 | (dgram ? GNUTLS_DATAGRAM | GNUTLS_NONBLOCK : 0)
+	                 | (plain ? GNUTLS_NO_TICKETS : 0) ) )
 		return 1;
 
-	gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) fd);
+	if (dgram) {
+		gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) this);
+		gnutls_transport_set_push_function (session, dgram_push);
+		gnutls_transport_set_pull_function (session, dgram_pull);
+		gnutls_transport_set_pull_timeout_function (session,
+		        dgram_pull_timeout);
+		gnutls_dtls_set_mtu (session, dgram_mtu);
+		gnutls_dtls_set_timeouts (session, 1000, timeout / 1000);
+	} else gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t) fd);
 	gnutls_priority_set (session, prio_cache);
 	gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred);
 	gnutls_certificate_server_set_request (session, GNUTLS_CERT_REQUIRE);
 
+	if (resumption && server && !plain)
+		gnutls_session_ticket_enable_server (session, &ticket_key);
+	else if (resumption && !plain) {
+		map<string, vector<uint8_t> >::iterator i =
+		    session_cache.find (connect_address);
+		if (i != session_cache.end() )
+			gnutls_session_set_data (session, & (i->second[0]),
+			                         i->second.size() );
+	}
+
 	return 0;
 }
 
+/*
+ * Resumed sessions still get their peer certificate verified (it's kept
+ * in the session data), which is cheap; what's saved is the key exchange
+ * and the signatures.
+ */
+
+void connection::handshake_done()
+{
+	handshake_usec = timestamp_precise() - handshake_start;
+	resumed = gnutls_session_is_resumed (session);
+	if (resumed) ++all_handshakes_resumed;
+	else ++all_handshakes_full;
+	all_handshake_usec += handshake_usec;
+	Log_info ("connection %d %s handshake took %gms", id,
+	          resumed ? "resumed" : "full", 0.001 * handshake_usec);
+}
+
+/*
+ * The worker owns session and socket until it returns the job; the
+ * connection doesn't poll the socket meanwhile.
+ */
+
+void connection::handshake_offload (bool server)
+{
+	poll_set_remove_write (fd);
+	poll_set_remove_read (fd);
+	hs_job = handshake_submit (id, fd, session, server,
+	                           handshake_start + timeout);
+}
+
+void connection::handshake_finished (handshake_job&j)
+{
+	hs_job = 0;
+	poll_set_add_read (fd);
+
+	if (j.result) {
+		if (j.result == GNUTLS_E_TIMEDOUT)
+			Log_error ("handshake on fd %d timeout", fd);
+		else Log_error ("handshake on fd %d failed: %s",
+			                fd, gnutls_strerror (j.result) );
+		reset();
+	} else if (j.server) accepted (j.verify_result, j.verify_status);
+	else established (j.verify_result, j.verify_status);
+}
+
+void connection::save_session()
+{
+	if (!resumption || plain || !session || !connect_address.length() )
+		return;
+
+	gnutls_datum_t d;
+	if (gnutls_session_get_data2 (session, &d) ) return;
+	session_cache[connect_address].assign (d.data, d.data + d.size);
+	gnutls_free (d.data);
+}
+
 void connection::dealloc_ssl()
 {
 	if (session) {
@@ -1163,6 +2736,166 @@ void connection::dealloc_ssl()
 	}
 }
 
+/*
+ * bundles
+ */
+
+#define bundle_max_streams 64
+
+/*
+ * Bundle IDs are only unique per peer and side, so the map is keyed by the
+ * peer certificate fingerprint prefixed with 'c' on the connecting side and
+ * 'a' on the accepting one. Someone else can't add streams into our bundle
+ * by guessing its ID, and accepted streams never join a bundle we opened.
+ */
+
+bool connection::bundle_peer_key()
+{
+	unsigned int n = 0;
+	const gnutls_datum_t*crt = session ?
+	                           gnutls_certificate_get_peers (session, &n) : 0;
+	uint8_t fp[64];
+	size_t fps = sizeof (fp);
+	if (!crt || !n || gnutls_fingerprint (GNUTLS_DIG_SHA256, crt, fp, &fps) )
+		return false;
+
+	bundle_peer = connect_address.length() ? "c" : "a";
+	bundle_peer.append ( (const char*) fp, fps);
+	return true;
+}
+
+void connection::bundle_join()
+{
+	if ( (bundle_count > bundle_max_streams)
+	        || (bundle_index >= bundle_count) ) {
+		Log_info ("connection %d got invalid bundle stream %d/%d",
+		          id, bundle_index, bundle_count);
+		return;
+	}
+	if (!bundle_peer_key() ) {
+		Log_info ("connection %d: no peer certificate to bundle by", id);
+		return;
+	}
+
+	vector<int>&b = bundles[bundle_key (bundle_peer, bundle_id)];
+	if (b.size() < bundle_count) b.resize (bundle_count, -1);
+	if ( (b[bundle_index] >= 0) && (b[bundle_index] != id) ) {
+		Log_info ("connection %d: stream %d of bundle %08x is taken",
+		          id, bundle_index, bundle_id);
+		return;
+	}
+	b[bundle_index] = id;
+	bundled = true;
+	Log_info ("connection %d is stream %d of bundle %08x",
+	          id, bundle_index, bundle_id);
+
+	if (bundle_index) { //secondary streams aren't neighbours
+		remote_routes.clear();
+		route_set_dirty();
+	}
+}
+
+void connection::bundle_leave()
+{
+	if (!bundled) return;
+	bundled = false;
+
+	map<bundle_key, vector<int> >::iterator i =
+	    bundles.find (bundle_key (bundle_peer, bundle_id) );
+	if (i == bundles.end() ) return;
+	vector<int>&b = i->second;
+	if ( (bundle_index < b.size() ) && (b[bundle_index] == id) )
+		b[bundle_index] = -1;
+	for (size_t k = 0;k < b.size();++k) if (b[k] >= 0) return;
+	bundles.erase (i);
+}
+
+/*
+ * Flows are told apart by instance and both addresses, so that packets
+ * of one flow stay on one stream and keep their order. If the addresses
+ * are those of an ethernet frame, IPv4/IPv6 addresses and TCP/UDP/SCTP
+ * ports go in as well, so that traffic between two hosts (or behind one
+ * router) spreads over the streams too. Fragments hash by the addresses
+ * only, so that they don't get split from each other.
+ */
+
+static inline uint32_t hash_bytes (uint32_t h, const uint8_t*p, size_t n)
+{
+	while (n--) h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+static inline bool has_ports (int proto)
+{
+	return (proto == 6) || (proto == 17) || (proto == 132);
+}
+
+static uint32_t flow_hash_inner (uint32_t h, const uint8_t*d, size_t size)
+{
+	size_t off = 12;
+	if (size < off + 2) return h;
+	int type = (d[off] << 8) | d[off+1];
+	if ( (type == 0x8100) && (size >= 18) ) {
+		off = 16;
+		type = (d[off] << 8) | d[off+1];
+	}
+	d += off + 2;
+	size -= off + 2;
+
+	size_t ports = 0;
+	if ( (type == 0x0800) && (size >= 20) && ( (d[0] >> 4) == 4) ) {
+		h = hash_bytes (h, d + 9, 1); //protocol
+		h = hash_bytes (h, d + 12, 8); //addresses
+		bool frag = ( (d[6] & 0x3f) | d[7]) != 0;
+		if (!frag && has_ports (d[9]) ) ports = (d[0] & 0x0f) * 4;
+	} else if ( (type == 0x86DD) && (size >= 40) ) {
+		h = hash_bytes (h, d + 6, 1); //next header
+		h = hash_bytes (h, d + 8, 32); //addresses
+		if (has_ports (d[6]) ) ports = 40;
+	} else return h;
+
+	if (ports && (size >= ports + 4) ) h = hash_bytes (h, d + ports, 4);
+	return h;
+}
+
+static uint32_t flow_hash (packet_frame&f)
+{
+	uint32_t h = 2166136261U ^ f.inst;
+	const uint8_t*d = f.payload.data;
+	h = hash_bytes (h, d + f.dof, f.ds);
+	h = hash_bytes (h, d + f.sof, f.ss);
+	if (!f.dof && (f.sof == 6) && (f.ss == 6) )
+		h = flow_hash_inner (h, d, f.payload.size);
+	return h ^ (h >> 16);
+}
+
+connection& connection::bundle_stream (packet_frame&f)
+{
+	if (!bundled || bundle_index) return *this;
+
+	map<bundle_key, vector<int> >::iterator i =
+	    bundles.find (bundle_key (bundle_peer, bundle_id) );
+	if ( (i == bundles.end() ) || (i->second.size() < 2) ) return *this;
+
+	int cid = i->second[flow_hash (f) % i->second.size()];
+	if (cid < 0) return *this;
+
+	map<int, connection>::iterator c = connections.find (cid);
+	if ( (c == connections.end() ) || (c->second.state != cs_active) )
+		return *this;
+	return c->second;
+}
+
+int connection::bundle_primary()
+{
+	if (!bundle_secondary() ) return id;
+
+	map<bundle_key, vector<int> >::iterator i =
+	    bundles.find (bundle_key (bundle_peer, bundle_id) );
+	if ( (i == bundles.end() ) || (i->second[0] < 0) ) return id;
+	return i->second[0];
+}
+
 /*
  * remote route overflow handling
  *
@@ -1258,6 +2991,29 @@ uint64_t connection::all_in_p_total = 0;
 uint64_t connection::all_in_s_total = 0;
 uint64_t connection::all_out_p_total = 0;
 uint64_t connection::all_out_s_total = 0;
+uint64_t connection::all_fanout_frames = 0;
+uint64_t connection::all_fanout_saved = 0;
+uint64_t connection::all_compact_saved = 0;
+uint64_t connection::all_handshakes_full = 0;
+uint64_t connection::all_handshakes_resumed = 0;
+uint64_t connection::all_handshake_usec = 0;
+uint64_t connection::all_handshakes_refused = 0;
+int connection::all_handshaking = 0;
+uint64_t connection::all_stall_max = 0;
+uint64_t connection::all_stall_jitter = 0;
+uint64_t connection::all_stall_last = 0;
+
+void connection::stat_stall (uint64_t usec)
+{
+	if (usec > all_stall_max) all_stall_max = usec;
+
+	//jitter is kept scaled by 16, as in RFC3550 A.8
+	uint64_t d = (usec > all_stall_last) ?
+	             usec - all_stall_last : all_stall_last - usec;
+	all_stall_last = usec;
+	all_stall_jitter += d;
+	all_stall_jitter -= (all_stall_jitter + 8) >> 4;
+}
 
 void connection::stat_packet (bool in, int size)
 {
@@ -1288,6 +3044,14 @@ void connection::stats_update()
 	in_s_speed = in_s_now / 5;
 	out_s_speed = out_s_now / 5;
 	in_p_now = out_p_now = in_s_now = out_s_now = 0;
+
+	rec_in_speed = rec_in_now / 5;
+	rec_in_size = rec_in_now ? rec_in_bytes / rec_in_now : 0;
+	rec_out_speed = rec_out_now / 5;
+	rec_out_size = rec_out_now ? rec_out_bytes / rec_out_now : 0;
+	syscall_speed = syscalls_now / 5;
+	rec_in_now = rec_in_bytes = rec_out_now = rec_out_bytes = 0;
+	syscalls_now = 0;
 }
 
 void connection::stats_clear()
@@ -1295,6 +3059,10 @@ void connection::stats_clear()
 	in_p_total = in_p_now = in_s_total = in_s_now = 0;
 	out_p_total = out_p_now = out_s_total = out_s_now = 0;
 	in_p_speed = in_s_speed = out_p_speed = out_s_speed = 0;
+	rec_in_now = rec_in_bytes = rec_out_now = rec_out_bytes = 0;
+	syscalls_now = 0;
+	rec_in_speed = rec_in_size = rec_out_speed = rec_out_size = 0;
+	syscall_speed = 0;
 	stat_update = 0;
 	peer_addr_str.clear();
 	peer_connected_since = 0;
@@ -1303,72 +3071,37 @@ void connection::stats_clear()
 /*
  * bandwidth limiting
  *
- * as we rely on TCP, we can limit only upload, but that shouldn't be a problem.
+ * Upload is shaped right when writing, see shaper.h. As we rely on TCP,
+ * download can be limited only by dropping what's over the limit.
  */
 
 #define minimum_granularity 10000 //full recompute threshold = 10ms.
 
 void connection::bl_recompute()
 {
-	if (! (ubl_enabled || dbl_enabled) ) return;
+	if (!dbl_enabled) return;
 
 	static uint64_t last_recompute = timestamp();
 	uint64_t timediff = timestamp() - last_recompute;
-	if (timediff < minimum_granularity) {
-		/*
-		 * only push some up-bandwidth to connectins which desperately
-		 * need it. Spares much time when the connections trigger on
-		 * slowly.
-		 */
-		map<int, connection>::iterator i, e;
-		for (i = connections.begin(), e = connections.end(); i != e; ++i)
-			if (i->second.needs_write() &&
-			        (!i->second.ubl_available) )
-				i->second.ubl_available = ubl_burst;
-
-		return;
-	}
-	/*
-	 * normal recompute. Guess how many connections need bandwidth,
-	 * give them some, capped by maximal per-connection bandwidth.
-	 */
+	if (timediff < minimum_granularity) return;
 	last_recompute = timestamp();
 
 	map<int, connection>::iterator i, e;
-	int up_bandwidth_to_add, down_bandwidth_to_add;
-
-	up_bandwidth_to_add = down_bandwidth_to_add = 0;
-
-	if (ubl_total || dbl_total) {
+	int down_bandwidth_to_add = 0;
 
+	if (dbl_total) {
 		for (i = connections.begin(), e = connections.end();
-		        i != e; ++i) {
-			if (i->second.needs_write() ) ++up_bandwidth_to_add;
+		        i != e; ++i)
 			if (i->second.dbl_over > 0) ++down_bandwidth_to_add;
-		}
-
-		if (up_bandwidth_to_add)
-			up_bandwidth_to_add = timediff * ubl_total
-			                      / up_bandwidth_to_add / 1000000;
-		if (ubl_conn && (up_bandwidth_to_add > ubl_conn) )
-			up_bandwidth_to_add = ubl_conn;
 
 		if (down_bandwidth_to_add)
 			down_bandwidth_to_add = timediff * dbl_total
 			                        / down_bandwidth_to_add / 1000000;
 		if (dbl_conn && (down_bandwidth_to_add > dbl_conn) )
 			down_bandwidth_to_add = dbl_conn;
-
-	}
-	if (!ubl_total)
-		up_bandwidth_to_add = timediff * ubl_conn / 1000000;
-
-	if (!dbl_total)
-		down_bandwidth_to_add = timediff * dbl_conn / 1000000;
+	} else down_bandwidth_to_add = timediff * dbl_conn / 1000000;
 
 	for (i = connections.begin(), e = connections.end(); i != e; ++i) {
-		if (i->second.needs_write() )
-			i->second.ubl_available += up_bandwidth_to_add;
 		if (i->second.dbl_over < (unsigned int) down_bandwidth_to_add)
 			i->second.dbl_over = 0;
 		else i->second.dbl_over -= down_bandwidth_to_add;
@@ -1386,7 +3119,8 @@ void connection::bl_recompute()
 bool connection::red_can_send (size_t s)
 {
 	if (red_enabled) {
-		int fill = (100 * (send_q.len() + s) ) / max_waiting_data_size;
+		int fill = (100 * (send_q.len() + data_q.len() + s) )
+		           / max_waiting_data_size;
 		if (fill < red_threshold) return true;
 		if (fill > red_threshold + (rand() % (101 - red_threshold) ) )
 			return false;
@@ -1413,9 +3147,19 @@ static int comm_listeners_init()
 
 	for (i = l.begin();i != l.end();++i) {
 		Log_info ("trying to listen on `%s'", i->c_str() );
-		s = tcp_listen_socket (i->c_str() );
+		string a, b;
+		bool p = plain_address (*i, b);
+		bool d = dgram_address (b, a);
+		if (p && d) {
+			Log_error ("plain listener can't be DTLS");
+			return 1;
+		}
+		s = d ? udp_listen_socket (a.c_str() ) :
+		    tcp_listen_socket (a.c_str() );
 		if (s >= 0) {
 			listeners.insert (s);
+			if (d) dgram_listeners.insert (s);
+			if (p) plain_listeners.insert (s);
 			poll_set_add_read (s);
 		} else return 1;
 	}
@@ -1437,18 +3181,61 @@ static int comm_listeners_close()
 		}
 	}
 	listeners.clear();
+	dgram_listeners.clear();
+	plain_listeners.clear();
 	return ret;
 }
 
 void comm_listener_poll (int fd)
 {
-	try_accept_connection (fd);
+	if (dgram_listeners.count (fd) ) try_accept_dgram (fd);
+	else try_accept_connection (fd);
+}
+
+/*
+ * handshakes finished by workers
+ */
+
+void comm_handshake_poll()
+{
+	handshake_job*j;
+	map<int, connection>::iterator i;
+
+	while ( (j = handshake_finished() ) ) {
+		i = connections.find (j->id);
+		if ( (i == connections.end() ) || (i->second.hs_job != j) ) {
+			gnutls_deinit (j->session);
+			tcp_close_socket (j->fd);
+		} else i->second.handshake_finished (*j);
+		delete j;
+	}
+}
+
+int comm_handshakes_pending()
+{
+	return connection::all_handshaking;
 }
 
 /*
  * create/destroy the connections
  */
 
+#define bundle_prefix "bundle"
+
+//"bundleN:address" opens N streams, returns N
+static int bundle_address (const string&a, string&addr)
+{
+	size_t n = strlen (bundle_prefix), c = a.find (':');
+	int streams;
+	addr = a;
+	if (a.compare (0, n, bundle_prefix) || (c == string::npos) ) return 1;
+	if (sscanf (a.c_str() + n, "%d", &streams) != 1) return 1;
+	if (streams < 1) streams = 1;
+	if (streams > bundle_max_streams) streams = bundle_max_streams;
+	addr = a.substr (c + 1);
+	return streams;
+}
+
 static int comm_connections_init()
 {
 	list<string> c;
@@ -1461,12 +3248,18 @@ static int comm_connections_init()
 		return 0;
 	}
 
-	for (i = c.begin();i != c.end();++i)
-		if (connect_connection (*i) ) {
-			Log_error ("couldn't start connection to `%s'",
-			           i->c_str() );
-			return 1;
-		}
+	for (i = c.begin();i != c.end();++i) {
+		string a;
+		int n = bundle_address (*i, a);
+		uint32_t b = 0;
+		if (n > 1) while (!b) b = new_packet_uid();
+
+		for (int k = 0;k < n;++k) if (connect_connection (a, b, k, n) ) {
+				Log_error ("couldn't start connection to `%s'",
+				           i->c_str() );
+				return 1;
+			}
+	}
 
 	Log_info ("connections ready for connecting");
 	return 0;
@@ -1522,18 +3315,19 @@ static int comm_connections_close()
  */
 
 unsigned int connection::mtu = 8192;
+int connection::dgram_mtu = 4096;
 unsigned int connection::max_waiting_data_size = 1024000;
 unsigned int connection::max_remote_routes = 256;
-bool connection::ubl_enabled = false;
-int connection::ubl_total = 0;
-int connection::ubl_conn = 0;
-int connection::ubl_burst = 2048;
+bool connection::throttled = false;
 bool connection::dbl_enabled = false;
 int connection::dbl_total = 0;
 int connection::dbl_conn = 0;
 int connection::dbl_burst = 20480;
 bool connection::red_enabled = true;
 int connection::red_threshold = 50;
+int connection::prio_rate[prio_classes] = {0, 0, 1048576, 262144};
+uint32_t connection::local_features = feat_compact | feat_caps | feat_bundle
+                                      | feat_prio;
 
 int comm_load()
 {
@@ -1549,12 +3343,20 @@ int comm_load()
 	Log_info ("maximal size of internal packets is %d",
 	          connection::mtu);
 
+	if (!config_get_int ("dtls_mtu", t) )
+		connection::dgram_mtu = 4096;
+	else	connection::dgram_mtu = t;
+	Log_info ("datagram size on DTLS connections is %d",
+	          connection::dgram_mtu);
+
 	if (!config_get_int ("max_waiting_data_size", t) )
 		connection::max_waiting_data_size = 1024000;
 	else connection::max_waiting_data_size = t;
 	Log_info ("max %d pending data bytes",
 	          connection::max_waiting_data_size);
 
+	config_get_int ("tcp_notsent_lowat", notsent_lowat);
+
 	if (!config_get_int ("max_remote_routes", t) )
 		connection::max_remote_routes = 256;
 	else connection::max_remote_routes = t;
@@ -1577,23 +3379,7 @@ int comm_load()
 	Log_info ("connection keepalive is %gsec",
 	          0.000001*connection::keepalive);
 
-	if (config_get_int ("uplimit-conn", t) ) {
-		connection::ubl_enabled = true;
-		connection::ubl_conn = t;
-		Log_info ("per-connection upload limit is %dB/s", t);
-	}
-
-	if (config_get_int ("uplimit-total", t) ) {
-		connection::ubl_enabled = true;
-		connection::ubl_total = t;
-		Log_info ("total upload limit is %dB/s", t);
-	}
-
-	if (config_get_int ("uplimit-burst", t) ) {
-		connection::ubl_burst = t;
-	} else connection::ubl_burst = 2048;
-	if (connection::ubl_enabled)
-		Log_info ("burst upload size is %dB", t);
+	shaper_init();
 
 	if (config_get_int ("downlimit-conn", t) ) {
 		connection::dbl_enabled = true;
@@ -1623,6 +3409,34 @@ int comm_load()
 		          connection::red_threshold);
 	}
 
+	fq_init();
+	if (fq_enabled() ) connection::red_enabled = false;
+
+	config_get_int ("prio-voice-rate", connection::prio_rate[prio_voice]);
+	config_get_int ("prio-interactive-rate",
+	                connection::prio_rate[prio_interactive]);
+	Log_info ("voice is policed to %dB/s, interactive to %dB/s "
+	          "(0 is no limit)", connection::prio_rate[prio_voice],
+	          connection::prio_rate[prio_interactive]);
+
+	if (config_is_set ("compact_headers")
+	        && !config_is_true ("compact_headers") )
+		connection::local_features &= ~feat_compact;
+	if (connection::local_features & feat_compact)
+		Log_info ("compact packet headers enabled");
+
+	ktls_init();
+
+	if (config_get_int ("max_handshakes", t) ) max_handshakes = t;
+	else max_handshakes = 256;
+	Log_info ("at most %d handshakes at once, refusing more incoming",
+	          max_handshakes);
+
+	if (config_is_true ("compress") ) {
+		connection::local_features |= feat_compress;
+		Log_info ("packet compression enabled");
+	}
+
 	/*
 	 * configuration done, lets init.
 	 */
@@ -1636,6 +3450,11 @@ int comm_load()
 
 int comm_init()
 {
+	if (handshake_init() ) {
+		Log_fatal ("couldn't start handshake workers");
+		return 2;
+	}
+	if (handshake_workers() ) poll_set_add_read (handshake_notify_fd() );
 
 	if (comm_listeners_init() ) {
 		Log_fatal ("couldn't initialize listeners");
@@ -1658,22 +3477,66 @@ int comm_shutdown()
 	if (comm_connections_close() )
 		Log_warn ("closing of some connections failed!");
 
+	if (handshake_workers() )
+		poll_set_remove_read (handshake_notify_fd() );
+	handshake_shutdown();
+
 	if (ssl_destroy() )
 		Log_warn ("SSL shutdown failed!");
 
 	return 0;
 }
 
+/*
+ * Connections that got something to send are remembered until they have
+ * nothing left, so that idle ones (most of them, usually) cost nothing
+ * here. Those that wait for the socket or for tokens stay.
+ */
+
+static set<int> writers;
+
+void connection::want_write()
+{
+	writers.insert (id);
+}
+
 void comm_flush_data()
 {
 	/*
 	 * call this after each timeslice. It prevents send-data fragmentation.
+	 *
+	 * Connections that borrow from the root take what's there in turns,
+	 * so the first one doesn't always get everything.
 	 */
-	if (connection::ubl_enabled) connection::bl_recompute();
 
-	map<int, connection>::iterator i;
-	for (i = connections.begin();i != connections.end();++i)
-		i->second.try_write();
+	static int next = 0;
+	set<int>::iterator i;
+	map<int, connection>::iterator c;
+	vector<int> ids;
+
+	connection::throttled = false;
+	if (writers.empty() ) return;
+
+	//writing may reset connections, so the list is walked by a copy
+	i = writers.lower_bound (next);
+	ids.insert (ids.end(), i, writers.end() );
+	ids.insert (ids.end(), writers.begin(), i);
+
+	for (size_t k = 0;k < ids.size();++k) {
+		c = connections.find (ids[k]);
+		if (c != connections.end() ) {
+			c->second.try_write();
+			if (c->second.needs_write() || c->second.corked) continue;
+		}
+		writers.erase (ids[k]);
+	}
+
+	next = ids[0] + 1;
+}
+
+bool comm_throttled()
+{
+	return connection::throttled;
 }
 
 void comm_periodic_update()
@@ -1698,6 +3561,15 @@ void comm_periodic_update()
 	}
 
 	connection::bl_recompute();
+
+	dh_check_expiry();
+
+	//workers may be reading the credentials
+	if (dh_pending() ) {
+		handshake_pause();
+		dh_periodic_update (xcred);
+		handshake_resume();
+	}
 }
 
 /*
@@ -1708,7 +3580,8 @@ void comm_broadcast_route_update (uint8_t*data, int n)
 {
 	map<int, connection>::iterator i;
 	for (i = connections.begin();i != connections.end();++i)
-		if (i->second.state == cs_active)
+		if ( (i->second.state == cs_active)
+		        && !i->second.bundle_secondary() )
 			i->second.write_route_diff (data, n);
 }
 
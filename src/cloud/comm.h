@@ -14,18 +14,153 @@
 #define _CVPN_COMM_H
 
 #include "sq.h"
+#include "wire.h"
 #include "address.h"
+#include "zerocopy.h"
+#include "fq.h"
+#include "sojourn.h"
+#include "shaper.h"
 
 #include <stdint.h>
 
 #include <gnutls/gnutls.h>
+#include <gnutls/dtls.h>
 
 #include <map>
 #include <set>
+#include <deque>
 #include <queue>
 #include <string>
 using namespace std;
 
+/*
+ * inter-node protocol frame layouts, see wire.h
+ */
+
+class comm_header
+{
+public:
+	enum { size = 4 };
+	typedef wire_field<0, uint8_t> type;
+	typedef wire_field<1, uint8_t> special;
+	typedef wire_field<2, uint16_t> length;
+};
+wire_check (comm_header, length);
+wire_order (comm_header, type, special);
+wire_order (comm_header, special, length);
+
+class comm_packet
+{
+public:
+	enum { size = 20 };
+	typedef wire_field<0, uint32_t> id;
+	typedef wire_field<4, uint16_t> ttl;
+	typedef wire_field<6, uint32_t> inst;
+	typedef wire_field<10, uint16_t> dof;
+	typedef wire_field<12, uint16_t> ds;
+	typedef wire_field<14, uint16_t> sof;
+	typedef wire_field<16, uint16_t> ss;
+	typedef wire_field<18, uint16_t> length;
+};
+wire_check (comm_packet, length);
+wire_order (comm_packet, id, ttl);
+wire_order (comm_packet, ttl, inst);
+wire_order (comm_packet, inst, dof);
+wire_order (comm_packet, dof, ds);
+wire_order (comm_packet, ds, sof);
+wire_order (comm_packet, sof, ss);
+wire_order (comm_packet, ss, length);
+
+/*
+ * compact packet: 32b ID, then varint TTL, instance (unless it's the same
+ * as in the previous compact packet on the connection), varint offsets and
+ * sizes (unless the layout is implied by flags in the special byte).
+ * Payload is the rest of the frame.
+ */
+
+class comm_compact
+{
+public:
+	enum { size = 4 };
+	typedef wire_field<0, uint32_t> id;
+};
+wire_check (comm_compact, id);
+
+class comm_cap_entry
+{
+public:
+	enum { size = 2 };
+	typedef wire_field<0, uint8_t> tag;
+	typedef wire_field<1, uint8_t> length;
+};
+wire_check (comm_cap_entry, length);
+wire_order (comm_cap_entry, tag, length);
+
+class comm_route_entry
+{
+public:
+	enum { size = 14 };
+	typedef wire_field<0, uint32_t> ping;
+	typedef wire_field<4, uint32_t> dist;
+	typedef wire_field<8, uint32_t> inst;
+	typedef wire_field<12, uint16_t> addr_size;
+};
+wire_check (comm_route_entry, addr_size);
+wire_order (comm_route_entry, ping, dist);
+wire_order (comm_route_entry, dist, inst);
+wire_order (comm_route_entry, inst, addr_size);
+
+/*
+ * Hello is an empty route-diff with features in the special byte. Old
+ * nodes take it as a no-op, so they never hear of new frame types.
+ * If both sides set feat_caps, each one follows with a capability frame
+ * that carries the full feature mask and the limits.
+ */
+
+#define feat_compact 0x01
+#define feat_compress 0x02 //works only together with compact packets
+#define feat_caps 0x80
+#define feat_bundle 0x100 //only in capability frame
+#define feat_prio 0x200 //same
+#define feat_plain 0x400 //only in the greeting of plain links, see activate
+
+/*
+ * A routed packet on its way to connections. When the packet goes to more
+ * than one place, the whole inter-node frame (header and payload) gets
+ * encoded only once into a shared block, and every send queue just holds
+ * a reference to it. Block is freed after the last queue sends it.
+ */
+
+class packet_frame
+{
+public:
+	uint32_t id, inst;
+	uint16_t ttl, dof, ds, sof, ss;
+	sq_payload payload;
+	int fanout; //how many connections are going to get this
+	uint64_t since; //when it came to this node, for the sojourn times
+	uint8_t prio; //class, see wire.h
+
+	sq_ref frame;
+	int uses;
+
+	//compressed payload, shared as well. zstate 0 = not tried yet,
+	//1 = compressed, 2 = not worth it
+	sq_ref zpayload;
+	int zstate;
+
+	inline packet_frame (uint32_t ID, uint16_t TTL, uint32_t INST,
+	                     uint16_t DOF, uint16_t DS,
+	                     uint16_t SOF, uint16_t SS,
+	                     const uint8_t*data, size_t size) :
+			id (ID), inst (INST), ttl (TTL),
+			dof (DOF), ds (DS), sof (SOF), ss (SS),
+			payload (data, size), fanout (1), since (0),
+			prio (prio_best_effort), uses (0), zstate (0) {}
+
+	const sq_ref& encode();
+};
+
 class connection
 {
 public:
@@ -48,6 +183,7 @@ public:
 	}
 
 	int state;
+	void set_state (int); //keeps all_handshaking
 
 #define cs_inactive 0
 #define cs_retry_timeout 1
@@ -82,17 +218,46 @@ public:
 	explicit inline connection (int ID) {
 		id = ID;
 		fd = -1;
+		state = cs_inactive;
 		ping = timeout;
 		last_ping = 0;
 		cached_header.type = 0;
 		route_overflow = false;
 		stats_clear();
-		ubl_available = 0;
+		shaper_conn_setup (shaper);
+		leaves_len = 0;
+		prio_len = 0;
+		for (int i = 0;i < prio_classes;++i)
+			prio_out[i] = prio_drops[i] = prio_over[i] = 0;
+		prio_setup();
 		dbl_over = 0;
 		session = 0;
 		connect_address = peer_addr_str = "";
 		peer_connected_since = 0;
 		pending_write = 0;
+		ctl_q.budgeted = false;
+		ctl_since = 0;
+		stage_pos = stage_len = 0;
+		buffers_busy = 0;
+		features = 0;
+		peer_max_frame = peer_max_record = 0;
+		caps_received = false;
+		compact_tx_valid = compact_rx_valid = false;
+		comp_clear();
+		dgram = false;
+		dgram_last_report = dgram_dropped = 0;
+		bundle_id = 0;
+		bundle_index = bundle_count = 0;
+		bundled = false;
+		ktls_tx = ktls_rx = false;
+		ktls_wait = 0;
+		plain = plain_rx = false;
+		handshake_start = handshake_usec = 0;
+		resumed = false;
+		hs_job = 0;
+		rec_bulk = corked = pull_drained = false;
+		rec_burst = rec_last = 0;
+		read_size = 4096;
 	}
 
 	connection (); //this is supposed to fail, always use c(ID)
@@ -101,16 +266,27 @@ public:
 	 * packet handling/sending functions.
 	 */
 
-	void handle_packet (uint8_t*data, int len);
+	void handle_packet (uint8_t special, uint8_t*data, int len);
+	void handle_compact_packet (uint8_t flags, uint8_t*data, int len);
+	void handle_hello (uint8_t features);
+	void handle_caps (uint8_t*data, int len);
 	void handle_route (bool set, uint8_t*data, int len);
 	void handle_ping (uint8_t id);
 	void handle_pong (uint8_t id);
 	void handle_route_request ();
 
-	void write_packet (uint32_t id, uint16_t ttl, uint32_t inst,
-	                   uint16_t dof, uint16_t ds,
-	                   uint16_t sof, uint16_t ss,
-	                   uint16_t s, const uint8_t*buf);
+	void write_packet (packet_frame&);
+	void write_full_packet (packet_frame&, sgqueue&);
+	void write_compact_packet (packet_frame&, sgqueue&);
+	bool write_data_packet (packet_frame&);
+	bool write_to_queue (packet_frame&, sgqueue&,
+	                     sojourn_stamps&, size_t&total);
+	shaper_leaf& leaf (uint32_t inst);
+	bool compress_payload (packet_frame&);
+	void write_hello();
+	size_t caps_frame (uint8_t*, uint32_t features);
+	void write_caps();
+	bool write_plain_greeting();
 	void write_route_set (uint8_t*data, int n);
 	void write_route_diff (uint8_t*data, int n);
 	void write_ping (uint8_t id);
@@ -122,10 +298,107 @@ public:
 	 */
 
 	squeue recv_q;
-	squeue send_q;
+
+	/*
+	 * Control frames (pings, routes, caps) and data frames wait in
+	 * separate queues. send_q is what's being written; whole frames are
+	 * fed into it, control ones always first, so that a control frame
+	 * never waits for more than one feed of data.
+	 */
+	sgqueue send_q, ctl_q, data_q;
+	flow_queue fq; //data frames go here instead of data_q, see fq.h
+	void feed_send_q();
+	bool feed_frame(); //one from fq or data_q
+
+	/*
+	 * Priority classes other than best effort wait in their own queues:
+	 * voice goes right after control frames, interactive before the rest
+	 * of data, background only when there's nothing else. Every class
+	 * has a token bucket (prio-*-rate), frames over it wait with best
+	 * effort data.
+	 */
+	sgqueue prio_q[prio_classes];
+	sojourn_stamps prio_stamps[prio_classes];
+	size_t prio_len;
+	uint64_t prio_out[prio_classes], prio_drops[prio_classes],
+	         prio_over[prio_classes];
+	shaper_class prio_police[prio_classes];
+	static int prio_rate[prio_classes];
+	void prio_setup();
+	bool prio_queueing();
+	bool prio_conforms (packet_frame&);
+	bool feed_prio (int prio);
+
+	inline void feed() {
+		if (ctl_q.len() || data_q.len() || fq.len() || leaves_len
+		        || prio_len) feed_send_q();
+	}
+
+	/*
+	 * Sojourn times: every frame is remembered with the time it was
+	 * queued, data frames with the time the node got them. Whatever is
+	 * read out of send_q has left the node.
+	 */
+	sojourn_stamps send_stamps, data_stamps;
+	uint64_t ctl_since; //when ctl_q stopped being empty
+	delay_hist sojourn_data, sojourn_ctl;
+
+	uint8_t* ctl_buffer (size_t size);
+
+	inline void send_q_read (size_t n) {
+		send_q.read (n);
+		send_stamps.read (n, sojourn_data, sojourn_ctl);
+	}
 
 	int pending_write;
 
+	sq_ref write_stage; //small segments gathered into one record
+	size_t stage_pos, stage_len;
+
+	/*
+	 * record sizing: records fit in a TCP segment while the link is
+	 * interactive, and are full and corked once it gets busy. Reads
+	 * follow the size of what arrives.
+	 */
+
+	bool rec_bulk, corked, pull_drained;
+	uint64_t rec_burst, rec_last;
+	int read_size;
+	void record_sizing();
+	int record_size();
+	int corked_write();
+
+	uint64_t buffers_busy;
+	void release_buffers();
+	size_t resident_buffers();
+	size_t leaves_resident();
+
+	/*
+	 * protocol features, negotiated by the hello message, and refined
+	 * by the capability frame if both sides know it. Peer limits are 0
+	 * until the peer tells them.
+	 */
+
+	static uint32_t local_features;
+	uint32_t features;
+	uint32_t peer_max_frame, peer_max_record;
+	bool caps_received;
+	unsigned int max_frame();
+	int max_record();
+
+	/*
+	 * adaptive compression: after several packets that didn't compress,
+	 * it's switched off for exponentially growing number of packets.
+	 */
+
+	int comp_fails, comp_skip, comp_backoff;
+	uint64_t comp_in, comp_out, comp_packets, comp_bypass, comp_usec;
+	void comp_clear();
+
+	//compact packet instance context, for both directions
+	uint32_t compact_tx_inst, compact_rx_inst;
+	bool compact_tx_valid, compact_rx_valid;
+
 	struct {
 		uint8_t type;
 		uint8_t special;
@@ -136,6 +409,7 @@ public:
 
 	bool try_read();
 	bool try_write(); //both called by try_data(); dont use directly
+	uint8_t* write_chunk (int&);
 
 	void try_data();
 
@@ -144,8 +418,14 @@ public:
 	void try_ssl_connect();
 	void try_close();
 
+	bool peer_verified (int verify_result, unsigned int verify_status);
+	void accepted (int verify_result, unsigned int verify_status);
+	void established (int verify_result, unsigned int verify_status);
+
 	void start_connect();
 	void start_accept();
+	void start_accept_dgram (const uint8_t*hello, size_t len,
+	                         gnutls_dtls_prestate_st&);
 	void send_ping();
 
 	void activate();
@@ -192,6 +472,77 @@ public:
 	int alloc_ssl (bool server);
 	void dealloc_ssl();
 
+	/*
+	 * handshake accounting and session resumption; connecting side
+	 * caches the session by connect_address.
+	 */
+
+	uint64_t handshake_start, handshake_usec;
+	bool resumed;
+	void handshake_done();
+	void save_session();
+
+	static uint64_t all_handshakes_full, all_handshakes_resumed,
+	       all_handshake_usec, all_handshakes_refused;
+	static int all_handshaking; //connections in TLS handshake, both ways
+
+	//handshake running on a worker thread, see handshake.h
+	class handshake_job*hs_job;
+	void handshake_offload (bool server);
+	void handshake_finished (class handshake_job&);
+
+	/*
+	 * time spent in single poll event handlers, which is the delay
+	 * that all other connections see; jitter is smoothed like RFC3550.
+	 */
+
+	static uint64_t all_stall_max, all_stall_jitter, all_stall_last;
+	static void stat_stall (uint64_t usec);
+
+	//kernel TLS offload, see ktls.h
+	bool ktls_tx, ktls_rx;
+	uint64_t ktls_wait; //until when offloading waits for a ticket
+	void ktls_late();
+	bool raw_write();
+
+	//plaintext after the handshake, see plain_address() and activate()
+	bool plain;
+	bool plain_rx; //peer's greeting came, reading bypasses TLS
+	sock_zerocopy zc;
+
+	/*
+	 * datagram (DTLS) transport. Every record is one datagram carrying
+	 * whole frames, and nothing is retransmitted -- lost route updates
+	 * are fixed by resending the full route set every keepalive.
+	 */
+
+	bool dgram;
+	static int dgram_mtu;
+	sq_ref dgram_hello; //first datagram, already read by the listener
+	uint64_t dgram_last_report, dgram_dropped;
+	uint8_t* dgram_chunk (int&);
+
+	/*
+	 * Bundles are several streams to the same peer that act as a single
+	 * neighbour. Only the primary stream (index 0) carries routes and is
+	 * seen by routing; it spreads packets over the other streams by flow
+	 * hash. Connecting side keeps the bundle setup across reconnects.
+	 */
+
+	uint32_t bundle_id; //0 if not in any
+	uint16_t bundle_index, bundle_count;
+	bool bundled; //both sides agreed, stream is in use
+	string bundle_peer; //side and peer certificate, see bundle_join
+
+	bool bundle_peer_key();
+	void bundle_join();
+	void bundle_leave();
+	connection& bundle_stream (packet_frame&);
+	int bundle_primary();
+	inline bool bundle_secondary() {
+		return bundled && bundle_index;
+	}
+
 	/*
 	 * queue management
 	 */
@@ -200,11 +551,24 @@ public:
 	static unsigned int max_waiting_data_size;
 	static unsigned int max_remote_routes;
 
+	//data and priority classes share the limit
+	inline size_t queued_data() {
+		return send_q.len() + data_q.len() + fq.len() + prio_len;
+	}
+
+	//flow queueing drops from the longest flow on its own
 	inline bool can_write_data (size_t s) {
-		return (send_q.len() + s < max_waiting_data_size)
+		if (fq_enabled() ) return true;
+		return (queued_data() + s < max_waiting_data_size)
 		       && red_can_send (s);
 	}
 
+	//every leaf has a limit of its own and a plain tail drop
+	inline bool can_queue (sgqueue&q, size_t s) {
+		if (&q == &data_q) return can_write_data (s);
+		return q.len() + s < max_waiting_data_size;
+	}
+
 	/*
 	 * route information size management
 	 */
@@ -230,20 +594,33 @@ public:
 	in_p_speed, in_s_speed,
 	out_p_speed, out_s_speed;
 
+	uint64_t
+	rec_in_now, rec_in_bytes, rec_out_now, rec_out_bytes,
+	syscalls_now,
+	rec_in_speed, rec_in_size, rec_out_speed, rec_out_size,
+	syscall_speed;
+
 	static uint64_t
 	all_in_p_total, all_in_s_total,
-	all_out_p_total, all_out_s_total;
+	all_out_p_total, all_out_s_total,
+	all_fanout_frames, all_fanout_saved,
+	all_compact_saved;
 
 	string peer_addr_str;
 	uint64_t peer_connected_since;
 
 	/*
-	 * bandwidth limiting
+	 * bandwidth limiting. Upload goes through the shaper (see shaper.h):
+	 * data of instances with a class waits in the leaves, and is fed
+	 * into send_q as the leaf tokens allow.
 	 */
 
-	static bool ubl_enabled;
-	static int ubl_total, ubl_conn, ubl_burst;
-	unsigned int ubl_available;
+	shaper_class shaper;
+	map<uint32_t, shaper_leaf> leaves;
+	deque<uint32_t> backlog; //instances whose leaves hold some data
+	size_t leaves_len;
+	bool feed_leaves (bool borrow);
+	static bool throttled; //some connection waits for tokens
 
 	static bool dbl_enabled;
 	static int dbl_total, dbl_conn, dbl_burst;
@@ -252,9 +629,13 @@ public:
 	static void bl_recompute();
 
 	inline bool needs_write() {
-		return send_q.len();
+		return send_q.len() || stage_len || ctl_q.len() || data_q.len()
+		       || fq.len() || leaves_len || prio_len;
 	}
 
+	//comm_flush_data only looks at connections that asked for it
+	void want_write();
+
 	/*
 	 * traffic shaping - Random Early Drop
 	 */
@@ -265,12 +646,15 @@ public:
 };
 
 void comm_listener_poll (int fd);
+void comm_handshake_poll();
+int comm_handshakes_pending();
 
 int comm_load();
 int comm_init();
 int comm_shutdown();
 
 void comm_flush_data();
+bool comm_throttled(); //upload shaper waits, poll shouldn't sleep long
 void comm_periodic_update();
 
 void comm_broadcast_route_update (uint8_t*data, int n);
@@ -0,0 +1,291 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dh.h"
+
+#include "conf.h"
+#define LOGNAME "cloud/dh"
+#include "log.h"
+#include "timestamp.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#ifndef __WIN32__
+#include <pthread.h>
+#endif
+
+static gnutls_dh_params_t dh_params; //installed ones
+static string cache_file;
+static int cache_lifetime = 604800; //a week
+static time_t params_time = 0; //when the installed params were made
+
+/*
+ * files
+ */
+
+static int load_params (const string&name, gnutls_dh_params_t p)
+{
+	FILE*f;
+	long s;
+	vector<uint8_t>buffer;
+
+	f = fopen (name.c_str(), "r");
+	if (!f) {
+		Log_error ("can't open DH params file");
+		return 5;
+	}
+
+	fseek (f, 0, SEEK_END);
+	s = ftell (f);
+	fseek (f, 0, SEEK_SET);
+	if ( (s <= 0) || s > 65536) { //prevent too large files.
+		Log_error ("DH params file empty or too big");
+		fclose (f);
+		return 6;
+	}
+
+	buffer.resize (s, 0);
+	if (fread (buffer.begin().base(), s, 1, f) != 1) {
+		Log_error ("bad DH param read");
+		fclose (f);
+		return 7;
+	}
+	fclose (f);
+
+	gnutls_datum_t data = {buffer.begin().base(), s};
+
+	if (gnutls_dh_params_import_pkcs3
+	        (p, &data, GNUTLS_X509_FMT_PEM) ) {
+		Log_error ("DH params importing failed");
+		return 8;
+	}
+	return 0;
+}
+
+static bool cache_fresh (time_t*mtime = 0)
+{
+	struct stat st;
+	if (!cache_file.length() ) return false;
+	if (stat (cache_file.c_str(), &st) ) return false;
+	if (mtime) *mtime = st.st_mtime;
+	return time (0) - st.st_mtime < cache_lifetime;
+}
+
+//written aside and renamed, so that nobody reads half of it
+static void save_cache()
+{
+	if (!cache_file.length() ) return;
+
+	gnutls_datum_t d;
+	if (gnutls_dh_params_export2_pkcs3 (dh_params, GNUTLS_X509_FMT_PEM, &d) )
+		return;
+
+	string tmp = cache_file + ".new";
+	FILE*f = fopen (tmp.c_str(), "w");
+	bool ok = f && (fwrite (d.data, d.size, 1, f) == 1);
+	if (f && fclose (f) ) ok = false;
+	gnutls_free (d.data);
+
+	if (ok && !rename (tmp.c_str(), cache_file.c_str() ) )
+		Log_info ("DH params cached in `%s'", cache_file.c_str() );
+	else {
+		Log_warn ("could not write DH params cache `%s'",
+		          cache_file.c_str() );
+		remove (tmp.c_str() );
+	}
+}
+
+/*
+ * background generation
+ */
+
+#define gen_idle 0
+#define gen_running 1
+#define gen_done 2
+#define gen_failed 3
+
+static gnutls_dh_params_t gen_params;
+static uint64_t gen_start = 0;
+static uint64_t next_expiry_check = 0;
+
+#define expiry_check_interval 60000000 //1 minute
+
+static unsigned int gen_bits()
+{
+	return gnutls_sec_param_to_pk_bits (GNUTLS_PK_DH,
+	                                    GNUTLS_SEC_PARAM_MEDIUM);
+}
+
+#ifndef __WIN32__
+
+static pthread_t gen_thread;
+static pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gen_state = gen_idle;
+
+static void* generate (void*)
+{
+	int r = gnutls_dh_params_generate2 (gen_params, gen_bits() );
+
+	pthread_mutex_lock (&gen_lock);
+	gen_state = r ? gen_failed : gen_done;
+	pthread_mutex_unlock (&gen_lock);
+	return 0;
+}
+
+static int get_state()
+{
+	pthread_mutex_lock (&gen_lock);
+	int r = gen_state;
+	pthread_mutex_unlock (&gen_lock);
+	return r;
+}
+
+static void start_generating()
+{
+	gnutls_dh_params_init (&gen_params);
+	gen_start = timestamp_precise();
+	gen_state = gen_running;
+	if (pthread_create (&gen_thread, 0, generate, 0) ) {
+		Log_error ("cannot start DH params generation");
+		gen_state = gen_idle;
+		gnutls_dh_params_deinit (gen_params);
+		return;
+	}
+	Log_info ("generating DH params in background");
+}
+
+#else //__WIN32__
+
+static int gen_state = gen_idle;
+
+static int get_state()
+{
+	return gen_state;
+}
+
+//no threads here, at least it doesn't run before the config is read
+static void start_generating()
+{
+	gnutls_dh_params_init (&gen_params);
+	gen_start = timestamp_precise();
+	gen_state = gnutls_dh_params_generate2 (gen_params, gen_bits() ) ?
+	            gen_failed : gen_done;
+}
+
+#endif
+
+bool dh_pending()
+{
+	int s = get_state();
+	return (s == gen_done) || (s == gen_failed);
+}
+
+void dh_periodic_update (gnutls_certificate_credentials_t xcred)
+{
+	int s = get_state();
+	if ( (s != gen_done) && (s != gen_failed) ) return;
+
+#ifndef __WIN32__
+	pthread_join (gen_thread, 0);
+#endif
+	gen_state = gen_idle;
+
+	if (s == gen_failed) {
+		Log_error ("DH params generation failed, staying with ECDHE");
+		gnutls_dh_params_deinit (gen_params);
+		return;
+	}
+
+	//credentials keep just a pointer, old ones go after the switch
+	gnutls_certificate_set_dh_params (xcred, gen_params);
+	gnutls_dh_params_deinit (dh_params);
+	dh_params = gen_params;
+	params_time = time (0);
+	Log_info ("DH params generated in %gs and installed",
+	          0.000001 * (timestamp_precise() - gen_start) );
+
+	save_cache();
+}
+
+/*
+ * A node that runs longer than the cache lifetime regenerates the params
+ * the same way as on start. The installed ones are checked too, so that
+ * an unwritable cache doesn't make it generate again every minute.
+ * Win32 would generate in the main loop, so it waits for a restart.
+ */
+
+void dh_check_expiry()
+{
+#ifndef __WIN32__
+	if (!cache_file.length() || get_state() != gen_idle) return;
+	if (timestamp() < next_expiry_check) return;
+	next_expiry_check = timestamp() + expiry_check_interval;
+
+	if (cache_fresh() || time (0) - params_time < cache_lifetime) return;
+	Log_info ("DH params are older than %ds", cache_lifetime);
+	start_generating();
+#endif
+}
+
+int dh_init (gnutls_certificate_credentials_t xcred)
+{
+	string t;
+
+	gnutls_dh_params_init (&dh_params);
+
+	if (config_get ("x509dh", t) ) {
+		int r = load_params (t, dh_params);
+		if (!r) gnutls_certificate_set_dh_params (xcred, dh_params);
+		return r;
+	}
+
+	config_get ("x509dh_cache", cache_file);
+	config_get_int ("x509dh_cache_lifetime", cache_lifetime);
+
+	if (cache_fresh (&params_time) &&
+	    !load_params (cache_file, dh_params) ) {
+		Log_info ("using cached DH params from `%s'",
+		          cache_file.c_str() );
+		gnutls_certificate_set_dh_params (xcred, dh_params);
+		return 0;
+	}
+
+	Log_info ("starting with ECDHE only");
+	start_generating();
+	dh_periodic_update (xcred); //win32 is done already
+	return 0;
+}
+
+void dh_destroy()
+{
+	int s = get_state();
+
+#ifndef __WIN32__
+	/*
+	 * Generation can't be interrupted, and there's no point in waiting
+	 * for it on exit; the thread just dies with the process.
+	 */
+	if (s == gen_running) pthread_detach (gen_thread);
+	else if (s != gen_idle) pthread_join (gen_thread, 0);
+#endif
+	if ( (s == gen_done) || (s == gen_failed) )
+		gnutls_dh_params_deinit (gen_params);
+
+	gnutls_dh_params_deinit (dh_params);
+}
+
@@ -0,0 +1,41 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_DH_H
+#define _CVPN_DH_H
+
+#include <gnutls/gnutls.h>
+
+/*
+ * DH parameters
+ *
+ * Generating the parameters takes long, so it's never done on startup.
+ * Unless x509dh or a fresh enough x509dh_cache file is there, the node
+ * starts with ECDHE key exchange only, while the parameters are generated
+ * by a background thread. Main loop then installs them and writes the
+ * cache for the next start. Cached params older than x509dh_cache_lifetime
+ * get replaced the same way while the node runs.
+ */
+
+int dh_init (gnutls_certificate_credentials_t); //nonzero on failure
+
+//installs generated params; handshake workers must be paused
+void dh_periodic_update (gnutls_certificate_credentials_t);
+
+bool dh_pending(); //is something waiting for installation?
+
+void dh_check_expiry(); //starts regenerating expired cached params
+
+void dh_destroy();
+
+#endif
+
@@ -0,0 +1,254 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fq.h"
+
+#include "conf.h"
+#define LOGNAME "cloud/fq"
+#include "log.h"
+#include "timestamp.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+static bool enabled = false;
+static int n_flows = 64;
+static int quantum = 1514;
+static int target = 5000; //usec
+static int interval = 100000;
+static uint32_t seed = 0;
+
+void fq_init()
+{
+	enabled = config_is_true ("fq_codel");
+	if (!enabled) return;
+
+	config_get_int ("fq_flows", n_flows);
+	if (n_flows < 1) n_flows = 1;
+	config_get_int ("fq_quantum", quantum);
+	if (quantum < 64) quantum = 64;
+	config_get_int ("fq_target", target);
+	config_get_int ("fq_interval", interval);
+
+	//so that nobody can aim at a single flow from outside
+	seed = rand();
+
+	Log_info ("FQ-CoDel with %d flows, quantum %dB, target %gms, "
+	          "interval %gms", n_flows, quantum,
+	          0.001 * target, 0.001 * interval);
+}
+
+bool fq_enabled()
+{
+	return enabled;
+}
+
+//FNV-1a
+static inline uint32_t hash_bytes (uint32_t h, const uint8_t*p, size_t n)
+{
+	while (n--) h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+uint32_t fq_hash (uint32_t inst, const uint8_t*dst, size_t ds,
+                  const uint8_t*src, size_t ss)
+{
+	uint32_t h = 2166136261U ^ seed;
+	h = hash_bytes (h, (const uint8_t*) &inst, sizeof (inst) );
+	h = hash_bytes (h, dst, ds);
+	return hash_bytes (h, src, ss);
+}
+
+/*
+ * queueing
+ */
+
+void flow_queue::enqueue (uint32_t hash, sgqueue&q, size_t limit,
+                          uint64_t since)
+{
+	if (flows.empty() ) flows.resize (n_flows);
+
+	int i = hash % flows.size();
+	flow&f = flows[i];
+
+	f.frames.push_back (frame() );
+	f.frames.back().len = q.len();
+	f.frames.back().enqueued = timestamp();
+	f.frames.back().since = since;
+	total += q.len();
+	f.q.take (q, q.len() );
+
+	if (!f.list) {
+		f.list = 1;
+		f.deficit = quantum;
+		new_flows.push_back (i);
+	}
+
+	//over the limit, the fattest flow pays
+	while (total > limit) {
+		size_t max = 0, j, fat = 0;
+		for (j = 0;j < flows.size();++j)
+			if (flows[j].q.len() > max) {
+				max = flows[j].q.len();
+				fat = j;
+			}
+		if (!max) break;
+		drop_head (flows[fat]);
+	}
+}
+
+void flow_queue::drop_head (flow&f)
+{
+	size_t l = f.frames.front().len;
+	f.q.read (l);
+	f.frames.pop_front();
+	total -= l;
+	++f.drops;
+	++drops;
+}
+
+/*
+ * CoDel as in RFC 8289. head() looks at the first frame and tells whether
+ * it has been over the target for long enough to be dropped.
+ */
+
+bool flow_queue::head (flow&f, uint64_t now, bool&ok_to_drop)
+{
+	ok_to_drop = false;
+	if (f.frames.empty() ) {
+		f.first_above = 0;
+		return false;
+	}
+
+	uint64_t s = now - f.frames.front().enqueued;
+	if ( (s < (uint64_t) target) || (f.q.len() <= (size_t) quantum) )
+		f.first_above = 0;
+	else if (!f.first_above)
+		f.first_above = now + interval;
+	else if (now >= f.first_above)
+		ok_to_drop = true;
+	return true;
+}
+
+static inline uint64_t control_law (uint64_t t, uint32_t count)
+{
+	return t + (uint64_t) (interval / sqrt ( (double) count) );
+}
+
+bool flow_queue::codel_dequeue (flow&f, uint64_t now)
+{
+	bool ok_to_drop;
+
+	if (!head (f, now, ok_to_drop) ) {
+		f.dropping = false;
+		return false;
+	}
+
+	if (f.dropping) {
+		if (!ok_to_drop) f.dropping = false;
+		while (f.dropping && (now >= f.drop_next) ) {
+			drop_head (f);
+			++f.count;
+			if (!head (f, now, ok_to_drop) ) {
+				f.dropping = false;
+				return false;
+			}
+			if (!ok_to_drop) f.dropping = false;
+			else f.drop_next = control_law (f.drop_next, f.count);
+		}
+	} else if (ok_to_drop) {
+		drop_head (f);
+		if (!head (f, now, ok_to_drop) ) return false;
+		f.dropping = true;
+		uint32_t delta = f.count - f.last_count;
+		f.count = ( (delta > 1)
+		            && (now - f.drop_next < 16 * (uint64_t) interval) ) ?
+		          delta : 1;
+		f.drop_next = control_law (now, f.count);
+		f.last_count = f.count;
+	}
+	return true;
+}
+
+bool flow_queue::dequeue (sgqueue&q, uint64_t&since)
+{
+	uint64_t now = timestamp();
+
+	for (;;) {
+		deque<int>&l = new_flows.size() ? new_flows : old_flows;
+		if (l.empty() ) return false;
+
+		int i = l.front();
+		flow&f = flows[i];
+
+		if (f.deficit <= 0) {
+			f.deficit += quantum;
+			l.pop_front();
+			f.list = 2;
+			old_flows.push_back (i);
+			continue;
+		}
+
+		if (!codel_dequeue (f, now) ) {
+			//a new flow that ran empty still gets a turn among the old
+			l.pop_front();
+			if ( (&l == &new_flows) && old_flows.size() ) {
+				f.list = 2;
+				old_flows.push_back (i);
+			} else f.list = 0;
+			continue;
+		}
+
+		frame&fr = f.frames.front();
+		uint64_t s = now - fr.enqueued;
+		f.sojourn += s - (f.sojourn >> 3);
+		if (s > f.sojourn_max) f.sojourn_max = s;
+		++f.packets;
+
+		f.deficit -= fr.len;
+		total -= fr.len;
+		q.take (f.q, fr.len);
+		since = fr.since;
+		f.frames.pop_front();
+		return true;
+	}
+}
+
+void flow_queue::clear()
+{
+	flows.clear();
+	new_flows.clear();
+	old_flows.clear();
+	total = 0;
+	drops = 0;
+}
+
+void flow_queue::release (bool idle)
+{
+	if (!idle || total) return;
+	vector<flow>().swap (flows);
+	deque<int>().swap (new_flows);
+	deque<int>().swap (old_flows);
+}
+
+size_t flow_queue::resident()
+{
+	size_t r = 0;
+	for (size_t i = 0;i < flows.size();++i) r += flows[i].q.resident();
+	return r;
+}
+
+int flow_queue::active()
+{
+	return new_flows.size() + old_flows.size();
+}
+
@@ -0,0 +1,104 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_FQ_H
+#define _CVPN_FQ_H
+
+#include "sq.h"
+
+#include <stdint.h>
+
+#include <vector>
+#include <deque>
+using namespace std;
+
+/*
+ * Flow queueing (FQ-CoDel)
+ *
+ * Alternative to RED for the data frames of a connection. Frames are
+ * hashed by instance and source/destination address into a fixed set of
+ * flow queues, served by deficit round robin, with flows that just woke up
+ * going first. Every flow runs its own CoDel, which drops frames that waited
+ * too long (over the target for a whole interval), so one bulk transfer
+ * can't build a queue that interactive flows would have to wait behind.
+ * When the connection limit is hit anyway, the longest flow loses.
+ */
+
+class flow_queue
+{
+public:
+	class frame
+	{
+	public:
+		size_t len;
+		uint64_t enqueued, since;
+	};
+
+	class flow
+	{
+	public:
+		sgqueue q;
+		deque<frame> frames;
+		int deficit;
+		int list; //0 idle, 1 new, 2 old
+
+		//CoDel
+		uint64_t first_above, drop_next;
+		uint32_t count, last_count;
+		bool dropping;
+
+		//stats
+		uint64_t packets, drops, sojourn, sojourn_max; //sojourn is *8
+
+		inline flow() : deficit (0), list (0),
+			first_above (0), drop_next (0),
+			count (0), last_count (0), dropping (false),
+			packets (0), drops (0), sojourn (0), sojourn_max (0) {}
+	};
+
+	vector<flow> flows;
+	deque<int> new_flows, old_flows;
+	size_t total;
+	uint64_t drops;
+
+	explicit inline flow_queue() : total (0), drops (0) {}
+
+	inline size_t len() {
+		return total;
+	}
+
+	//takes the whole content of q as one frame, since is kept for it
+	void enqueue (uint32_t hash, sgqueue&q, size_t limit, uint64_t since);
+
+	//moves one frame to the end of q, false if there's nothing
+	bool dequeue (sgqueue&q, uint64_t&since);
+
+	void clear();
+	void release (bool idle);
+	size_t resident();
+
+	int active();
+
+private:
+	bool head (flow&, uint64_t now, bool&ok_to_drop);
+	bool codel_dequeue (flow&, uint64_t now);
+	void drop_head (flow&);
+};
+
+void fq_init();
+bool fq_enabled();
+
+uint32_t fq_hash (uint32_t inst, const uint8_t*dst, size_t ds,
+                  const uint8_t*src, size_t ss);
+
+#endif
+
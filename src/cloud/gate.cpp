@@ -19,6 +19,11 @@
 #include "route.h"
 #include "network.h"
 #include "timestamp.h"
+#include "wire.h"
+
+#ifndef __WIN32__
+#include <sys/uio.h>
+#endif
 
 /*
  * index stuff
@@ -92,6 +97,7 @@ gate::gate (int ID)
 	id = ID;
 	fd = -1;
 	cached_header_type = cached_header_size = 0;
+	buffers_busy = 0;
 }
 
 gate::gate()
@@ -115,21 +121,22 @@ gate::gate()
 #define pt_route 2
 #define pt_packet 3
 
-#define p_head_size 3
+#define p_head_size gate_header::size
 
 bool gate::parse_packet_header()
 {
-	if (recv_q.len() < p_head_size) return false;
-	recv_q.pop<uint8_t> (cached_header_type);
-	recv_q.pop<uint16_t> (cached_header_size);
-	cached_header_size = ntohs (cached_header_size);
+	const uint8_t*h = recv_q.window (p_head_size);
+	if (!h) return false;
+	cached_header_type = gate_header::type::get (h);
+	cached_header_size = gate_header::length::get (h);
+	recv_q.read (p_head_size);
 	return true;
 }
 
-void gate::add_packet_header (pusher&b, uint8_t type, uint16_t size)
+void gate::add_packet_header (uint8_t*b, uint8_t type, uint16_t size)
 {
-	b.push<uint8_t> (type);
-	b.push<uint16_t> (htons (size) );
+	gate_header::type::put (b, type);
+	gate_header::length::put (b, size);
 }
 
 void gate::handle_keepalive()
@@ -142,25 +149,24 @@ void gate::handle_route (uint16_t size, const uint8_t*data)
 
 	uint16_t asize;
 	uint32_t inst;
+	const uint8_t*h, *a;
+	wire_reader r (data, size);
 
 	local.clear();
 	instances.clear();
 	route_set_dirty();
 
-	while (size) {
-		if (size < 6) goto error;
-
-		asize = ntohs (* (uint16_t*) data);
-		inst = ntohl (* (uint32_t*) (data + 2) );
-		if (asize + 6 > size) goto error;
+	while (r.left) {
+		if (! (h = r.take<gate_route_entry>() ) ) goto error;
+		asize = gate_route_entry::addr_size::get (h);
+		inst = gate_route_entry::inst::get (h);
+		if (! (a = r.take (asize) ) ) goto error;
 
 		local.push_back (address() );
-		local.back().set (inst, data + 6, asize);
+		local.back().set (inst, a, asize);
 		instances.insert (address (inst, 0, 0) );
 		Log_info ("gate %d handling address %s",
 		          id, local.back().format().c_str() );
-		data += 6 + asize;
-		size -= 6 + asize;
 	}
 	return;
 
@@ -171,27 +177,29 @@ error:
 
 void gate::handle_packet (uint16_t size, const uint8_t*data)
 {
-	uint32_t inst;
 	uint16_t dof, ds, sof, ss, s;
+	uint8_t prio = prio_best_effort;
+	const uint8_t*h, *payload;
+	wire_reader r (data, size);
 
-	if (size < 14) goto error;
-
-	inst = ntohl (* (uint32_t*) data);
+	if (! (h = r.take<gate_packet>() ) ) goto error;
 
-#define h ((uint16_t*)data)
-	dof = ntohs (h[2]);
-	ds = ntohs (h[3]);
-	sof = ntohs (h[4]);
-	ss = ntohs (h[5]);
-	s = ntohs (h[6]);
-#undef h
+	dof = gate_packet::dof::get (h);
+	ds = gate_packet::ds::get (h);
+	sof = gate_packet::sof::get (h);
+	ss = gate_packet::ss::get (h);
+	s = gate_packet::length::get (h);
 
 	//beware of overflows
-	if ( (int) s + 14 > (int) size) goto error;
-	if ( (int) sof + (int) ss + 14 > (int) size) goto error;
-	if ( (int) dof + (int) ds + 14 > (int) size) goto error;
+	if (! (payload = r.take (s) ) ) goto error;
+	if ( (int) sof + (int) ss + gate_packet::size > (int) size) goto error;
+	if ( (int) dof + (int) ds + gate_packet::size > (int) size) goto error;
+
+	//optional priority byte after the payload
+	if (r.left && (r.p[0] < prio_classes) ) prio = r.p[0];
 
-	route_new_packet (inst, dof, ds, sof, ss, s, data + 14, - (id + 1) );
+	route_new_packet (gate_packet::inst::get (h), dof, ds, sof, ss, s,
+	                  payload, - (id + 1), prio);
 
 	return;
 error:
@@ -204,33 +212,65 @@ void gate::send_keepalive()
 	if (!can_send() ) poll_write();
 	if (!can_send() ) return;
 
-	pusher p (send_q.get_buffer (p_head_size) );
-	if (!p.d) return;
+	uint8_t*b = send_q.get_buffer (p_head_size);
+	if (!b) return;
+	add_packet_header (b, pt_keepalive, 0);
 	send_q.append (p_head_size);
-
-	add_packet_header (p, pt_keepalive, 0);
+	send_stamps.push (p_head_size, 0, false);
 }
 
+/*
+ * If there's nothing waiting in the queue, packet is written directly from
+ * the buffer it came in, and only the part that socket didn't take gets
+ * queued. Payload is copied only if it must wait.
+ */
+
 void gate::send_packet (uint32_t inst,
                         uint16_t doff, uint16_t ds,
                         uint16_t soff, uint16_t ss,
-                        uint16_t size, const uint8_t*data)
+                        sq_payload&data, uint64_t since)
 {
 	if (!can_send() ) poll_write();
 	if (!can_send() ) return;
 
-	pusher p (send_q.get_buffer (p_head_size + size + 14) );
-	if (!p.d) return;
-	send_q.append (p_head_size + size + 14);
-
-	add_packet_header (p, pt_packet, size + 14);
-	p.push<uint32_t> (htonl (inst) );
-	p.push<uint16_t> (htons (doff) );
-	p.push<uint16_t> (htons (ds) );
-	p.push<uint16_t> (htons (soff) );
-	p.push<uint16_t> (htons (ss) );
-	p.push<uint16_t> (htons (size) );
-	p.push (data, size);
+	uint8_t head[p_head_size+gate_packet::size];
+	size_t done = 0, hs = sizeof (head);
+	uint8_t*p = head + p_head_size;
+
+	add_packet_header (head, pt_packet, data.size + gate_packet::size);
+	gate_packet::inst::put (p, inst);
+	gate_packet::dof::put (p, doff);
+	gate_packet::ds::put (p, ds);
+	gate_packet::sof::put (p, soff);
+	gate_packet::ss::put (p, ss);
+	gate_packet::length::put (p, data.size);
+
+#ifndef __WIN32__
+	if (!send_q.len() && (fd >= 0) ) {
+		struct iovec iov[2];
+		iov[0].iov_base = head;
+		iov[0].iov_len = hs;
+		iov[1].iov_base = (void*) data.data;
+		iov[1].iov_len = data.size;
+		int r = writev (fd, iov, 2);
+		if (r > 0) done = r;
+	}
+#endif
+
+	if (done == hs + data.size) {
+		if (since) {
+			uint64_t t = timestamp_precise();
+			t = t > since ? t - since : 0;
+			sojourn.add (t);
+			sojourn_node().add (t);
+		}
+		return;
+	}
+
+	size_t l = send_q.len();
+	if (done < hs) send_q.push (head + done, hs - done);
+	send_q.push_payload (data, done > hs ? done - hs : 0);
+	send_stamps.push (send_q.len() - l, since, true);
 }
 
 void gate::try_parse_input()
@@ -251,8 +291,10 @@ try_more:
 		if (recv_q.len() < cached_header_size) break;
 
 		if (cached_header_type == pt_route)
-			handle_route (cached_header_size, recv_q.begin() );
-		else	handle_packet (cached_header_size, recv_q.begin() );
+			handle_route (cached_header_size,
+			              recv_q.window (cached_header_size) );
+		else	handle_packet (cached_header_size,
+			               recv_q.window (cached_header_size) );
 
 		recv_q.read (cached_header_size);
 		cached_header_type = 0;
@@ -282,10 +324,21 @@ void gate::periodic_update()
 		Log_error ("gate %d timeout", id);
 		reset();
 	}
+
+	release_buffers();
+}
+
+void gate::release_buffers()
+{
+	if (recv_q.len() || send_q.len() ) buffers_busy = timestamp();
+	bool idle = sq_buffers_idle (buffers_busy);
+	recv_q.release (idle);
+	send_q.release (idle);
 }
 
 void gate::start()
 {
+	zc.setup (fd);
 	poll_set_add_read (fd);
 	send_keepalive();
 }
@@ -293,11 +346,13 @@ void gate::start()
 void gate::reset()
 {
 	send_q.clear();
+	send_stamps.clear();
 	recv_q.clear();
 	local.clear();
 	route_set_dirty();
 	if (fd < 0) return;
 	poll_set_remove_read (fd);
+	zc.reset (fd);
 	close (fd);
 	unset_fd();
 }
@@ -306,6 +361,10 @@ void gate::poll_read()
 {
 	int r;
 	uint8_t*buf;
+
+	//zerocopy completions come as socket errors
+	if (zc.pending() ) zc.reap (fd);
+
 	while (1) {
 		if (recv_q.len() > gate_max_recv_q_len) {
 			Log_error ("gate %d receive queue overflow", id);
@@ -334,16 +393,16 @@ void gate::poll_read()
 			return;
 		}
 		recv_q.append (r);
+		buffers_busy = timestamp();
 		try_parse_input();
 	}
 }
 
 void gate::poll_write()
 {
-	int r, n;
-	const uint8_t* buf;
+	int r;
 	while (send_q.len() ) {
-		r = send (fd, (char*) send_q.begin(), send_q.len(), 0);
+		r = zc.send (fd, send_q, send_q.len() );
 
 		if (r <= 0) {
 			if (errno != EWOULDBLOCK) {
@@ -353,6 +412,8 @@ void gate::poll_write()
 			return;
 		} else {
 			send_q.read (r);
+			send_stamps.read (r, sojourn, sojourn);
+			buffers_busy = timestamp();
 		}
 	}
 
@@ -16,6 +16,8 @@
 #include <stdint.h>
 #include "sq.h"
 #include "address.h"
+#include "zerocopy.h"
+#include "sojourn.h"
 
 #include <deque>
 #include <list>
@@ -55,7 +57,7 @@ public:
 	uint16_t cached_header_size;
 
 	bool parse_packet_header();
-	void add_packet_header (pusher&, uint8_t type, uint16_t size);
+	void add_packet_header (uint8_t*, uint8_t type, uint16_t size);
 
 	void handle_keepalive();
 	void handle_route (uint16_t size, const uint8_t*data);
@@ -65,7 +67,7 @@ public:
 	void send_packet (uint32_t inst,
 	                  uint16_t doff, uint16_t ds,
 	                  uint16_t soff, uint16_t ss,
-	                  uint16_t size, const uint8_t*data);
+	                  sq_payload&, uint64_t since);
 
 	void try_parse_input();
 
@@ -79,7 +81,16 @@ public:
 #define gate_max_send_q_len 0x100000
 #define gate_max_recv_q_len 0x100000
 
-	squeue recv_q, send_q;
+	squeue recv_q;
+	sgqueue send_q;
+	sock_zerocopy zc;
+
+	//how long packets waited here, see sojourn.h
+	sojourn_stamps send_stamps;
+	delay_hist sojourn;
+
+	uint64_t buffers_busy;
+	void release_buffers();
 
 	inline bool can_send() {
 		return send_q.len() < gate_max_send_q_len;
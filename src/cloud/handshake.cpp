@@ -0,0 +1,356 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "handshake.h"
+
+#include "conf.h"
+#define LOGNAME "cloud/handshake"
+#include "log.h"
+#include "timestamp.h"
+
+#include <gnutls/openpgp.h>
+
+int handshake_verify (gnutls_session_t s, unsigned int*status)
+{
+	int r = gnutls_certificate_verify_peers2 (s, status);
+	if (r < 0 || *status) return r;
+	if (gnutls_certificate_type_get (s) != GNUTLS_CRT_OPENPGP) return 0;
+
+	unsigned int n;
+	const gnutls_datum_t*d = gnutls_certificate_get_peers (s, &n);
+	if (!d) return GNUTLS_E_NO_CERTIFICATE_FOUND;
+
+	gnutls_certificate_credentials_t cred;
+	gnutls_openpgp_keyring_t keyring;
+	gnutls_openpgp_crt_t key;
+	r = gnutls_credentials_get (s, GNUTLS_CRD_CERTIFICATE, (void**) &cred);
+	if (r < 0) return r;
+	gnutls_certificate_get_openpgp_keyring (cred, &keyring);
+
+	gnutls_openpgp_crt_init (&key);
+	r = gnutls_openpgp_crt_import (key, d, GNUTLS_OPENPGP_FMT_RAW);
+	if (r >= 0) r = gnutls_openpgp_crt_verify_ring (key, keyring, 0, status);
+	gnutls_openpgp_crt_deinit (key);
+	return r;
+}
+
+#ifndef __WIN32__
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/poll.h>
+
+#include <deque>
+#include <vector>
+using namespace std;
+
+/*
+ * Workers wait for the socket themselves, in short slices so that they
+ * notice cancellation and shutdown quickly.
+ */
+
+#define handshake_slice_usec 100000
+#define handshake_max_threads 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t unpaused = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t steps_done = PTHREAD_COND_INITIALIZER;
+static bool paused = false;
+static int stepping = 0; //workers inside GnuTLS calls
+static deque<handshake_job*> waiting, finished;
+static vector<pthread_t> workers;
+static bool stopping = false;
+static int in_flight = 0;
+static int notify_pipe[2] = { -1, -1};
+
+static bool is_cancelled (handshake_job*j)
+{
+	pthread_mutex_lock (&lock);
+	bool r = j->cancelled || stopping;
+	pthread_mutex_unlock (&lock);
+	return r;
+}
+
+static void wait_socket (int fd, bool write)
+{
+	struct pollfd f;
+	f.fd = fd;
+	f.events = write ? POLLOUT : POLLIN;
+	f.revents = 0;
+	poll (&f, 1, handshake_slice_usec / 1000);
+}
+
+static void step_begin()
+{
+	pthread_mutex_lock (&lock);
+	while (paused) pthread_cond_wait (&unpaused, &lock);
+	++stepping;
+	pthread_mutex_unlock (&lock);
+}
+
+static void step_end()
+{
+	pthread_mutex_lock (&lock);
+	if (!--stepping && paused) pthread_cond_signal (&steps_done);
+	pthread_mutex_unlock (&lock);
+}
+
+static void run_job (handshake_job*j)
+{
+	int r;
+
+	for (;;) {
+		step_begin();
+		r = gnutls_handshake (j->session);
+		step_end();
+		if (!r || gnutls_error_is_fatal (r) ) break;
+		if (is_cancelled (j) ) {
+			r = GNUTLS_E_INTERRUPTED;
+			break;
+		}
+		if (timestamp_precise() > j->deadline) {
+			r = GNUTLS_E_TIMEDOUT;
+			break;
+		}
+		//non-fatal warnings are just retried, like on the main loop
+		if ( (r == GNUTLS_E_AGAIN) || (r == GNUTLS_E_INTERRUPTED) )
+			wait_socket (j->fd,
+			             gnutls_record_get_direction (j->session) );
+	}
+
+	j->result = r;
+	if (!r) {
+		step_begin();
+		j->verify_result = handshake_verify (j->session,
+		                                     &j->verify_status);
+		step_end();
+	}
+}
+
+static void* worker (void*)
+{
+	handshake_job*j;
+	char c = 0;
+
+	pthread_mutex_lock (&lock);
+	for (;;) {
+		while (!stopping && waiting.empty() )
+			pthread_cond_wait (&wakeup, &lock);
+		if (stopping) break;
+
+		j = waiting.front();
+		waiting.pop_front();
+		pthread_mutex_unlock (&lock);
+
+		run_job (j);
+
+		pthread_mutex_lock (&lock);
+		finished.push_back (j);
+		if (write (notify_pipe[1], &c, 1) < 0) {
+			//pipe full means the main loop will come anyway
+		}
+	}
+	pthread_mutex_unlock (&lock);
+	return 0;
+}
+
+int handshake_init()
+{
+	int threads = 2;
+	config_get_int ("handshake_threads", threads);
+	if (threads <= 0) {
+		Log_info ("handshakes run on the main loop");
+		return 0;
+	}
+	if (threads > handshake_max_threads) threads = handshake_max_threads;
+
+	if (pipe (notify_pipe) ) {
+		Log_error ("cannot create handshake notification pipe");
+		return 1;
+	}
+	fcntl (notify_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl (notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+	stopping = false;
+	for (int i = 0;i < threads;++i) {
+		pthread_t t;
+		if (pthread_create (&t, 0, worker, 0) ) {
+			Log_error ("cannot start handshake worker");
+			break;
+		}
+		workers.push_back (t);
+	}
+
+	if (workers.empty() ) {
+		handshake_shutdown();
+		return 1;
+	}
+
+	Log_info ("using %u handshake workers", (unsigned int) workers.size() );
+	return 0;
+}
+
+void handshake_shutdown()
+{
+	pthread_mutex_lock (&lock);
+	stopping = true;
+	pthread_cond_broadcast (&wakeup);
+	pthread_mutex_unlock (&lock);
+
+	for (size_t i = 0;i < workers.size();++i)
+		pthread_join (workers[i], 0);
+	workers.clear();
+
+	//nobody is going to need those sessions anymore
+	handshake_job*j;
+	while (!waiting.empty() ) {
+		finished.push_back (waiting.front() );
+		waiting.pop_front();
+	}
+	while ( (j = handshake_finished() ) ) {
+		gnutls_deinit (j->session);
+		close (j->fd);
+		delete j;
+	}
+
+	if (notify_pipe[0] >= 0) {
+		close (notify_pipe[0]);
+		close (notify_pipe[1]);
+		notify_pipe[0] = notify_pipe[1] = -1;
+	}
+}
+
+int handshake_workers()
+{
+	return workers.size();
+}
+
+int handshake_notify_fd()
+{
+	return notify_pipe[0];
+}
+
+handshake_job* handshake_submit (int id, int fd, gnutls_session_t s,
+                                 bool server, uint64_t deadline)
+{
+	handshake_job*j = new handshake_job;
+	j->id = id;
+	j->fd = fd;
+	j->session = s;
+	j->server = server;
+	j->deadline = deadline;
+	j->result = GNUTLS_E_INTERRUPTED;
+	j->verify_result = 0;
+	j->verify_status = 0;
+	j->cancelled = false;
+
+	pthread_mutex_lock (&lock);
+	waiting.push_back (j);
+	++in_flight;
+	pthread_cond_signal (&wakeup);
+	pthread_mutex_unlock (&lock);
+	return j;
+}
+
+void handshake_cancel (handshake_job*j)
+{
+	pthread_mutex_lock (&lock);
+	j->cancelled = true;
+	pthread_mutex_unlock (&lock);
+}
+
+handshake_job* handshake_finished()
+{
+	char buf[64];
+	handshake_job*j = 0;
+
+	pthread_mutex_lock (&lock);
+	if (finished.empty() ) {
+		if (notify_pipe[0] >= 0)
+			while (read (notify_pipe[0], buf, sizeof (buf) ) > 0);
+	} else {
+		j = finished.front();
+		finished.pop_front();
+		--in_flight;
+	}
+	pthread_mutex_unlock (&lock);
+	return j;
+}
+
+int handshake_in_flight()
+{
+	return in_flight;
+}
+
+void handshake_pause()
+{
+	pthread_mutex_lock (&lock);
+	paused = true;
+	while (stepping) pthread_cond_wait (&steps_done, &lock);
+	pthread_mutex_unlock (&lock);
+}
+
+void handshake_resume()
+{
+	pthread_mutex_lock (&lock);
+	paused = false;
+	pthread_cond_broadcast (&unpaused);
+	pthread_mutex_unlock (&lock);
+}
+
+#else //__WIN32__
+
+/*
+ * no notification pipes to poll for on win32, handshakes stay inline.
+ */
+
+int handshake_init()
+{
+	return 0;
+}
+
+void handshake_shutdown() {}
+
+int handshake_workers()
+{
+	return 0;
+}
+
+int handshake_notify_fd()
+{
+	return -1;
+}
+
+handshake_job* handshake_submit (int, int, gnutls_session_t, bool, uint64_t)
+{
+	return 0;
+}
+
+void handshake_cancel (handshake_job*) {}
+
+handshake_job* handshake_finished()
+{
+	return 0;
+}
+
+int handshake_in_flight()
+{
+	return 0;
+}
+
+void handshake_pause() {}
+void handshake_resume() {}
+
+#endif
+
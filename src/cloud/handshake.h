@@ -0,0 +1,81 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_HANDSHAKE_H
+#define _CVPN_HANDSHAKE_H
+
+#include <stdint.h>
+
+#include <gnutls/gnutls.h>
+
+/*
+ * Handshake workers
+ *
+ * TLS handshakes of stream connections (including the peer certificate
+ * and keyring verification, which is the expensive part) can run on a small pool of
+ * threads, so that a burst of new connections doesn't stall forwarding
+ * for the established ones. The main loop hands the session and socket
+ * over, and gets them back through a notification pipe when the
+ * handshake finishes. Workers never touch the connection objects.
+ */
+
+class handshake_job
+{
+public:
+	int id; //connection that started it
+	int fd;
+	gnutls_session_t session;
+	bool server;
+	uint64_t deadline;
+
+	//results
+	int result; //of gnutls_handshake
+	int verify_result;
+	unsigned int verify_status;
+	bool cancelled; //connection is gone, only clean up
+};
+
+int handshake_init(); //nonzero on failure
+void handshake_shutdown();
+
+int handshake_workers(); //0 if handshakes run on the main loop
+int handshake_notify_fd(); //readable when some job is finished
+
+handshake_job* handshake_submit (int id, int fd, gnutls_session_t,
+                                 bool server, uint64_t deadline);
+
+//worker finishes soon; session and fd then belong to the job
+void handshake_cancel (handshake_job*);
+
+//returns finished jobs one by one, 0 if there are no more
+handshake_job* handshake_finished();
+
+int handshake_in_flight();
+
+/*
+ * Shared handshake state (like the credentials) may only change while the
+ * workers are paused. Pausing waits for the running handshake steps to
+ * finish, which is at most one step per worker; no new ones start until
+ * resumed.
+ */
+void handshake_pause();
+void handshake_resume();
+
+/*
+ * Peer certificate verification of a finished handshake, including the
+ * OpenPGP keyring check. Returns like gnutls_certificate_verify_peers2;
+ * runs on the workers, or on the main loop if there are none.
+ */
+int handshake_verify (gnutls_session_t, unsigned int*status);
+
+#endif
+
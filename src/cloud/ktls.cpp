@@ -0,0 +1,257 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ktls.h"
+
+#include "conf.h"
+#include "network.h"
+#define LOGNAME "cloud/ktls"
+#include "log.h"
+
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/tls.h>)
+#define CVPN_KTLS
+#endif
+#endif
+
+#ifdef CVPN_KTLS
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+
+//record types
+#define rt_alert 21
+#define rt_handshake 22
+#define rt_data 23
+
+//post-handshake messages
+#define hs_new_session_ticket 4
+#define hs_key_update 24
+
+static bool enabled = false;
+
+void ktls_init()
+{
+	enabled = config_is_true ("ktls");
+	if (enabled) Log_info ("kernel TLS offload enabled");
+}
+
+/*
+ * Key material layout follows the kernel's crypto_info structures. TLS1.2
+ * GCM uses the record sequence number as explicit nonce, TLS1.3 has the
+ * whole nonce in the IV (4 bytes of salt, 8 bytes of the rest).
+ */
+
+static int push_keys (int fd, gnutls_session_t s, bool read)
+{
+	gnutls_datum_t mac, iv, key;
+	unsigned char seq[8];
+	bool v12 = gnutls_protocol_get_version (s) == GNUTLS_TLS1_2;
+	uint16_t version = v12 ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+	int opt = read ? TLS_RX : TLS_TX;
+
+	if (gnutls_record_get_state (s, read ? 1 : 0, &mac, &iv, &key, seq) )
+		return -1;
+
+	switch (gnutls_cipher_get (s) ) {
+	case GNUTLS_CIPHER_AES_128_GCM: {
+		struct tls12_crypto_info_aes_gcm_128 ci;
+		memset (&ci, 0, sizeof (ci) );
+		ci.info.version = version;
+		ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		if (v12) memcpy (ci.iv, seq, sizeof (ci.iv) );
+		else memcpy (ci.iv, iv.data + sizeof (ci.salt), sizeof (ci.iv) );
+		memcpy (ci.salt, iv.data, sizeof (ci.salt) );
+		memcpy (ci.key, key.data, sizeof (ci.key) );
+		memcpy (ci.rec_seq, seq, sizeof (ci.rec_seq) );
+		return setsockopt (fd, SOL_TLS, opt, &ci, sizeof (ci) );
+	}
+	case GNUTLS_CIPHER_AES_256_GCM: {
+		struct tls12_crypto_info_aes_gcm_256 ci;
+		memset (&ci, 0, sizeof (ci) );
+		ci.info.version = version;
+		ci.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		if (v12) memcpy (ci.iv, seq, sizeof (ci.iv) );
+		else memcpy (ci.iv, iv.data + sizeof (ci.salt), sizeof (ci.iv) );
+		memcpy (ci.salt, iv.data, sizeof (ci.salt) );
+		memcpy (ci.key, key.data, sizeof (ci.key) );
+		memcpy (ci.rec_seq, seq, sizeof (ci.rec_seq) );
+		return setsockopt (fd, SOL_TLS, opt, &ci, sizeof (ci) );
+	}
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case GNUTLS_CIPHER_CHACHA20_POLY1305: {
+		struct tls12_crypto_info_chacha20_poly1305 ci;
+		memset (&ci, 0, sizeof (ci) );
+		ci.info.version = version;
+		ci.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy (ci.iv, iv.data, sizeof (ci.iv) );
+		memcpy (ci.key, key.data, sizeof (ci.key) );
+		memcpy (ci.rec_seq, seq, sizeof (ci.rec_seq) );
+		return setsockopt (fd, SOL_TLS, opt, &ci, sizeof (ci) );
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Receiving goes first: should only that one work, GnuTLS can still send
+ * alerts. The other way, it might answer a key update with stale keys.
+ */
+
+void ktls_enable (int fd, gnutls_session_t s, bool&tx, bool&rx)
+{
+	tx = rx = false;
+	if (!enabled) return;
+
+	gnutls_protocol_t v = gnutls_protocol_get_version (s);
+	if ( (v != GNUTLS_TLS1_2) && (v != GNUTLS_TLS1_3) ) return;
+
+	//decrypted data that GnuTLS already holds would get lost
+	if (gnutls_record_check_pending (s) ) return;
+
+	if (setsockopt (fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof ("tls") ) ) {
+		Log_info ("kernel TLS not available on socket %d: %s",
+		          fd, strerror (errno) );
+		return;
+	}
+
+	rx = !push_keys (fd, s, true);
+	if (rx) tx = !push_keys (fd, s, false);
+
+	if (! (tx || rx) )
+		Log_info ("kernel TLS can't take cipher %s on socket %d",
+		          gnutls_cipher_get_name (gnutls_cipher_get (s) ), fd);
+}
+
+/*
+ * Non-data records are reported in control messages. GnuTLS can't take
+ * handshake messages anymore, so session tickets that come after the one
+ * connection::ktls_late waited for are skipped; anything else that would
+ * need GnuTLS (key updates, alerts) ends the connection.
+ */
+
+int ktls_recv (int fd, uint8_t*buf, size_t len)
+{
+	char cbuf[CMSG_SPACE (sizeof (unsigned char) )];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr*cmsg;
+	int r;
+
+	for (;;) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		memset (&msg, 0, sizeof (msg) );
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof (cbuf);
+
+		r = recvmsg (fd, &msg, 0);
+		if (r <= 0) return r;
+
+		cmsg = CMSG_FIRSTHDR (&msg);
+		if (!cmsg || (cmsg->cmsg_level != SOL_TLS)
+		        || (cmsg->cmsg_type != TLS_GET_RECORD_TYPE) ) return r;
+
+		switch (* (unsigned char*) CMSG_DATA (cmsg) ) {
+		case rt_data:
+			return r;
+		case rt_alert:
+			return 0;
+		case rt_handshake:
+			if (buf[0] == hs_new_session_ticket) continue;
+			Log_info ("post-handshake message %d on socket %d",
+			          buf[0], fd);
+			//fall through
+		default:
+			errno = EPROTO;
+			return -1;
+		}
+	}
+}
+
+//records are made by the kernel, this is just a plain send
+int ktls_send (int fd, sgqueue&q, size_t max)
+{
+	return sock_send_queue (fd, q, max);
+}
+
+void ktls_send_close (int fd)
+{
+	unsigned char alert[2] = {1, 0}; //warning, close notify
+	char cbuf[CMSG_SPACE (sizeof (unsigned char) )];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr*cmsg;
+
+	iov.iov_base = alert;
+	iov.iov_len = sizeof (alert);
+	memset (&msg, 0, sizeof (msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof (cbuf);
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char) );
+	* (unsigned char*) CMSG_DATA (cmsg) = rt_alert;
+
+	sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+#else //no kernel TLS here
+
+void ktls_init()
+{
+	if (config_is_true ("ktls") )
+		Log_warn ("kernel TLS offload is not supported on this platform");
+}
+
+void ktls_enable (int fd, gnutls_session_t s, bool&tx, bool&rx)
+{
+	tx = rx = false;
+}
+
+int ktls_recv (int fd, uint8_t*buf, size_t len)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+int ktls_send (int fd, sgqueue&q, size_t max)
+{
+	errno = EINVAL;
+	return -1;
+}
+
+void ktls_send_close (int fd) {}
+
+#endif
+
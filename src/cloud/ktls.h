@@ -0,0 +1,49 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_KTLS_H
+#define _CVPN_KTLS_H
+
+#include "sq.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <gnutls/gnutls.h>
+
+/*
+ * Kernel TLS offload (Linux only)
+ *
+ * After the GnuTLS handshake, record keys and sequence numbers are pushed
+ * into the kernel TLS socket layer, and the data then goes through plain
+ * socket calls. Only AEAD ciphers that the kernel knows are offloaded;
+ * anything else (or a kernel without TLS support) stays with GnuTLS.
+ */
+
+void ktls_init();
+
+/*
+ * Tries to offload both directions, reports what got offloaded. GnuTLS
+ * must be at a record boundary both ways, with nothing left to send.
+ */
+void ktls_enable (int fd, gnutls_session_t, bool&tx, bool&rx);
+
+//like recv(), 0 means that peer closed the connection
+int ktls_recv (int fd, uint8_t*buf, size_t len);
+
+//sends as much of the queue as the socket takes, up to max bytes
+int ktls_send (int fd, sgqueue&, size_t max);
+
+void ktls_send_close (int fd);
+
+#endif
+
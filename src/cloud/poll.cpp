@@ -14,11 +14,11 @@
 #include "gate.h"
 #include "poll.h"
 #include "log.h"
+#include "timestamp.h"
+#include "handshake.h"
 
-void poll_handle_event (int fd, int what)
+static void handle_event (int fd, int what)
 {
-	if (!what) return;
-
 	map<int, int>::iterator id;
 
 	/*
@@ -54,6 +54,11 @@ void poll_handle_event (int fd, int what)
 		return;
 	}
 
+	if (fd == handshake_notify_fd() ) {
+		comm_handshake_poll();
+		return;
+	}
+
 	set<int>::iterator lis;
 
 	lis = comm_listeners().find (fd);
@@ -72,4 +77,16 @@ void poll_handle_event (int fd, int what)
 	Log_info ("polled a nonexistent fd %d!", fd);
 }
 
+/*
+ * handlers run one after another, so the time spent in one is a delay for
+ * everyone else.
+ */
+
+void poll_handle_event (int fd, int what)
+{
+	if (!what) return;
 
+	uint64_t start = timestamp_precise();
+	handle_event (fd, what);
+	connection::stat_stall (timestamp_precise() - start);
+}
@@ -370,24 +370,19 @@ void route_update()
 	report_route();
 }
 
-static void send_packet_to_id (int to,
-                               uint32_t id, uint16_t ttl, uint32_t inst,
-                               uint16_t dof, uint16_t ds,
-                               uint16_t sof, uint16_t ss,
-                               uint16_t s, const uint8_t*buf)
+static void send_packet_to_id (int to, packet_frame&f)
 {
 	if (to < 0) {
 		map<int, gate>::iterator g =
 		    gate_gates().find (- (to + 1) );
 		if (g == gate_gates().end() ) return;
-		g->second.send_packet (inst, dof, ds, sof, ss, s, buf);
-	} else if (ttl) {
+		g->second.send_packet (f.inst, f.dof, f.ds, f.sof, f.ss,
+		                       f.payload, f.since);
+	} else {
 		map<int, connection>::iterator c =
 		    comm_connections().find (to);
 		if (c == comm_connections().end() ) return;
-		c->second.write_packet (id, ttl - 1,
-		                        inst, dof, ds, sof, ss,
-		                        s, buf);
+		c->second.write_packet (f);
 	}
 }
 
@@ -403,8 +398,10 @@ template<class iter> static iter random_select (iter s, iter e)
 void route_packet (uint32_t id, uint16_t ttl, uint32_t inst,
                    uint16_t dof, uint16_t ds,
                    uint16_t sof, uint16_t ss,
-                   uint16_t s, const uint8_t*buf, int from)
+                   uint16_t s, const uint8_t*buf, int from, uint8_t prio)
 {
+	uint64_t since = timestamp_precise();
+
 	if ( (s < dof + ds) || (s < sof + ss) ) return; //invalid one
 
 	if (!ttl) return; //don't spread this any further
@@ -464,9 +461,16 @@ void route_packet (uint32_t id, uint16_t ttl, uint32_t inst,
 		set<int>::iterator k, ke; //now send to all destinations
 		k = sendlist.begin();
 		ke = sendlist.end();
-		for (;k != ke;++k) if ( (*k < 0) || (ttl > 0) )
-				send_packet_to_id (*k, id, ttl - 1, inst,
-				                   dof, ds, sof, ss, s, buf);
+
+		packet_frame f (id, ttl - 2, inst, dof, ds, sof, ss, buf, s);
+		f.since = since;
+		f.prio = prio;
+		f.fanout = 0;
+		if (ttl > 1) for (;k != ke;++k) if (*k >= 0) ++f.fanout;
+
+		for (k = sendlist.begin();k != ke;++k)
+			if ( (*k < 0) || (ttl > 1) )
+				send_packet_to_id (*k, f);
 
 		if (sendlist.size() ) return;
 		//otherwise packet is lost and needs...
@@ -475,24 +479,32 @@ void route_packet (uint32_t id, uint16_t ttl, uint32_t inst,
 
 	// the broadcast part!
 
+	packet_frame f (id, ttl - 1, inst, dof, ds, sof, ss, buf, s);
+	f.since = since;
+	f.prio = prio;
+
 	map<int, connection>::iterator
 	i = comm_connections().begin(),
 	    e = comm_connections().end();
 
 	if (shared_uplink) {
-		random_select (i, e)->second
-		.write_packet (id, ttl - 1, inst,
-		               dof, ds, sof, ss, s, buf);
+		random_select (i, e)->second.write_packet (f);
 		return;
 
 	}
 
-	for (;i != e;++i) {
+	f.fanout = 0;
+	for (;i != e;++i)
+		if ( (i->first != from) && (i->second.state == cs_active)
+		        && !i->second.bundle_secondary() )
+			++f.fanout;
+
+	for (i = comm_connections().begin();i != e;++i) {
 		if (i->first == from) continue; //dont send back
 		if (i->second.state != cs_active) continue; //ready only
+		if (i->second.bundle_secondary() ) continue; //primary decides
 
-		i->second.write_packet (id, ttl - 1, inst,
-		                        dof, ds, sof, ss, s, buf);
+		i->second.write_packet (f);
 	}
 }
 
@@ -501,6 +513,18 @@ map<address, route_info>& route_get ()
 	return route;
 }
 
+static uint8_t* put_route_entry (uint8_t*p, const address&a,
+                                 const route_info&r)
+{
+	comm_route_entry::ping::put (p, r.ping);
+	comm_route_entry::dist::put (p, r.dist);
+	comm_route_entry::inst::put (p, a.inst);
+	comm_route_entry::addr_size::put (p, a.addr.size() );
+	p += comm_route_entry::size;
+	sq_memcpy (p, a.addr.begin().base(), a.addr.size() );
+	return p + a.addr.size();
+}
+
 void route_report_to_connection (connection&c)
 {
 	/*
@@ -510,25 +534,22 @@ void route_report_to_connection (connection&c)
 	size_t size = 0;
 	map<address, route_info>::iterator r;
 	for (r = reported_route.begin();r != reported_route.end();++r)
-		size += r->first.addr.size() + 14;
-
-	vector<uint8_t> data (size);
-	uint8_t *datap = data.begin().base();
+		size += r->first.addr.size() + comm_route_entry::size;
+
+	//without the full set the peer would never learn our routes
+	sq_ref data (sq_block_alloc (size, false) );
+	if (!data.b) {
+		Log_error ("cannot allocate route report for connection %d",
+		           c.id);
+		c.reset();
+		return;
+	}
+	uint8_t *datap = data->data();
 
 	for (r = reported_route.begin(); (r != reported_route.end() ); ++r) {
-		* (uint32_t*) (datap) =
-		    htonl ( (uint32_t) (r->second.ping) );
-		* (uint32_t*) (datap + 4) =
-		    htonl ( (uint32_t) (r->second.dist) );
-		* (uint32_t*) (datap + 8) =
-		    htonl ( (uint32_t) (r->first.inst) );
-		* (uint16_t*) (datap + 12) =
-		    htons ( (uint16_t) (r->first.addr.size() ) );
-		sq_memcpy (datap + 14, r->first.addr.begin().base(),
-		           r->first.addr.size() );
-		datap += 14 + r->first.addr.size();
+		datap = put_route_entry (datap, r->first, r->second);
 	}
-	c.write_route_set (data.begin().base(), size);
+	c.write_route_set (data->data(), size);
 }
 
 static void report_route()
@@ -583,10 +604,15 @@ static void report_route()
 	size_t size = 0;
 	list<pair<address, route_info> >::iterator rep;
 	for (rep = report.begin();rep != report.end();++rep)
-		size += rep->first.addr.size() + 14;
+		size += rep->first.addr.size() + comm_route_entry::size;
 
-	vector<uint8_t> data (size);
-	uint8_t *datap = data.begin().base();
+	//reported_route stays as it was, so the next update tries again
+	sq_ref data (sq_block_alloc (size, false) );
+	if (!data.b) {
+		Log_error ("cannot allocate route report");
+		return;
+	}
+	uint8_t *datap = data->data();
 
 	for (rep = report.begin();
 	        (rep != report.end() ); ++rep) {
@@ -594,18 +620,8 @@ static void report_route()
 		if (rep->second.ping) reported_route[rep->first] = rep->second;
 		else reported_route.erase (rep->first);
 
-		* (uint32_t*) (datap) =
-		    htonl ( (uint32_t) (rep->second.ping) );
-		* (uint32_t*) (datap + 4) =
-		    htonl ( (uint32_t) (rep->second.dist) );
-		* (uint32_t*) (datap + 8) =
-		    htonl ( (uint32_t) (rep->first.inst) );
-		* (uint16_t*) (datap + 12) =
-		    htons ( (uint16_t) (rep->first.addr.size() ) );
-		sq_memcpy (datap + 14, rep->first.addr.begin().base(),
-		           rep->first.addr.size() );
-		datap += 14 + rep->first.addr.size();
+		datap = put_route_entry (datap, rep->first, rep->second);
 	}
-	comm_broadcast_route_update (data.begin().base(), size);
+	comm_broadcast_route_update (data->data(), size);
 }
 
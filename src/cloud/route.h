@@ -37,7 +37,8 @@ void route_packet (
     uint32_t id, uint16_t ttl, uint32_t inst,
     uint16_t dof, uint16_t ds,
     uint16_t sof, uint16_t ss,
-    uint16_t s, const uint8_t*buf, int from);
+    uint16_t s, const uint8_t*buf, int from,
+    uint8_t prio = prio_best_effort);
 
 
 void route_set_dirty();
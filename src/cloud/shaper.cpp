@@ -0,0 +1,198 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shaper.h"
+
+#include "conf.h"
+#define LOGNAME "cloud/shaper"
+#include "log.h"
+#include "timestamp.h"
+
+#include <stdio.h>
+
+#include <map>
+using namespace std;
+
+static bool enabled = false;
+static int conn_rate = 0, conn_ceil = 0;
+static int burst = 32768;
+
+class class_conf
+{
+public:
+	int rate, ceil, burst;
+};
+
+static map<uint32_t, class_conf> classes;
+
+static shaper_class root;
+
+void shaper_init()
+{
+	int t;
+	list<string> l;
+	list<string>::iterator i;
+
+	if (config_get_int ("uplimit-total", t) && (t > 0) ) {
+		enabled = true;
+		Log_info ("total upload limit is %dB/s", t);
+	} else t = 0;
+
+	if (config_get_int ("uplimit-conn", conn_ceil) && (conn_ceil > 0) ) {
+		enabled = true;
+		Log_info ("per-connection upload limit is %dB/s", conn_ceil);
+	} else conn_ceil = 0;
+
+	if (config_get_int ("uplimit-conn-rate", conn_rate)
+	        && (conn_rate > 0) ) {
+		enabled = true;
+		Log_info ("per-connection guaranteed upload is %dB/s",
+		          conn_rate);
+	} else conn_rate = 0;
+
+	config_get_int ("uplimit-burst", burst);
+	//smaller wouldn't fit a whole datagram
+	if (burst < 16384) burst = 16384;
+
+	config_get_list ("uplimit-class", l);
+	for (i = l.begin();i != l.end();++i) {
+		unsigned int inst;
+		class_conf c;
+		c.ceil = 0;
+		c.burst = burst;
+		if (sscanf (i->c_str(), "%x %d %d %d", &inst,
+		            &c.rate, &c.ceil, &c.burst) < 2) {
+			Log_warn ("could not parse upload class `%s'",
+			          i->c_str() );
+			continue;
+		}
+		if (c.burst < 16384) c.burst = 16384;
+		//the list starts with the last one given, so later ones win
+		if (classes.count (inst) ) {
+			Log_warn ("upload class for instance %08x given more "
+			          "than once, using the last one", inst);
+			continue;
+		}
+		classes[inst] = c;
+		enabled = true;
+		Log_info ("upload class for instance %08x: rate %dB/s, "
+		          "ceil %dB/s", inst, c.rate, c.ceil);
+	}
+
+	if (!enabled) return;
+	root.setup (t, t, burst, 0);
+	Log_info ("burst upload size is %dB", burst);
+}
+
+bool shaper_enabled()
+{
+	return enabled;
+}
+
+shaper_class& shaper_root()
+{
+	return root;
+}
+
+void shaper_conn_setup (shaper_class&c)
+{
+	c.setup (conn_rate, conn_ceil, burst, &root);
+}
+
+bool shaper_has_class (uint32_t inst)
+{
+	return classes.count (inst);
+}
+
+bool shaper_classes()
+{
+	return !classes.empty();
+}
+
+bool shaper_leaf_setup (uint32_t inst, shaper_leaf&l, shaper_class&conn)
+{
+	map<uint32_t, class_conf>::iterator i = classes.find (inst);
+	if (i == classes.end() ) return false;
+	l.cls.setup (i->second.rate, i->second.ceil, i->second.burst, &conn);
+	return true;
+}
+
+/*
+ * classes
+ */
+
+void shaper_class::setup (int r, int c, int b, shaper_class*p)
+{
+	rate = r;
+	ceil = c;
+	burst = b;
+	parent = p;
+	tokens = ctokens = 1000000 * (int64_t) burst;
+	last = timestamp();
+}
+
+void shaper_class::update()
+{
+	uint64_t now = timestamp();
+	if (now <= last) return;
+	int64_t dt = now - last, max = 1000000 * (int64_t) burst;
+	last = now;
+
+	if (rate) {
+		tokens += rate * dt;
+		if (tokens > max) tokens = max;
+	}
+	if (ceil) {
+		ctokens += ceil * dt;
+		if (ctokens > max) ctokens = max;
+	}
+}
+
+int64_t shaper_class::allowance()
+{
+	update();
+
+	int64_t a = (rate && (tokens > 0) ) ? tokens / 1000000 : 0;
+	if (parent) a += parent->allowance();
+	else if (!rate) return shaper_unlimited;
+
+	if (ceil && (a > ctokens / 1000000) )
+		a = ctokens > 0 ? ctokens / 1000000 : 0;
+	return a;
+}
+
+bool shaper_class::green()
+{
+	update();
+	return rate && (tokens > 0);
+}
+
+void shaper_class::charge (size_t n, bool up)
+{
+	int64_t c = 1000000 * (int64_t) n, min = -1000000 * (int64_t) burst;
+
+	sent += n;
+	if (!rate || (tokens < c) )
+		borrowed += rate && (tokens > 0) ? n - tokens / 1000000 : n;
+
+	//debts don't grow over a burst, so a borrower isn't stuck for long
+	if (rate) {
+		tokens -= c;
+		if (tokens < min) tokens = min;
+	}
+	if (ceil) {
+		ctokens -= c;
+		if (ctokens < min) ctokens = min;
+	}
+	if (up && parent) parent->charge (n, true);
+}
+
@@ -0,0 +1,96 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_SHAPER_H
+#define _CVPN_SHAPER_H
+
+#include "sq.h"
+#include "sojourn.h"
+
+#include <stdint.h>
+
+/*
+ * Upload shaper (HTB-style)
+ *
+ * Classes form a tree: node-wide root, a child for every connection and,
+ * inside a connection, leaves for the VPN instances that have a class
+ * configured. Every class has two token buckets -- one filled at its rate,
+ * which it can always use, and one at its ceil, which bounds what it may
+ * borrow from the parent's spare tokens on top of that. Buckets are
+ * refilled only when the class is looked at, so the cost is proportional
+ * to the classes that actually have something to send.
+ *
+ * Rates are in bytes per second, 0 rate means nothing is guaranteed (all
+ * is borrowed), 0 ceil means no limit of its own.
+ */
+
+#define shaper_unlimited ( (int64_t) 1 << 40)
+
+class shaper_class
+{
+public:
+	int rate, ceil, burst;
+	int64_t tokens, ctokens; //in byte-microseconds, so nothing's lost
+	uint64_t last;
+	shaper_class*parent;
+
+	//stats
+	uint64_t sent, borrowed, throttled;
+
+	explicit inline shaper_class() : rate (0), ceil (0), burst (0),
+		tokens (0), ctokens (0), last (0), parent (0),
+		sent (0), borrowed (0), throttled (0) {}
+
+	void setup (int rate, int ceil, int burst, shaper_class*parent);
+
+	//bytes it may send right now
+	int64_t allowance();
+
+	//within its own rate
+	bool green();
+
+	//n bytes were sent; up also charges the parents
+	void charge (size_t n, bool up);
+
+private:
+	void update();
+};
+
+/*
+ * Instance class inside a connection, with its own queue of whole frames.
+ */
+
+class shaper_leaf
+{
+public:
+	shaper_class cls;
+	sgqueue q;
+	sojourn_stamps stamps;
+	uint64_t drops;
+	bool backlogged; //listed in the connection's backlog
+
+	explicit inline shaper_leaf() : drops (0), backlogged (false) {}
+};
+
+void shaper_init();
+bool shaper_enabled();
+
+shaper_class& shaper_root();
+void shaper_conn_setup (shaper_class&);
+
+//sets up a leaf if the instance has a class, false otherwise
+bool shaper_leaf_setup (uint32_t inst, shaper_leaf&, shaper_class&conn);
+bool shaper_has_class (uint32_t inst);
+bool shaper_classes(); //any configured
+
+#endif
+
@@ -0,0 +1,148 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sojourn.h"
+
+#include "timestamp.h"
+
+#include <string.h>
+
+#define hist_window 10000000 //usec
+
+/*
+ * Below 4 usec every value has its own bucket, above that every power of
+ * two is split into 4. Buckets report their top value, so percentiles are
+ * overestimated by 25% at worst.
+ */
+
+static inline int bucket (uint64_t v)
+{
+	if (v < (1 << hist_sub_bits) ) return v;
+
+	int e = 0;
+	while (v >> (e + 1) ) ++e;
+	int i = ( (e - hist_sub_bits + 1) << hist_sub_bits)
+	        + ( (v >> (e - hist_sub_bits) ) & ( (1 << hist_sub_bits) - 1) );
+	return i < hist_buckets ? i : hist_buckets - 1;
+}
+
+static inline uint64_t bucket_top (int i)
+{
+	if (i < (1 << hist_sub_bits) ) return i;
+
+	int e = (i >> hist_sub_bits) + hist_sub_bits - 1;
+	uint64_t m = (i & ( (1 << hist_sub_bits) - 1) ) | (1 << hist_sub_bits);
+	return ( (m + 1) << (e - hist_sub_bits) ) - 1;
+}
+
+delay_hist::delay_hist()
+{
+	memset (cur, 0, sizeof (cur) );
+	memset (prev, 0, sizeof (prev) );
+	cur_max = prev_max = 0;
+	window_start = timestamp();
+}
+
+void delay_hist::rotate()
+{
+	uint64_t now = timestamp();
+	if (now - window_start < hist_window) return;
+
+	//a window that's long gone doesn't count either
+	if (now - window_start < 2 * hist_window) {
+		memcpy (prev, cur, sizeof (prev) );
+		prev_max = cur_max;
+	} else {
+		memset (prev, 0, sizeof (prev) );
+		prev_max = 0;
+	}
+	memset (cur, 0, sizeof (cur) );
+	cur_max = 0;
+	window_start = now;
+}
+
+void delay_hist::add (uint64_t usec)
+{
+	rotate();
+	++cur[bucket (usec)];
+	if (usec > cur_max) cur_max = usec;
+}
+
+uint64_t delay_hist::count()
+{
+	rotate();
+	uint64_t n = 0;
+	for (int i = 0;i < hist_buckets;++i) n += cur[i] + prev[i];
+	return n;
+}
+
+uint64_t delay_hist::percentile (int p)
+{
+	uint64_t n = count(), k = 0;
+	if (!n) return 0;
+
+	uint64_t want = (n * p + 99) / 100;
+	for (int i = 0;i < hist_buckets;++i) {
+		k += cur[i] + prev[i];
+		if (k >= want) return bucket_top (i) < max() ?
+			                      bucket_top (i) : max();
+	}
+	return max();
+}
+
+uint64_t delay_hist::max()
+{
+	rotate();
+	return cur_max > prev_max ? cur_max : prev_max;
+}
+
+/*
+ * stamps
+ */
+
+bool sojourn_stamps::pop (size_t&len, uint64_t&t, bool&data)
+{
+	if (s.empty() ) return false;
+	stamp&f = s.front();
+	len = f.end - out;
+	t = f.t;
+	data = f.data;
+	out = f.end;
+	s.pop_front();
+	return true;
+}
+
+void sojourn_stamps::read (size_t n, delay_hist&data, delay_hist&ctl)
+{
+	uint64_t now = 0, d;
+
+	out += n;
+	while (s.size() && (s.front().end <= out) ) {
+		stamp&f = s.front();
+		if (f.t) {
+			if (!now) now = timestamp_precise();
+			d = now > f.t ? now - f.t : 0;
+			if (f.data) {
+				data.add (d);
+				sojourn_node().add (d);
+			} else ctl.add (d);
+		}
+		s.pop_front();
+	}
+}
+
+delay_hist& sojourn_node()
+{
+	static delay_hist h;
+	return h;
+}
+
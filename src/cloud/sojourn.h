@@ -0,0 +1,100 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_SOJOURN_H
+#define _CVPN_SOJOURN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <deque>
+using namespace std;
+
+/*
+ * Delay histogram
+ *
+ * Log-linear buckets (4 per power of two) of microseconds. Two windows
+ * are kept, so that the percentiles always describe the last 10-20
+ * seconds instead of the whole uptime.
+ */
+
+#define hist_sub_bits 2
+#define hist_buckets (36 << hist_sub_bits)
+
+class delay_hist
+{
+public:
+	uint32_t cur[hist_buckets], prev[hist_buckets];
+	uint64_t cur_max, prev_max;
+	uint64_t window_start;
+
+	explicit delay_hist();
+
+	void add (uint64_t usec);
+
+	uint64_t count();
+	uint64_t percentile (int p); //bucket top, usec
+	uint64_t max();
+
+private:
+	void rotate();
+};
+
+/*
+ * Sojourn tracking for a byte queue
+ *
+ * Frames are remembered by where they end in the queue's byte stream,
+ * together with the time they were queued; as the bytes leave, each frame
+ * that left completely reports how long it stayed. Stuff queued with time
+ * 0 isn't measured. Data frames are stamped with the time the node got
+ * them, so they also count into the node-wide histogram.
+ */
+
+class sojourn_stamps
+{
+public:
+	class stamp
+	{
+	public:
+		uint64_t end, t;
+		bool data;
+	};
+
+	deque<stamp> s;
+	uint64_t in, out;
+
+	explicit inline sojourn_stamps() : in (0), out (0) {}
+
+	inline void push (size_t len, uint64_t t, bool data) {
+		in += len;
+		s.push_back (stamp() );
+		s.back().end = in;
+		s.back().t = t;
+		s.back().data = data;
+	}
+
+	//takes the first frame, for moving it into another queue
+	bool pop (size_t&len, uint64_t&t, bool&data);
+
+	//n bytes left the queue
+	void read (size_t n, delay_hist&data, delay_hist&ctl);
+
+	inline void clear() {
+		s.clear();
+		in = out = 0;
+	}
+};
+
+delay_hist& sojourn_node(); //time from arrival to leaving through a socket
+
+#endif
+
@@ -15,7 +15,11 @@
 #include "timestamp.h"
 #include "route.h"
 #include "comm.h"
+#include "gate.h"
 #include "conf.h"
+#include "pool.h"
+#include "handshake.h"
+#include "zerocopy.h"
 #define LOGNAME "cloud/status"
 #include "log.h"
 
@@ -45,9 +49,31 @@ static string data_format (uint64_t a)
 	return string (buffer);
 }
 
+static string hist_format (delay_hist&h)
+{
+	char buffer[128];
+	snprintf (buffer, 127, "p50 %gms, p99 %gms, max %gms",
+	          0.001 * h.percentile (50), 0.001 * h.percentile (99),
+	          0.001 * h.max() );
+	return string (buffer);
+}
+
+static string rate_format (shaper_class&c)
+{
+	return "rate " + (c.rate ? data_format (c.rate) + "B/s" : "-")
+	       + ", ceil " + (c.ceil ? data_format (c.ceil) + "B/s" : "-");
+}
+
+static const char*prio_names[prio_classes] =
+	{ "best-effort", "background", "interactive", "voice" };
+
 static int status_to_file (const char*fn)
 {
 	FILE*outfile;
+	uint64_t prio_out[prio_classes], prio_drops[prio_classes],
+	         prio_over[prio_classes];
+	for (int p = 0;p < prio_classes;++p)
+		prio_out[p] = prio_drops[p] = prio_over[p] = 0;
 
 	uint64_t //for computing totals
 	in_p_speed, in_s_speed,
@@ -86,6 +112,113 @@ static int status_to_file (const char*fn)
 		if (c->second.peer_connected_since)
 			output (" = connected for %g seconds\n", 0.000001 *
 			        (timestamp() - c->second.peer_connected_since) );
+		if ( (c->second.state == cs_active) && c->second.caps_received)
+			output (" = protocol features 0x%02x, max frame %uB, "
+			        "max record %dB\n", c->second.features,
+			        c->second.max_frame(), c->second.max_record() );
+		else if (c->second.state == cs_active)
+			output (" = protocol features 0x%02x\n",
+			        c->second.features);
+		if (c->second.handshake_usec)
+			output (" = handshake %gms, %s\n",
+			        0.001 * c->second.handshake_usec,
+			        c->second.resumed ? "resumed" : "full");
+		if (c->second.plain)
+			output (" = plaintext data path\n");
+		if (c->second.ktls_tx || c->second.ktls_rx)
+			output (" = kernel TLS%s%s\n",
+			        c->second.ktls_tx ? " tx" : "",
+			        c->second.ktls_rx ? " rx" : "");
+		if (c->second.bundled)
+			output (" = stream %d of %d in bundle %08x\n",
+			        c->second.bundle_index, c->second.bundle_count,
+			        c->second.bundle_id);
+		if (c->second.dgram)
+			output (" = datagram transport, %s too large frames "
+			        "dropped\n",
+			        data_format (c->second.dgram_dropped).c_str() );
+		if (c->second.comp_packets || c->second.comp_bypass)
+			output (" = compressed %spkt to %.1f%%, %gms cpu, "
+			        "bypassed %spkt\n",
+			        data_format (c->second.comp_packets).c_str(),
+			        c->second.comp_in ? 100.0 * c->second.comp_out /
+			        c->second.comp_in : 100.0,
+			        0.001 * c->second.comp_usec,
+			        data_format (c->second.comp_bypass).c_str() );
+		if (c->second.state == cs_active)
+			output (" = records out %s/s of %gB, in %s/s of %gB, "
+			        "%s syscalls/s%s\n",
+			        data_format (c->second.rec_out_speed).c_str(),
+			        (double) c->second.rec_out_size,
+			        data_format (c->second.rec_in_speed).c_str(),
+			        (double) c->second.rec_in_size,
+			        data_format (c->second.syscall_speed).c_str(),
+			        c->second.rec_bulk ? ", bulk" : "");
+		output (" = buffers %sB resident, queued %sB control, %sB data\n",
+		        data_format (c->second.resident_buffers() ).c_str(),
+		        data_format (c->second.ctl_q.len() ).c_str(),
+		        data_format (c->second.send_q.len()
+		                     + c->second.data_q.len()
+		                     + c->second.fq.len()
+		                     + c->second.leaves_len
+		                     + c->second.prio_len).c_str() );
+		for (int i = 0;i < prio_classes;++i) {
+			prio_out[i] += c->second.prio_out[i];
+			prio_drops[i] += c->second.prio_drops[i];
+			prio_over[i] += c->second.prio_over[i];
+			if (!c->second.prio_out[i] && !c->second.prio_drops[i])
+				continue;
+			output (" `--prio %s \tqueued %sB \tsent %spkt "
+			        "\tdropped %llu \tover rate %llu\n",
+			        prio_names[i],
+			        data_format (i == prio_best_effort ?
+			                     c->second.data_q.len()
+			                     + c->second.fq.len() :
+			                     c->second.prio_q[i].len() ).c_str(),
+			        data_format (c->second.prio_out[i]).c_str(),
+			        (unsigned long long) c->second.prio_drops[i],
+			        (unsigned long long) c->second.prio_over[i]);
+		}
+		if (c->second.fq.flows.size() ) {
+			flow_queue&q = c->second.fq;
+			output (" = flow queues: %d active, %llu dropped\n",
+			        q.active(), (unsigned long long) q.drops);
+			for (size_t i = 0;i < q.flows.size();++i) {
+				flow_queue::flow&f = q.flows[i];
+				if (!f.packets && !f.drops) continue;
+				output (" `--flow %zu \tqueued %sB \tsent %spkt "
+				        "\tdropped %llu \tsojourn %gms, max %gms\n",
+				        i, data_format (f.q.len() ).c_str(),
+				        data_format (f.packets).c_str(),
+				        (unsigned long long) f.drops,
+				        0.001 / 8 * f.sojourn,
+				        0.001 * f.sojourn_max);
+			}
+		}
+		if (shaper_enabled() ) {
+			shaper_class&sc = c->second.shaper;
+			output (" = shaper %s, sent %sB, borrowed %sB, "
+			        "throttled %llu\n", rate_format (sc).c_str(),
+			        data_format (sc.sent).c_str(),
+			        data_format (sc.borrowed).c_str(),
+			        (unsigned long long) sc.throttled);
+			map<uint32_t, shaper_leaf>::iterator l;
+			for (l = c->second.leaves.begin();
+			        l != c->second.leaves.end();++l)
+				output (" `--class %08x \t%s \tqueued %sB "
+				        "\tsent %sB \tborrowed %sB \tdropped %llu\n",
+				        l->first, rate_format (l->second.cls).c_str(),
+				        data_format (l->second.q.len() ).c_str(),
+				        data_format (l->second.cls.sent).c_str(),
+				        data_format (l->second.cls.borrowed).c_str(),
+				        (unsigned long long) l->second.drops);
+		}
+		if (c->second.sojourn_data.count() )
+			output (" = data sojourn %s\n",
+			        hist_format (c->second.sojourn_data).c_str() );
+		if (c->second.sojourn_ctl.count() )
+			output (" = control sojourn %s\n",
+			        hist_format (c->second.sojourn_ctl).c_str() );
 
 
 		output (" >> in  %sB/s, %spkt/s; total %sB, %spkt\n",
@@ -123,7 +256,74 @@ static int status_to_file (const char*fn)
 	        data_format (out_p_speed).c_str(),
 	        data_format (connection::all_out_s_total).c_str(),
 	        data_format (connection::all_out_p_total).c_str() );
+	output (" << shared fan-out %spkt, saved %sB of copying\n",
+	        data_format (connection::all_fanout_frames).c_str(),
+	        data_format (connection::all_fanout_saved).c_str() );
+	output (" << compact headers saved %sB\n",
+	        data_format (connection::all_compact_saved).c_str() );
+	output (" handshakes: %llu full, %llu resumed, %gms on average\n",
+	        (unsigned long long) connection::all_handshakes_full,
+	        (unsigned long long) connection::all_handshakes_resumed,
+	        (connection::all_handshakes_full +
+	         connection::all_handshakes_resumed) ?
+	        0.001 * connection::all_handshake_usec /
+	        (connection::all_handshakes_full +
+	         connection::all_handshakes_resumed) : 0.0);
+
+	output (" handshakes: %d in progress, %d on %d workers, "
+	        "%llu refused\n", comm_handshakes_pending(),
+	        handshake_in_flight(), handshake_workers(),
+	        (unsigned long long) connection::all_handshakes_refused);
+	if (zerocopy_sends() )
+		output (" << zerocopy %s sends of %sB, %llu copied anyway, "
+		        "%zu blocks pinned\n",
+		        data_format (zerocopy_sends() ).c_str(),
+		        data_format (zerocopy_bytes() ).c_str(),
+		        (unsigned long long) zerocopy_copied(),
+		        zerocopy_pinned() );
+	output (" event handlers: longest %gms, jitter %gms\n",
+	        0.001 * connection::all_stall_max,
+	        0.001 / 16 * connection::all_stall_jitter);
+	if (shaper_enabled() )
+		output (" << upload shaper %s, sent %sB\n",
+		        rate_format (shaper_root() ).c_str(),
+		        data_format (shaper_root().sent).c_str() );
+	for (int i = 0;i < prio_classes;++i)
+		if (prio_out[i] || prio_drops[i])
+			output (" prio %s: sent %spkt, dropped %llu, "
+			        "over rate %llu\n",
+			        prio_names[i], data_format (prio_out[i]).c_str(),
+			        (unsigned long long) prio_drops[i],
+			        (unsigned long long) prio_over[i]);
+	output (" time inside this node %s\n",
+	        hist_format (sojourn_node() ).c_str() );
+	output ("---\n\n");
+
+	output ("gates: %zd\n", gate_gates().size() );
 
+	map<int, gate>::iterator g;
+	for (g = gate_gates().begin();g != gate_gates().end();++g)
+		output ("gate %d 	queued %sB 	sojourn %s\n", g->first,
+		        data_format (g->second.send_q.len() ).c_str(),
+		        hist_format (g->second.sojourn).c_str() );
+	output ("---\n\n");
+
+	output ("buffer pool: %sB from system, budget %s, %llu failures\n",
+	        data_format (pool_used_bytes() ).c_str(),
+	        pool_budget_bytes() ?
+	        (data_format (pool_budget_bytes() ) + "B").c_str() :
+	        "unlimited",
+	        (unsigned long long) pool_failures() );
+
+	for (int i = pool_min_shift;i <= pool_max_shift;++i) {
+		pool_class&pc = pool_get_class (i);
+		if (!pc.total) continue;
+		output (" `--class %sB \tused %zu of %zu \thits %llu \tmisses %llu\n",
+		        data_format ( (uint64_t) 1 << i).c_str(),
+		        pc.used, pc.total,
+		        (unsigned long long) pc.hits,
+		        (unsigned long long) pc.misses);
+	}
 	output ("---\n\n");
 
 	output ("local route count: %zd\n", route_get().size() );
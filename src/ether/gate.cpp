@@ -11,6 +11,7 @@
  */
 
 #include "sq.h"
+#include "wire.h"
 #define LOGNAME "ether"
 #include "log.h"
 #include "conf.h"
@@ -707,6 +708,7 @@ void iface_poll_read()
 int gate = -1;
 bool promisc = false;
 bool bridge = false;
+bool priorities = true;
 
 uint16_t inst = 0xDEFA;
 uint16_t proto = 0xE78A;
@@ -733,6 +735,8 @@ void gate_init()
 		bridge = true;
 		proto = 0xE78B; //so it doesn't mess with normal ethernet
 	}
+	if (config_is_set ("priority") && !config_is_true ("priority") )
+		priorities = false;
 }
 
 int gate_connect()
@@ -797,20 +801,24 @@ void send_route()
 		return;
 	}
 
-	uint8_t*b = send_q.append_buffer (3);
-	*b = 2;
-	* (uint16_t*) (b + 1) = htons (12 + (promisc ? 6 : 0) );
-
-	b = send_q.append_buffer (12 + (promisc ? 6 : 0) );
-	* (uint16_t*) (b) = htons (6);
-	* (uint32_t*) (b + 2) = htonl ( (proto << 16) | inst);
-	sq_memcpy (b + 6, cached_hwaddr.addr.begin().base(),
+	uint16_t size = gate_route_entry::size + 6
+	                + (promisc ? gate_route_entry::size : 0);
+	uint8_t*b = send_q.append_buffer (gate_header::size + size);
+	if (!b) return;
+	gate_header::type::put (b, 2);
+	gate_header::length::put (b, size);
+
+	b += gate_header::size;
+	gate_route_entry::addr_size::put (b, 6);
+	gate_route_entry::inst::put (b, (proto << 16) | inst);
+	sq_memcpy (b + gate_route_entry::size,
+	           cached_hwaddr.addr.begin().base(),
 	           cached_hwaddr.addr.size() );
 
 	if (promisc) {   //promisc doesn't need to be used with bridge, though.
-		b += 12;
-		* (uint16_t*) (b) = htons (0);
-		* (uint32_t*) (b + 2) = htonl ( (proto << 16) | inst);
+		b += gate_route_entry::size + 6;
+		gate_route_entry::addr_size::put (b, 0);
+		gate_route_entry::inst::put (b, (proto << 16) | inst);
 	}
 	gate_poll_write();
 }
@@ -819,34 +827,79 @@ void send_keepalive()
 {
 	if (gate < 0) return;
 	if (send_q.len() > send_q_max) return;
-	uint8_t*b = send_q.append_buffer (3);
-	*b = 1;
-	* (uint16_t*) (b + 1) = 0;
+	uint8_t*b = send_q.append_buffer (gate_header::size);
+	if (!b) return;
+	gate_header::type::put (b, 1);
+	gate_header::length::put (b, 0);
 	gate_poll_write();
 }
 
+/*
+ * Priority class comes from the 802.1p bits of a VLAN tag, or from the
+ * DSCP of the IP header inside. Expedited forwarding and network control
+ * go as voice, the class selectors and assured forwarding from 2 up to
+ * CS5 as interactive, CS1 and lower effort as background.
+ */
+
+static const uint8_t pcp_class[8] = {
+	prio_best_effort, prio_background, prio_best_effort, prio_interactive,
+	prio_interactive, prio_voice, prio_voice, prio_voice
+};
+
+static uint8_t dscp_class (int dscp)
+{
+	if ( (dscp == 1) || (dscp == 8) ) return prio_background;
+	if ( (dscp == 44) || (dscp >= 46) ) return prio_voice;
+	if ( (dscp >= 16) && (dscp <= 40) ) return prio_interactive;
+	return prio_best_effort;
+}
+
+static uint8_t frame_priority (const uint8_t*d, int size)
+{
+	int off = 12;
+	int type = (d[off] << 8) | d[off+1];
+
+	if ( (type == 0x8100) && (size >= 18) ) {
+		if (d[14] >> 5) return pcp_class[d[14] >> 5];
+		off = 16;
+		type = (d[off] << 8) | d[off+1];
+	}
+	off += 2;
+	if (size < off + 2) return prio_best_effort;
+
+	if (type == 0x0800) return dscp_class (d[off+1] >> 2);
+	if (type == 0x86DD)
+		return dscp_class ( ( (d[off] & 0x0f) << 2) | (d[off+1] >> 6) );
+	return prio_best_effort;
+}
+
 void send_packet (uint8_t*data, int size)
 {
 	if (gate < 0) return;
 	if (send_q.len() > send_q_max) return;
 	if (size < 14) return;
-	uint8_t*b = send_q.append_buffer (3 + 14 + size);
-	*b = 3;
-	* (uint16_t*) (b + 1) = htons (14 + size);
-	b += 3;
-	* (uint32_t*) (b) = htonl ( (proto << 16) | inst);
-	* (uint16_t*) (b + 4) = htons (0);//dof
+
+	//best effort doesn't need the extra byte
+	uint8_t prio = priorities ? frame_priority (data, size) : 0;
+	int extra = prio ? 1 : 0;
+
+	uint8_t*b = send_q.append_buffer (gate_header::size
+	                                  + gate_packet::size + size + extra);
+	if (!b) return;
+	gate_header::type::put (b, 3);
+	gate_header::length::put (b, gate_packet::size + size + extra);
+	b += gate_header::size;
+	gate_packet::inst::put (b, (proto << 16) | inst);
+	gate_packet::dof::put (b, 0);
 
 	//ds - needs to be zerolen when broadcasting or bridge-casting
-	if (bridge || (data[0]&1) )
-		* (uint16_t*) (b + 6) = htons (0);
-	else
-		* (uint16_t*) (b + 6) = htons (6);
-
-	* (uint16_t*) (b + 8) = htons (6);//sof
-	* (uint16_t*) (b + 10) = htons (6);//ss
-	* (uint16_t*) (b + 12) = htons (size);
-	memcpy (b + 14, data, size);
+	gate_packet::ds::put (b, (bridge || (data[0]&1) ) ? 0 : 6);
+
+	gate_packet::sof::put (b, 6);
+	gate_packet::ss::put (b, 6);
+	gate_packet::length::put (b, size);
+	memcpy (b + gate_packet::size, data, size);
+	if (prio) b[gate_packet::size + size] = prio;
 	gate_poll_write();
 }
 
@@ -857,35 +910,36 @@ void handle_keepalive()
 
 void handle_packet (uint8_t*data, int size)
 {
-	uint32_t instance;
-	uint16_t dof, ds, sof, ss, s;
-	if (size < 28) return;
-	instance = ntohl (* (uint32_t*) (data) );
-	dof = ntohs (* (uint16_t*) (data + 4) );
-	ds = ntohs (* (uint16_t*) (data + 6) );
-	sof = ntohs (* (uint16_t*) (data + 8) );
-	ss = ntohs (* (uint16_t*) (data + 10) );
-	s = ntohs (* (uint16_t*) (data + 12) );
-
-	if (instance != (uint32_t) ( (proto << 16) | inst) ) return;
-
-	if ( (dof != 0) ||
+	uint16_t ds, s;
+	const uint8_t*h, *frame;
+	wire_reader r (data, size);
+
+	if (! (h = r.take<gate_packet>() ) ) return;
+
+	if (gate_packet::inst::get (h) != (uint32_t) ( (proto << 16) | inst) )
+		return;
+
+	ds = gate_packet::ds::get (h);
+	if ( (gate_packet::dof::get (h) != 0) ||
 	        ( (ds != 6) && (ds != 0) ) ||
-	        (sof != 6) ||
-	        (ss != 6) ) return;
+	        (gate_packet::sof::get (h) != 6) ||
+	        (gate_packet::ss::get (h) != 6) ) return;
 
+	s = gate_packet::length::get (h);
 	if (s < 14) return;
-	iface_write (data + 14, s);
+	if (! (frame = r.take (s) ) ) return;
+	iface_write ( (uint8_t*) frame, s);
 }
 
 void try_parse_input()
 {
 	while (1) {
 		if (!cached_header_type) {
-			if (recv_q.len() < 3) return;
-			recv_q.pop<uint8_t> (cached_header_type);
-			recv_q.pop<uint16_t> (cached_header_size);
-			cached_header_size = ntohs (cached_header_size);
+			const uint8_t*h = recv_q.window (gate_header::size);
+			if (!h) return;
+			cached_header_type = gate_header::type::get (h);
+			cached_header_size = gate_header::length::get (h);
+			recv_q.read (gate_header::size);
 		}
 		switch (cached_header_type) {
 		case 1: //keepalive
@@ -896,7 +950,8 @@ void try_parse_input()
 		case 3: //packet
 			if (recv_q.len() < cached_header_size) //need more
 				return;
-			handle_packet (recv_q.begin(), cached_header_size);
+			handle_packet (recv_q.window (cached_header_size),
+			               cached_header_size);
 			recv_q.read (cached_header_size);
 			cached_header_type = 0;
 			break;
@@ -946,7 +1001,7 @@ int gate_poll_write()
 #ifdef __WIN32__
 		          (const char*)
 #endif //__WIN32__
-		          send_q.begin(), send_q.len(), 0);
+		          send_q.begin(), send_q.contiguous(), 0);
 		if (r == 0) {
 			gate_disconnect();
 			return 1;
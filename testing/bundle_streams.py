@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+#
+# Throughput of one neighbour over loopback depending on how many streams
+# its bundle has ("bundleN:address").
+#
+# A gate client on one node pushes ethernet frames carrying UDP packets of
+# many different port pairs (so that the flow hash can spread them), the
+# other node's gate client counts what arrives. Without an argument it tries
+# 1, 2, 4 and 8 streams, 5 seconds each.
+#
+# usage: testing/bundle_streams.py [seconds] [streams ...]
+#
+
+import os, sys, time
+sys.path.insert (0, os.path.dirname (os.path.abspath (__file__) ) )
+from cvpn import *
+
+inst = 0xb0d1e000
+mac_a = b'\x02\x00\x00\x00\x00\x0a'
+mac_b = b'\x02\x00\x00\x00\x00\x0b'
+port = 17301
+
+def measure (d, streams, seconds):
+	addr = '127.0.0.1 %d' % port
+	if streams > 1: addr = 'bundle%d:%s' % (streams, addr)
+	a = Node (d, 'a', ['listen 127.0.0.1 %d' % port])
+	time.sleep (0.3)
+	b = Node (d, 'b', ['connect ' + addr])
+	ga = gb = None
+	try:
+		ga = a.gate()
+		gb = b.gate()
+		if not converge (ga, gb, inst, mac_a, mac_b): return None
+		time.sleep (0.5 * streams) #let the other streams join
+		cpu = a.cpu() + b.cpu()
+		r = throughput (gb, ga, inst, mac_a, mac_b, seconds)
+		return r, (a.cpu() + b.cpu() - cpu) / (r * seconds / 1e9)
+	finally:
+		for g in (ga, gb):
+			if g: g.close()
+		b.stop()
+		a.stop()
+
+def main():
+	seconds = float (sys.argv[1]) if len (sys.argv) > 1 else 5
+	counts = [int (x) for x in sys.argv[2:]] or [1, 2, 4, 8]
+	d = workdir()
+	print ('streams    MB/s  CPU s/GB')
+	try:
+		for n in counts:
+			r = measure (d, n, seconds)
+			if r is None: print ('%7d    no connection' % n)
+			else: print ('%7d %7.1f %9.2f' % (n, r[0] / 1e6, r[1]) )
+	finally:
+		cleanup (d)
+
+if __name__ == '__main__': main()
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Checks that pings and route updates keep going on a saturated link.
+#
+# Two nodes on loopback, the connecting one limited by uplimit-total, its
+# gate client sends much more than that. Control frames have a queue of
+# their own (and TCP_NOTSENT_LOWAT keeps the kernel queue short), so the
+# connection ping should stay close to the idle one and new routes should
+# reach the other node quickly, instead of waiting behind the data.
+#
+# A control frame may still wait behind one feed of data (at most 64KiB) at
+# the shaped rate, the whole data backlog would take seconds. The script
+# exits with 1 if the saturated ping p99 grows over the idle one by more
+# than that feed time plus 50ms, or if a route takes longer than a second.
+#
+# usage: testing/ctl_priority.py [seconds] [uplimit B/s]
+#
+
+import os, sys, time, threading
+sys.path.insert (0, os.path.dirname (os.path.abspath (__file__) ) )
+from cvpn import *
+
+inst = 0xc7100000
+mac_a = b'\x02\x00\x00\x00\x00\x0a'
+mac_b = b'\x02\x00\x00\x00\x00\x0b'
+port = 17501
+sample = 0.05
+feed = 65536
+ping_slack = 0.05
+route_max = 1.0
+
+def ping_of (node):
+	'''connection ping in seconds, from the status file'''
+	for l in node.status():
+		if l.startswith ('connection ') and '\tping ' in l:
+			return int (l.split ('\tping ')[1].split()[0]) / 1e6
+	return None
+
+def routes_of (node):
+	return len ([l for l in node.status()
+	             if l.startswith ('route to ') and
+	             ('%08x' % inst) in l.lower()])
+
+def pings (node, seconds):
+	r = []
+	end = time.time() + seconds
+	while time.time() < end:
+		p = ping_of (node)
+		if p is not None: r.append (p)
+		time.sleep (sample)
+	return sorted (r)
+
+def route_time (a, gr, n):
+	'''gives gate gr one more address, waits until node a knows it'''
+	before = routes_of (a)
+	extra = [b'\x02\x00\x00\x00\x01' + bytes ([i]) for i in range (n + 1)]
+	start = time.time()
+	gr.routes (inst, extra)
+	while time.time() < start + 5 * route_max:
+		if routes_of (a) > before: return time.time() - start
+		time.sleep (0.005)
+	return None
+
+def pct (l, p):
+	return l[min (len (l) - 1, int (len (l) * p) )]
+
+def main():
+	seconds = float (sys.argv[1]) if len (sys.argv) > 1 else 5
+	limit = int (sys.argv[2]) if len (sys.argv) > 2 else 1000000
+	common = ['conn_keepalive 100000', 'status-interval 20000']
+	d = workdir()
+	a = Node (d, 'a', common + ['listen 127.0.0.1 %d' % port])
+	time.sleep (0.3)
+	b = Node (d, 'b', common + ['connect 127.0.0.1 %d' % port,
+	                            'uplimit-total %d' % limit])
+	ga = gb = gr = None
+	ok = True
+	try:
+		ga = a.gate()
+		gb = b.gate()
+		gr = b.gate() #route updates, gb is busy with the traffic
+		if not converge (ga, gb, inst, mac_a, mac_b):
+			print ('nodes did not connect')
+			sys.exit (1)
+
+		idle = pings (b, seconds)
+		idle_route = [route_time (a, gr, i) for i in range (3)]
+
+		flood = threading.Thread (target = throughput,
+		                          args = (gb, ga, inst, mac_a, mac_b,
+		                                  seconds + 3) )
+		flood.start()
+		time.sleep (1)
+		busy = pings (b, seconds)
+		busy_route = [route_time (a, gr, i) for i in range (3, 6)]
+		flood.join()
+
+		print ('           ping p50 ms  ping p99 ms  route max ms')
+		for name, p, r in ( ('idle', idle, idle_route),
+		                    ('saturated', busy, busy_route) ):
+			worst = None if None in r else max (r)
+			print ('%-10s %11.1f %12.1f %13s' %
+			       (name, 1000 * pct (p, 0.5), 1000 * pct (p, 0.99),
+			        'never' if worst is None else '%.1f' % (1000 * worst) ) )
+			if worst is None or worst > route_max: ok = False
+		if pct (busy, 0.99) > pct (idle, 0.99) + float (feed) / limit + ping_slack:
+			ok = False
+	finally:
+		for g in (ga, gb, gr):
+			if g: g.close()
+		b.stop()
+		a.stop()
+		cleanup (d)
+	print ('OK' if ok else 'FAILED')
+	sys.exit (0 if ok else 1)
+
+if __name__ == '__main__': main()
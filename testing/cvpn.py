@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+#
+# Helpers for the loopback test scripts in this directory: certificates,
+# network namespaces joined by a lossy userspace link, running cloud nodes
+# and talking to their gates.
+#
+# Namespaces and TUN devices need root. The cloud binary is taken from the
+# CLOUD environment variable, or ./cloud of the build tree.
+#
+
+import os, sys, time, random, struct, socket, select, fcntl
+import subprocess, tempfile, shutil, threading
+
+here = os.path.dirname (os.path.abspath (__file__))
+cloud_bin = os.environ.get ('CLOUD', os.path.join (here, '..', 'cloud'))
+
+def workdir():
+	d = tempfile.mkdtemp (prefix = 'cvpn-')
+	make_certs (d)
+	return d
+
+def make_certs (d):
+	'''CA and one node certificate shared by all nodes, in directory d'''
+	def run (*a):
+		subprocess.check_call (a, cwd = d, stdout = subprocess.DEVNULL,
+		                       stderr = subprocess.DEVNULL)
+	open (os.path.join (d, 'ext.cnf'), 'w').write (
+	    'basicConstraints=CA:FALSE\n'
+	    'extendedKeyUsage=serverAuth,clientAuth\n'
+	    'keyUsage=digitalSignature,keyEncipherment\n')
+	run ('openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes',
+	     '-keyout', 'ca.key', '-out', 'ca.crt', '-days', '30',
+	     '-subj', '/CN=cvpn test ca')
+	run ('openssl', 'req', '-newkey', 'rsa:2048', '-nodes',
+	     '-keyout', 'ssl.key', '-out', 'ssl.csr', '-subj', '/CN=cvpn node')
+	run ('openssl', 'x509', '-req', '-in', 'ssl.csr', '-CA', 'ca.crt',
+	     '-CAkey', 'ca.key', '-CAcreateserial', '-days', '30',
+	     '-extfile', 'ext.cnf', '-out', 'ssl.crt')
+
+def sh (cmd):
+	subprocess.check_call (cmd, shell = True)
+
+#
+# two namespaces, each with a TUN device, packets between them are relayed
+# by a thread that drops the given fraction of them.
+#
+
+TUNSETIFF = 0x400454ca
+IFF_TUN = 0x0001
+IFF_NO_PI = 0x1000
+
+def tun_open (name):
+	fd = os.open ('/dev/net/tun', os.O_RDWR)
+	fcntl.ioctl (fd, TUNSETIFF,
+	             struct.pack ('16sH', name.encode(), IFF_TUN | IFF_NO_PI) )
+	return fd
+
+class Link:
+	def __init__ (s, loss = 0.0, names = ('cvpn-a', 'cvpn-b'),
+	              net = '10.231.0.'):
+		s.loss = loss
+		s.names = names
+		s.addr = [net + '1', net + '2']
+		s.fds = []
+		s.running = True
+		for i, n in enumerate (names):
+			sh ('ip netns add %s' % n)
+			fd = tun_open (n)
+			s.fds.append (fd)
+			sh ('ip link set %s netns %s' % (n, n) )
+			sh ('ip -n %s link set lo up' % n)
+			sh ('ip -n %s addr add %s/24 dev %s' % (n, s.addr[i], n) )
+			sh ('ip -n %s link set %s mtu 1500 up' % (n, n) )
+		s.dropped = s.passed = 0
+		s.t = threading.Thread (target = s.relay)
+		s.t.daemon = True
+		s.t.start()
+
+	def relay (s):
+		other = {s.fds[0]: s.fds[1], s.fds[1]: s.fds[0]}
+		while s.running:
+			r, _, _ = select.select (s.fds, [], [], 0.1)
+			for fd in r:
+				try: p = os.read (fd, 65536)
+				except OSError: continue
+				if random.random() < s.loss:
+					s.dropped += 1
+					continue
+				s.passed += 1
+				try: os.write (other[fd], p)
+				except OSError: pass
+
+	def close (s):
+		s.running = False
+		s.t.join()
+		for fd in s.fds: os.close (fd)
+		for n in s.names:
+			subprocess.call (['ip', 'netns', 'del', n])
+
+#
+# cloud nodes
+#
+
+class Node:
+	def __init__ (s, d, name, conf, netns = None):
+		s.name = name
+		s.gate_path = os.path.join (d, name + '.gate')
+		path = os.path.join (d, name + '.conf')
+		f = open (path, 'w')
+		f.write ('x509key %s/ssl.key\n' % d)
+		f.write ('x509cert %s/ssl.crt\n' % d)
+		f.write ('x509ca %s/ca.crt\n' % d)
+		f.write ('x509dh %s/dh1024.pem\n' % here)
+		f.write ('gate %s\n' % s.gate_path)
+		s.status_path = os.path.join (d, name + '.status')
+		f.write ('status-file %s\n' % s.status_path)
+		f.write ('heartbeat 50000\n')
+		for l in conf: f.write (l + '\n')
+		f.close()
+		cmd = [cloud_bin, '-@include', path]
+		if netns: cmd = ['ip', 'netns', 'exec', netns] + cmd
+		s.log = open (os.path.join (d, name + '.log'), 'w')
+		s.p = subprocess.Popen (cmd, stdout = s.log,
+		                        stderr = subprocess.STDOUT)
+
+	def gate (s, timeout = 5.0):
+		end = time.time() + timeout
+		while True:
+			try: return Gate (s.gate_path)
+			except socket.error:
+				if time.time() > end: raise
+				time.sleep (0.05)
+
+	def cpu (s):
+		'''seconds of CPU time the node used so far (Linux)'''
+		f = open ('/proc/%d/stat' % s.p.pid).read().rsplit (')', 1)[1]
+		t = f.split()
+		return (int (t[11]) + int (t[12]) ) / float (os.sysconf ('SC_CLK_TCK') )
+
+	def status (s):
+		'''lines of the status file, needs status-file in conf'''
+		try: return open (s.status_path).read().split ('\n')
+		except IOError: return []
+
+	def stop (s):
+		s.p.terminate()
+		s.p.wait()
+		s.log.close()
+
+#
+# gate protocol client, see src/cloud/gate.cpp
+#
+
+def frame (t, body):
+	return struct.pack ('!BH', t, len (body) ) + body
+
+def packet (inst, dst, src, payload):
+	data = dst + src + payload
+	return frame (3, struct.pack ('!IHHHHH', inst, 0, len (dst), len (dst),
+	                              len (src), len (data) ) + data)
+
+class Gate:
+	def __init__ (s, path):
+		s.s = socket.socket (socket.AF_UNIX, socket.SOCK_STREAM)
+		s.s.connect (path)
+		s.buf = b''
+
+	def send (s, t, body):
+		s.s.sendall (frame (t, body) )
+
+	def route (s, inst, addr):
+		s.routes (inst, [addr])
+
+	def routes (s, inst, addrs):
+		'''replaces all addresses the gate handles'''
+		s.send (2, b''.join ([struct.pack ('!HI', len (a), inst) + a
+		                      for a in addrs]) )
+
+	def packet (s, inst, dst, src, payload):
+		s.s.sendall (packet (inst, dst, src, payload) )
+
+	def frames (s, timeout):
+		'''(type, body) of frames that arrive within timeout seconds'''
+		out = []
+		end = time.time() + timeout
+		while not out:
+			left = end - time.time()
+			if left <= 0: break
+			r, _, _ = select.select ([s.s], [], [], left)
+			if not r: break
+			d = s.s.recv (65536)
+			if not d: break
+			s.buf += d
+			while len (s.buf) >= 3:
+				t, l = struct.unpack ('!BH', s.buf[:3])
+				if len (s.buf) < 3 + l: break
+				out.append ( (t, s.buf[3:3 + l]) )
+				s.buf = s.buf[3 + l:]
+		return out
+
+	def payloads (s, src_len, timeout):
+		'''payloads of packets that arrive within timeout seconds'''
+		return [b[14 + 2 * src_len:] for t, b in s.frames (timeout)
+		        if t == 3]
+
+	def close (s):
+		s.s.close()
+
+#
+# bulk traffic: ethernet frames with UDP packets of many port pairs, so that
+# flow hashing has something to spread
+#
+
+def udp_frame (inst, dst, src, sport, size):
+	ip = struct.pack ('!BBHHHBBH4s4s', 0x45, 0, 20 + 8 + size, 0, 0, 64, 17,
+	                  0, b'\x0a\x00\x00\x0b', b'\x0a\x00\x00\x0a')
+	udp = struct.pack ('!HHHH', sport, 9, 8 + size, 0)
+	return packet (inst, dst, src, b'\x08\x00' + ip + udp + b'x' * size)
+
+def throughput (sender, receiver, inst, dst, src, seconds,
+                size = 1400, flows = 64):
+	'''bytes per second that come out of the receiving gate'''
+	stat = {'run': True, 'bytes': 0}
+	def receive():
+		while stat['run']:
+			r, _, _ = select.select ([receiver.s], [], [], 0.1)
+			if r: stat['bytes'] += len (receiver.s.recv (1 << 20) )
+	burst = b''.join ([udp_frame (inst, dst, src, 10000 + i, size)
+	                   for i in range (flows)])
+	t = threading.Thread (target = receive)
+	t.start()
+	start = time.time()
+	while time.time() < start + seconds: sender.s.sendall (burst)
+	time.sleep (0.5)
+	stat['run'] = False
+	t.join()
+	return stat['bytes'] / (time.time() - 0.5 - start)
+
+def converge (ga, gb, inst, mac_a, mac_b, timeout = 20):
+	'''sets up routes, waits until packets from gb reach ga'''
+	ga.route (inst, mac_a)
+	gb.route (inst, mac_b)
+	end = time.time() + timeout
+	while time.time() < end:
+		gb.packet (inst, mac_a, mac_b, b'hello')
+		if ga.payloads (len (mac_b), 0.2): return True
+	return False
+
+def need_root():
+	if os.geteuid() != 0:
+		sys.stderr.write ('this needs root for network namespaces\n')
+		sys.exit (2)
+
+def cleanup (d):
+	shutil.rmtree (d, True)
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+#
+# Latency of packets through a lossy link, TCP versus DTLS connections.
+#
+# Two nodes run in separate network namespaces joined by a userspace link
+# that drops the given fraction of IP packets. A gate client on one node
+# sends a small timestamped packet every few milliseconds, the client on the
+# other node echoes it back; the script prints round trip percentiles and
+# the share of packets that never came back.
+#
+# usage: sudo testing/dtls_loss.py [seconds] [loss ...]
+#
+
+import os, sys, time, struct
+sys.path.insert (0, os.path.dirname (os.path.abspath (__file__) ) )
+from cvpn import *
+
+inst = 0x10550000
+mac_a = b'\x02\x00\x00\x00\x00\x0a'
+mac_b = b'\x02\x00\x00\x00\x00\x0b'
+interval = 0.005
+
+def measure (d, link, proto, seconds):
+	pre = 'dtls:' if proto == 'dtls' else ''
+	a = Node (d, 'a', ['listen %s%s 17001' % (pre, link.addr[0]),
+	                   'dtls_mtu 1400'], link.names[0])
+	b = Node (d, 'b', ['connect %s%s 17001' % (pre, link.addr[0]),
+	                   'dtls_mtu 1400'], link.names[1])
+	ga = gb = None
+	try:
+		ga = a.gate()
+		gb = b.gate()
+		if not converge (ga, gb, inst, mac_a, mac_b): return None
+		ga.payloads (6, 0.5)
+		gb.payloads (6, 0.1)
+		rtt = []
+		sent = 0
+		end = time.time() + seconds
+		next_send = time.time()
+		while time.time() < end + 1.0:
+			now = time.time()
+			if now < end and now >= next_send:
+				gb.packet (inst, mac_a, mac_b,
+				           struct.pack ('!Id', sent, now) + b'.' * 100)
+				sent += 1
+				next_send += interval
+			for p in ga.payloads (6, 0.0005):
+				ga.packet (inst, mac_b, mac_a, p)
+			for p in gb.payloads (6, 0.0005):
+				if len (p) < 12: continue
+				seq, t = struct.unpack ('!Id', p[:12])
+				rtt.append (time.time() - t)
+		return sent, sorted (rtt)
+	finally:
+		for g in (ga, gb):
+			if g: g.close()
+		a.stop()
+		b.stop()
+
+def pct (l, p):
+	return 1000.0 * l[min (len (l) - 1, int (len (l) * p) )]
+
+def main():
+	need_root()
+	seconds = float (sys.argv[1]) if len (sys.argv) > 1 else 10
+	losses = [float (x) for x in sys.argv[2:]] or [0, 0.01, 0.03]
+	d = workdir()
+	print ('loss   proto     p50 ms    p99 ms    max ms   lost')
+	try:
+		for loss in losses:
+			for proto in ('tcp', 'dtls'):
+				link = Link (loss)
+				try: r = measure (d, link, proto, seconds)
+				finally: link.close()
+				if not r or not r[1]:
+					print ('%4.1f%%  %-5s  no connection' %
+					       (100 * loss, proto) )
+					continue
+				sent, rtt = r
+				print ('%4.1f%%  %-5s %9.2f %9.2f %9.2f %5.1f%%' %
+				       (100 * loss, proto, pct (rtt, 0.5), pct (rtt, 0.99),
+				        1000.0 * rtt[-1],
+				        100.0 * (sent - len (rtt) ) / sent) )
+	finally:
+		cleanup (d)
+
+if __name__ == '__main__': main()
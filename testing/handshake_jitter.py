@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+#
+# Forwarding latency of an established link while the node is flooded with
+# incoming TLS handshakes.
+#
+# Two nodes on loopback; a gate client on the connecting one sends a small
+# timestamped packet every few milliseconds, the other one's gate client
+# notes how long it took. Then client processes keep the given number of
+# handshakes open against the listening node (a finished one is closed and
+# replaced by a new one) and the same is measured again. The script prints
+# latency percentiles, jitter (mean difference of consecutive latencies),
+# handshakes finished per second and the most handshakes the node had in
+# progress at once, from its status file.
+#
+# Run it with handshake_threads 0 to see the main loop doing them.
+#
+# usage: testing/handshake_jitter.py [seconds] [in flight] [handshake_threads]
+#
+
+import os, sys, time, struct, socket, ssl, selectors
+import multiprocessing
+sys.path.insert (0, os.path.dirname (os.path.abspath (__file__) ) )
+from cvpn import *
+
+inst = 0x7a150000
+mac_a = b'\x02\x00\x00\x00\x00\x0a'
+mac_b = b'\x02\x00\x00\x00\x00\x0b'
+port = 17701
+interval = 0.005
+clients = 4
+
+def handshakes (d, n, end, done):
+	'''keeps n handshakes open until end, counts the finished ones'''
+	ctx = ssl.SSLContext (ssl.PROTOCOL_TLS_CLIENT)
+	ctx.check_hostname = False
+	ctx.verify_mode = ssl.CERT_NONE
+	ctx.load_cert_chain (os.path.join (d, 'ssl.crt'),
+	                     os.path.join (d, 'ssl.key') )
+	sel = selectors.DefaultSelector()
+	def start():
+		s = socket.socket()
+		s.setblocking (False)
+		s.connect_ex ( ('127.0.0.1', port) )
+		sel.register (s, selectors.EVENT_WRITE)
+	def restart (s):
+		try: sel.unregister (s)
+		except KeyError: pass #failed while being wrapped
+		s.close()
+		start()
+	for i in range (n): start()
+	count = 0
+	while time.time() < end:
+		for k, ev in sel.select (0.1):
+			s = k.fileobj
+			try:
+				if not isinstance (s, ssl.SSLSocket): #connected now
+					sel.unregister (s)
+					s = ctx.wrap_socket (s, do_handshake_on_connect = False)
+					sel.register (s, selectors.EVENT_WRITE)
+				s.do_handshake()
+				count += 1
+				restart (s)
+			except ssl.SSLWantReadError:
+				sel.modify (s, selectors.EVENT_READ)
+			except ssl.SSLWantWriteError:
+				sel.modify (s, selectors.EVENT_WRITE)
+			except (OSError, ssl.SSLError):
+				restart (s)
+	done.put (count)
+
+def in_progress (node):
+	for l in node.status():
+		if l.startswith (' handshakes: ') and 'in progress' in l:
+			return int (l.split()[1])
+	return 0
+
+def latencies (ga, gb, seconds, a):
+	'''one way latencies of probe packets, peak of handshakes in progress'''
+	lat = []
+	peak = 0
+	end = time.time() + seconds
+	next_send = time.time()
+	while time.time() < end + 0.5:
+		now = time.time()
+		if now < end and now >= next_send:
+			gb.packet (inst, mac_a, mac_b,
+			           struct.pack ('!d', now) + b'.' * 100)
+			next_send += interval
+			peak = max (peak, in_progress (a) )
+		for p in ga.payloads (6, 0.0005):
+			if len (p) >= 8:
+				lat.append (time.time() - struct.unpack ('!d', p[:8])[0])
+	return lat, peak
+
+def pct (l, p):
+	return l[min (len (l) - 1, int (len (l) * p) )]
+
+def report (name, lat, rate, peak):
+	if not lat:
+		print ('%-6s  no packets' % name)
+		return
+	jitter = sum ([abs (lat[i] - lat[i - 1]) for i in range (1, len (lat) )])
+	jitter /= max (1, len (lat) - 1)
+	l = sorted (lat)
+	print ('%-6s %7.2f %7.2f %7.2f %7.2f %8.0f %6d' %
+	       (name, 1000 * pct (l, 0.5), 1000 * pct (l, 0.99), 1000 * l[-1],
+	        1000 * jitter, rate, peak) )
+
+def main():
+	seconds = float (sys.argv[1]) if len (sys.argv) > 1 else 5
+	n = int (sys.argv[2]) if len (sys.argv) > 2 else 500
+	conf = ['status-interval 20000', 'max_handshakes %d' % (n + 100),
+	        'max_connections %d' % (4 * n + 100)]
+	if len (sys.argv) > 3: conf.append ('handshake_threads ' + sys.argv[3])
+	d = workdir()
+	a = Node (d, 'a', conf + ['listen 127.0.0.1 %d' % port])
+	time.sleep (0.3)
+	b = Node (d, 'b', conf + ['connect 127.0.0.1 %d' % port])
+	ga = gb = None
+	procs = []
+	try:
+		ga = a.gate()
+		gb = b.gate()
+		if not converge (ga, gb, inst, mac_a, mac_b):
+			print ('nodes did not connect')
+			sys.exit (1)
+		ga.payloads (6, 0.5)
+
+		print ('        latency ms                    handshakes')
+		print ('         p50     p99     max  jitter      /s   peak')
+		lat, peak = latencies (ga, gb, seconds, a)
+		report ('idle', lat, 0, peak)
+
+		done = multiprocessing.Queue()
+		end = time.time() + seconds + 2
+		procs = [multiprocessing.Process (target = handshakes,
+		                                  args = (d, n // clients, end, done) )
+		         for i in range (clients)]
+		for p in procs: p.start()
+		time.sleep (1) #let the handshakes pile up
+		lat, peak = latencies (ga, gb, seconds, a)
+		count = sum ([done.get (timeout = 10) for p in procs])
+		report ('storm', lat, count / (seconds + 2), peak)
+	finally:
+		for p in procs: p.join()
+		for g in (ga, gb):
+			if g: g.close()
+		b.stop()
+		a.stop()
+		cleanup (d)
+
+if __name__ == '__main__': main()
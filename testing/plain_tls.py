@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+#
+# Loopback throughput and CPU cost of a link that stays in GnuTLS, one with
+# records offloaded to kernel TLS ("ktls yes", both nodes) and one that
+# goes on in plaintext after the handshake ("plain:address"). Traffic is
+# the same as in bundle_streams.py; CPU is what both nodes took per MB
+# that came through. The kernel TLS row is only printed when both nodes
+# really offloaded both directions (needs the tls module).
+#
+# usage: testing/plain_tls.py [seconds]
+#
+
+import os, sys, time
+sys.path.insert (0, os.path.dirname (os.path.abspath (__file__) ) )
+from cvpn import *
+
+inst = 0x91a10000
+mac_a = b'\x02\x00\x00\x00\x00\x0a'
+mac_b = b'\x02\x00\x00\x00\x00\x0b'
+port = 17401
+
+def offloaded (d, name):
+	log = open (os.path.join (d, name + '.log') ).read()
+	return 'uses kernel TLS for sending receiving' in log
+
+def measure (d, prefix, conf, seconds):
+	addr = '%s127.0.0.1 %d' % (prefix, port)
+	a = Node (d, 'a', conf + ['listen ' + addr])
+	time.sleep (0.3)
+	b = Node (d, 'b', conf + ['connect ' + addr])
+	ga = gb = None
+	try:
+		ga = a.gate()
+		gb = b.gate()
+		if not converge (ga, gb, inst, mac_a, mac_b): return None
+		cpu = a.cpu() + b.cpu()
+		r = throughput (gb, ga, inst, mac_a, mac_b, seconds)
+		return r, (a.cpu() + b.cpu() - cpu) / (r * seconds / 1e12)
+	finally:
+		for g in (ga, gb):
+			if g: g.close()
+		b.stop()
+		a.stop()
+
+def main():
+	seconds = float (sys.argv[1]) if len (sys.argv) > 1 else 5
+	d = workdir()
+	print ('link       MB/s  CPU us/MB')
+	try:
+		for name, prefix, conf in ( ('tls', '', []),
+		                            ('ktls', '', ['ktls yes']),
+		                            ('plain', 'plain:', []) ):
+			r = measure (d, prefix, conf, seconds)
+			if r is None: print ('%-6s  no connection' % name)
+			elif conf and not (offloaded (d, 'a') and offloaded (d, 'b') ):
+				print ('%-6s  kernel TLS unavailable' % name)
+			else: print ('%-6s %7.1f %10.0f' % (name, r[0] / 1e6, r[1]) )
+	finally:
+		cleanup (d)
+
+if __name__ == '__main__': main()